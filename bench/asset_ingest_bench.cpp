@@ -0,0 +1,439 @@
+﻿#include "model.h"
+#include <png.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Asset ingest throughput: generates synthetic OBJ files in every face format
+// and PNGs of several sizes and colour types, then times each loader on them.
+//
+//   asset_ingest_bench [--loader name]... [--faces N] [--png-size N]...
+//                      [--repeats N] [--dir path] [--keep]
+//
+// Reported per loader and file: best-of-N time, MB/s of file data, faces/s
+// (OBJ) or Mpix/s (PNG), the peak resident set added while loading and the
+// operator new calls and bytes per load, aligned allocations (the model and
+// texture storage) included. Allocations made with malloc inside
+// libpng and zlib are not counted; their peak memory is in the RSS column.
+// Files are read once before timing so every run sees a warm page cache.
+//
+// Loaders are listed in kLoaders; a parser or decoder variant is one more
+// entry there and is compared against the others on the same files.
+
+namespace {
+
+std::atomic<size_t> g_allocations{ 0 };
+std::atomic<size_t> g_allocated_bytes{ 0 };
+
+// Every replacement below goes through these two. They are kept out of line
+// so the compiler does not pair an inlined free() with operator new.
+[[gnu::noinline]] void* countedAlloc(size_t size, size_t align) noexcept {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (align <= alignof(std::max_align_t)) return std::malloc(size);
+    // aligned_alloc wants a multiple of the alignment
+    return std::aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+[[gnu::noinline]] void countedFree(void* p) noexcept { std::free(p); }
+
+void* countedAllocOrThrow(size_t size, size_t align) {
+    if (void* p = countedAlloc(size, align)) return p;
+    throw std::bad_alloc();
+}
+
+}
+
+void* operator new(size_t size) { return countedAllocOrThrow(size, 0); }
+void* operator new[](size_t size) { return countedAllocOrThrow(size, 0); }
+void* operator new(size_t size, std::align_val_t align) { return countedAllocOrThrow(size, static_cast<size_t>(align)); }
+void* operator new[](size_t size, std::align_val_t align) { return countedAllocOrThrow(size, static_cast<size_t>(align)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return countedAlloc(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return countedAlloc(size, static_cast<size_t>(align));
+}
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { countedFree(p); }
+
+namespace {
+
+enum class AssetKind {
+    Obj,
+    Png,
+};
+
+struct SourceFile {
+    AssetKind kind;
+    std::string label;
+    std::string path;
+    size_t bytes = 0;
+    size_t items = 0;   // faces in the file, or pixels
+};
+
+struct Loader {
+    const char* name;
+    AssetKind kind;
+    // loads the file and returns a value derived from the result so the work
+    // cannot be dropped
+    std::function<size_t(const std::string&)> load;
+};
+
+const std::vector<Loader> kLoaders = {
+    { "loadModel", AssetKind::Obj, [](const std::string& path) {
+        model::Model m = model::loadModel(path);
+        return m.verticle_idx.size() + m.vertices.size();
+    } },
+    { "loadTexture", AssetKind::Png, [](const std::string& path) {
+        texture::Texture t = texture::loadTexture(path);
+        return t.data.size() + (t.data.empty() ? 0 : t.data[0]);
+    } },
+    { "loadTexture/tiled8", AssetKind::Png, [](const std::string& path) {
+        texture::Texture t = texture::loadTexture(path, texture::Layout::Tiled8x8);
+        return t.data.size() + (t.data.empty() ? 0 : t.data[0]);
+    } },
+};
+
+// Grid of (n + 1)^2 vertices, each with a texcoord and a normal, and faces
+// over it in one of the face formats. Returns the number of faces written.
+size_t writeObj(const std::string& path, const std::string& format, size_t target_faces) {
+    const int per_cell = format == "quad" ? 1 : format == "ngon" ? 0 : 2;
+    // n-gons take two cells each
+    const size_t cells = per_cell ? target_faces / per_cell : target_faces * 2;
+    const int n = std::max(2, static_cast<int>(std::sqrt(static_cast<double>(cells))) & ~1);
+
+    std::ofstream out(path, std::ios::binary);
+    char line[160];
+    for (int y = 0; y <= n; ++y) {
+        for (int x = 0; x <= n; ++x) {
+            const float h = 0.05f * std::sin(x * 0.3f) * std::cos(y * 0.2f);
+            out.write(line, std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n",
+                                          x / static_cast<float>(n) - 0.5f, h, y / static_cast<float>(n) - 0.5f));
+        }
+    }
+    for (int y = 0; y <= n; ++y) {
+        for (int x = 0; x <= n; ++x)
+            out.write(line, std::snprintf(line, sizeof(line), "vt %.6f %.6f\n", x / static_cast<float>(n), y / static_cast<float>(n)));
+    }
+    for (int y = 0; y <= n; ++y) {
+        for (int x = 0; x <= n; ++x) out << "vn 0.000000 1.000000 0.000000\n";
+    }
+
+    auto corner = [&](int x, int y) {
+        const int i = y * (n + 1) + x + 1;
+        if (format == "v") return std::to_string(i);
+        if (format == "v/vt") return std::to_string(i) + '/' + std::to_string(i);
+        if (format == "v//vn") return std::to_string(i) + "//" + std::to_string(i);
+        return std::to_string(i) + '/' + std::to_string(i) + '/' + std::to_string(i);
+    };
+    size_t faces = 0;
+    for (int y = 0; y < n; ++y) {
+        if (format == "ngon") {
+            // hexagons around two neighbouring cells
+            for (int x = 0; x + 1 < n; x += 2) {
+                out << "f " << corner(x, y) << ' ' << corner(x + 1, y) << ' ' << corner(x + 2, y) << ' '
+                    << corner(x + 2, y + 1) << ' ' << corner(x + 1, y + 1) << ' ' << corner(x, y + 1) << '\n';
+                ++faces;
+            }
+            continue;
+        }
+        for (int x = 0; x < n; ++x) {
+            if (format == "quad") {
+                out << "f " << corner(x, y) << ' ' << corner(x + 1, y) << ' ' << corner(x + 1, y + 1) << ' '
+                    << corner(x, y + 1) << '\n';
+                ++faces;
+            } else {
+                out << "f " << corner(x, y) << ' ' << corner(x + 1, y) << ' ' << corner(x + 1, y + 1) << '\n'
+                    << "f " << corner(x, y) << ' ' << corner(x + 1, y + 1) << ' ' << corner(x, y + 1) << '\n';
+                faces += 2;
+            }
+        }
+    }
+    return out ? faces : 0;
+}
+
+struct PngColor {
+    const char* name;
+    int color_type;
+    int bit_depth;
+};
+
+const PngColor kPngColors[] = {
+    { "gray8", PNG_COLOR_TYPE_GRAY, 8 },
+    { "gray-alpha8", PNG_COLOR_TYPE_GRAY_ALPHA, 8 },
+    { "palette8", PNG_COLOR_TYPE_PALETTE, 8 },
+    { "rgb8", PNG_COLOR_TYPE_RGB, 8 },
+    { "rgba8", PNG_COLOR_TYPE_RGBA, 8 },
+    { "rgb16", PNG_COLOR_TYPE_RGB, 16 },
+};
+
+// Gradients with a little noise: compresses like a photo texture rather
+// than like a flat colour.
+bool writePng(const std::string& path, int size, const PngColor& color) {
+    std::unique_ptr<FILE, texture::FileCloser> file(std::fopen(path.c_str(), "wb"));
+    if (!file) return false;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (!info) {
+        png_destroy_write_struct(&png, nullptr);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+    png_init_io(png, file.get());
+    png_set_IHDR(png, info, size, size, color.bit_depth, color.color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    std::vector<png_color> palette(256);
+    if (color.color_type == PNG_COLOR_TYPE_PALETTE) {
+        for (int i = 0; i < 256; ++i)
+            palette[i] = { static_cast<png_byte>(i), static_cast<png_byte>(255 - i), static_cast<png_byte>(i * 7) };
+        png_set_PLTE(png, info, palette.data(), 256);
+    }
+    png_write_info(png, info);
+    if (color.bit_depth == 16) png_set_swap(png);
+
+    const int channels = png_get_channels(png, info);
+    const int bytes = color.bit_depth / 8;
+    std::vector<uint8_t> row(static_cast<size_t>(size) * channels * bytes);
+    uint32_t seed = 0x9E3779B9u;
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            const int noise = static_cast<int>(seed >> 28);
+            for (int c = 0; c < channels; ++c) {
+                const int base = c == 3 || (c == 1 && channels == 2) ? 255 - (x * 64 / size) : ((x + y * (c + 1)) * 255 / (2 * size));
+                const int v = std::clamp(base + noise - 8, 0, 255);
+                uint8_t* p = row.data() + (static_cast<size_t>(x) * channels + c) * bytes;
+                p[0] = static_cast<uint8_t>(v);
+                if (bytes == 2) p[1] = static_cast<uint8_t>(seed >> 8);
+            }
+        }
+        png_write_row(png, row.data());
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+// Peak resident set tracking. On Linux the high-water mark can be reset
+// (clear_refs "5"), which gives the peak of a single load; elsewhere the
+// process-wide maximum from getrusage is all there is. Free heap memory is
+// handed back first so a load cannot hide in pages an earlier one touched.
+class PeakRss {
+private:
+    bool resettable_ = false;
+
+    static long procStatusKiB(const char* field) {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        const size_t len = std::strlen(field);
+        while (std::getline(status, line)) {
+            if (line.compare(0, len, field) == 0) return std::atol(line.c_str() + len + 1);
+        }
+        return -1;
+    }
+
+public:
+    PeakRss() {
+        std::ofstream clear("/proc/self/clear_refs");
+        resettable_ = clear && (clear << "5").flush() && procStatusKiB("VmHWM") >= 0;
+    }
+
+    bool resettable() const { return resettable_; }
+
+    // resident KiB now; starts a new high-water mark where supported
+    long begin() const {
+#ifdef __GLIBC__
+        ::malloc_trim(0);
+#endif
+        if (resettable_) std::ofstream("/proc/self/clear_refs") << "5";
+        return resettable_ ? procStatusKiB("VmRSS") : 0;
+    }
+
+    long peakKiB() const {
+        if (resettable_) return procStatusKiB("VmHWM");
+        rusage usage{};
+        ::getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+};
+
+// Sends stdout to /dev/null while the loaders print their progress lines.
+class QuietStdout {
+private:
+    int saved_;
+
+public:
+    QuietStdout() {
+        std::cout.flush();
+        std::fflush(stdout);
+        saved_ = ::dup(STDOUT_FILENO);
+        const int null = ::open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            ::dup2(null, STDOUT_FILENO);
+            ::close(null);
+        }
+    }
+    ~QuietStdout() {
+        std::cout.flush();
+        std::fflush(stdout);
+        if (saved_ >= 0) {
+            ::dup2(saved_, STDOUT_FILENO);
+            ::close(saved_);
+        }
+    }
+};
+
+struct Measurement {
+    double best_ms = 1e30;
+    long peak_kib = 0;
+    size_t allocations = 0;
+    size_t allocated_bytes = 0;
+    size_t checksum = 0;
+};
+
+Measurement measure(const Loader& loader, const SourceFile& file, int repeats, const PeakRss& rss) {
+    Measurement m;
+    QuietStdout quiet;
+    m.checksum = loader.load(file.path); // warms the page cache
+    for (int r = 0; r < repeats; ++r) {
+        const long base_kib = rss.begin();
+        const size_t allocations = g_allocations.load(), bytes = g_allocated_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        m.checksum += loader.load(file.path);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        m.best_ms = std::min(m.best_ms, ms);
+        m.allocations = g_allocations.load() - allocations;
+        m.allocated_bytes = g_allocated_bytes.load() - bytes;
+        m.peak_kib = std::max(m.peak_kib, rss.peakKiB() - base_kib);
+    }
+    return m;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> loader_names;
+    std::vector<int> png_sizes;
+    size_t faces = 200000;
+    int repeats = 5;
+    bool keep = false;
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "asset_ingest_bench";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--loader" && i + 1 < argc) loader_names.push_back(argv[++i]);
+        else if (arg == "--faces" && i + 1 < argc) faces = std::max<size_t>(8, std::stoul(argv[++i]));
+        else if (arg == "--png-size" && i + 1 < argc) png_sizes.push_back(std::max(1, std::stoi(argv[++i])));
+        else if (arg == "--repeats" && i + 1 < argc) repeats = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--dir" && i + 1 < argc) dir = argv[++i];
+        else if (arg == "--keep") keep = true;
+        else {
+            std::fprintf(stderr, "usage: asset_ingest_bench [--loader name]... [--faces N] [--png-size N]... "
+                                 "[--repeats N] [--dir path] [--keep]\nloaders:");
+            for (const Loader& l : kLoaders) std::fprintf(stderr, " %s", l.name);
+            std::fprintf(stderr, "\n");
+            return 2;
+        }
+    }
+    if (png_sizes.empty()) png_sizes = { 256, 1024, 2048 };
+
+    std::vector<const Loader*> loaders;
+    for (const Loader& l : kLoaders) {
+        if (loader_names.empty() || std::find(loader_names.begin(), loader_names.end(), l.name) != loader_names.end())
+            loaders.push_back(&l);
+    }
+    if (loaders.empty()) {
+        std::fprintf(stderr, "no such loader\n");
+        return 2;
+    }
+    auto wanted = [&](AssetKind kind) {
+        return std::any_of(loaders.begin(), loaders.end(), [&](const Loader* l) { return l->kind == kind; });
+    };
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    std::vector<SourceFile> files;
+    if (wanted(AssetKind::Obj)) {
+        for (const char* format : { "v", "v/vt", "v//vn", "v/vt/vn", "quad", "ngon" }) {
+            std::string name = format;
+            std::replace(name.begin(), name.end(), '/', '_');
+            SourceFile f{ AssetKind::Obj, std::string("obj ") + format, (dir / ("mesh_" + name + ".obj")).string() };
+            f.items = writeObj(f.path, format, faces);
+            if (f.items) files.push_back(f);
+        }
+    }
+    if (wanted(AssetKind::Png)) {
+        for (int size : png_sizes) {
+            for (const PngColor& color : kPngColors) {
+                SourceFile f{ AssetKind::Png, "png " + std::to_string(size) + ' ' + color.name,
+                              (dir / ("tex_" + std::to_string(size) + '_' + color.name + ".png")).string() };
+                f.items = static_cast<size_t>(size) * size;
+                if (writePng(f.path, size, color)) files.push_back(f);
+            }
+        }
+    }
+    for (SourceFile& f : files) f.bytes = std::filesystem::file_size(f.path, ec);
+    if (files.empty()) {
+        std::fprintf(stderr, "cannot write test files to %s\n", dir.string().c_str());
+        return 1;
+    }
+
+    const PeakRss rss;
+    std::printf("best of %d, files in %s, peak RSS %s\n", repeats, dir.string().c_str(),
+                rss.resettable() ? "per load" : "process-wide (no clear_refs)");
+    std::printf("%-20s %-22s %9s %9s %9s %12s %10s %9s %10s\n", "loader", "file", "KiB", "ms", "MB/s",
+                "faces|pix/s", "peak KiB", "allocs", "alloc KiB");
+    size_t checksum = 0;
+    for (const Loader* loader : loaders) {
+        for (const SourceFile& f : files) {
+            if (f.kind != loader->kind) continue;
+            const Measurement m = measure(*loader, f, repeats, rss);
+            checksum += m.checksum;
+            std::printf("%-20s %-22s %9.1f %9.3f %9.1f %11.2fM %10ld %9zu %10.1f\n", loader->name, f.label.c_str(),
+                        f.bytes / 1024.0, m.best_ms, f.bytes / 1e3 / m.best_ms, f.items / 1e3 / m.best_ms, m.peak_kib,
+                        m.allocations, m.allocated_bytes / 1024.0);
+        }
+    }
+    std::printf("checksum %zx\n", checksum);
+
+    if (!keep) {
+        for (const SourceFile& f : files) std::filesystem::remove(f.path, ec);
+        std::filesystem::remove(dir, ec);
+    }
+    return 0;
+}
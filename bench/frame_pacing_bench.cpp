@@ -0,0 +1,76 @@
+﻿#include "timer.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+// Frame pacing accuracy against CPU cost for each PacingMode: paces a fixed
+// frame rate with a simulated render workload and reports how late the
+// frames woke up and how much of the core the waiting used.
+//
+//   frame_pacing_bench [fps] [frames] [work_ms]
+
+namespace {
+
+// Busy work standing in for rendering a frame.
+void simulateWork(double ms, volatile double& sink) {
+    const auto end = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(ms);
+    double x = sink;
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 256; ++i) x = x * 1.0000001 + 0.5;
+    }
+    sink = x;
+}
+
+const char* modeName(PacingMode mode) {
+    switch (mode) {
+    case PacingMode::Spin: return "spin";
+    case PacingMode::Hybrid: return "hybrid";
+    case PacingMode::Sleep: return "sleep";
+    }
+    return "?";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    const int fps = argc > 1 ? std::max(1, std::stoi(argv[1])) : 60;
+    const int frames = argc > 2 ? std::max(1, std::stoi(argv[2])) : 300;
+    const double work_ms = argc > 3 ? std::stod(argv[3]) : 4.0;
+
+    struct Config {
+        PacingMode mode;
+        double safety;
+    };
+    const Config configs[] = {
+        { PacingMode::Spin, 0 }, { PacingMode::Hybrid, 1 }, { PacingMode::Hybrid, 3 },
+        { PacingMode::Hybrid, 6 }, { PacingMode::Sleep, 0 },
+    };
+
+    std::printf("%d fps, %d frames, %.1f ms work per frame\n", fps, frames, work_ms);
+    std::printf("%-8s %6s %10s %10s %10s %10s %12s %10s %8s\n", "mode", "safety", "mean us", "p50 us", "p99 us",
+                "max us", "overshoot us", "busy ms/f", "cpu %");
+    volatile double sink = 1.0;
+    for (const Config& c : configs) {
+        RenderTimer timer(fps);
+        PacingOptions options;
+        options.mode = c.mode;
+        options.safety = c.safety;
+        timer.setPacing(options);
+
+        const std::clock_t cpu_start = std::clock();
+        const auto wall_start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; ++f) {
+            simulateWork(work_ms, sink);
+            timer.waitIfNeeded();
+        }
+        const double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_start).count();
+        const double cpu_ms = 1000.0 * static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+        const PacingStats s = timer.getPacingStats();
+        std::printf("%-8s %6.1f %10.1f %10.1f %10.1f %10.1f %12.1f %10.3f %8.1f\n", modeName(c.mode), c.safety,
+                    s.mean_error_us, s.p50_error_us, s.p99_error_us, s.max_error_us, s.overshoot_us,
+                    s.frames ? s.busy_ms / s.frames : 0.0, 100.0 * cpu_ms / wall_ms);
+    }
+    return 0;
+}
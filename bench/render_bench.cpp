@@ -0,0 +1,383 @@
+﻿#include "linear.h"
+#include "graph.h"
+#include "model.h"
+#include "render.h"
+#include "camera.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reproducible rendering benchmark: procedural scenes rendered along scripted
+// camera paths, no window, input or asset files.
+//
+//   render_bench [--scene name]... [--res WxH]... [--threads N]... [--frames N]
+//                [--repeats N] [--json file|-] [--replay input.txt] [--pin] [--pool-stats]
+//
+// Every scene/resolution/thread count combination renders the path's frames
+// (transform + render) and keeps the best of --repeats runs. Frames are drawn
+// one after another; with N threads the calling thread and N - 1 pool
+// workers share each frame's transform, setup and tile raster jobs, so
+// ms/frame is the frame latency. --pin binds the pool workers to CPUs,
+// --pool-stats prints each worker's jobs, steals, queue depth and busy/idle
+// time over the timed runs below the case's row.
+//
+// Mtri/s counts submitted triangles, Mpix/s covered pixels (fragments that
+// reached the depth test), both from an untimed pass with RasterDiagnostics.
+//
+// --replay flies every scene along a recorded camera path instead (see
+// InputRecorder, e.g. the viewer's --record), one frame per timestep of the
+// recording, so before/after runs see exactly the same views.
+
+namespace {
+
+struct Scene {
+    std::string name;
+    std::string description;
+    model::Model model;
+    // camera position and target at t in [0, 1)
+    std::function<std::pair<vec3, vec3>(float)> path;
+};
+
+// Assembles a model from positions, normals and texcoords shared by index.
+model::Model makeModel(std::vector<vec3> positions, std::vector<vec3> normals, std::vector<Point2D> uvs,
+                       const std::vector<model::Triangle>& triangles) {
+    model::Model m;
+    m.vertices = std::move(positions);
+    m.vertex_norm = std::move(normals);
+    m.texcoords = std::move(uvs);
+    m.verticle_idx = triangles;
+    m.texture_idx = triangles;
+    m.normal_idx = triangles;
+    model::Material material;
+    material.name = "procedural";
+    m.materials.push_back(material);
+    m.material_ranges.push_back({ 0, 0, triangles.size() });
+    m.transfromed_vertices.resize(m.vertices.size());
+    m.mesh = model::to_soa(m.vertices);
+    m.isLoaded = true;
+    return m;
+}
+
+// UV sphere of radius 1 with the given rings and segments.
+model::Model makeSphere(int rings, int segments) {
+    std::vector<vec3> positions, normals;
+    std::vector<Point2D> uvs;
+    for (int r = 0; r <= rings; ++r) {
+        const float theta = static_cast<float>(PI) * r / rings;
+        for (int s = 0; s <= segments; ++s) {
+            const float phi = 2.f * static_cast<float>(PI) * s / segments;
+            vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            positions.push_back(n);
+            normals.push_back(n);
+            uvs.emplace_back(static_cast<float>(s) / segments, static_cast<float>(r) / rings);
+        }
+    }
+    std::vector<model::Triangle> triangles;
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            const unsigned a = r * (segments + 1) + s, b = a + segments + 1;
+            triangles.emplace_back(a, b, a + 1);
+            triangles.emplace_back(a + 1, b, b + 1);
+        }
+    }
+    return makeModel(std::move(positions), std::move(normals), std::move(uvs), triangles);
+}
+
+// n x n quads covering [-size, size]^2 in the z = depth plane.
+void appendGrid(std::vector<vec3>& positions, std::vector<vec3>& normals, std::vector<Point2D>& uvs,
+                std::vector<model::Triangle>& triangles, int n, float size, float depth) {
+    const unsigned base = static_cast<unsigned>(positions.size());
+    for (int y = 0; y <= n; ++y) {
+        for (int x = 0; x <= n; ++x) {
+            positions.emplace_back(-size + 2.f * size * x / n, -size + 2.f * size * y / n, depth);
+            normals.emplace_back(0.f, 0.f, 1.f);
+            uvs.emplace_back(static_cast<float>(x) / n, static_cast<float>(y) / n);
+        }
+    }
+    for (int y = 0; y < n; ++y) {
+        for (int x = 0; x < n; ++x) {
+            const unsigned a = base + y * (n + 1) + x, b = a + n + 1;
+            triangles.emplace_back(a, a + 1, b);
+            triangles.emplace_back(a + 1, b + 1, b);
+        }
+    }
+}
+
+model::Model makeGrid(int n, float size) {
+    std::vector<vec3> positions, normals;
+    std::vector<Point2D> uvs;
+    std::vector<model::Triangle> triangles;
+    appendGrid(positions, normals, uvs, triangles, n, size, 0.f);
+    return makeModel(std::move(positions), std::move(normals), std::move(uvs), triangles);
+}
+
+// layers full-screen quads one behind the other, drawn back to front so
+// every layer passes the depth test.
+model::Model makeOverdrawStack(int layers) {
+    std::vector<vec3> positions, normals;
+    std::vector<Point2D> uvs;
+    std::vector<model::Triangle> triangles;
+    for (int i = 0; i < layers; ++i) appendGrid(positions, normals, uvs, triangles, 1, 2.f, -1.f + static_cast<float>(i) / layers);
+    return makeModel(std::move(positions), std::move(normals), std::move(uvs), triangles);
+}
+
+// Long, thin triangles fanned across the view: big bounding boxes, few
+// covered pixels.
+model::Model makeSlivers(int count) {
+    std::vector<vec3> positions, normals;
+    std::vector<Point2D> uvs;
+    std::vector<model::Triangle> triangles;
+    for (int i = 0; i < count; ++i) {
+        const float a = static_cast<float>(PI) * i / count;
+        const float da = static_cast<float>(PI) / count * 0.25f;
+        const unsigned base = static_cast<unsigned>(positions.size());
+        positions.emplace_back(-1.5f * std::cos(a), -1.5f * std::sin(a), 0.f);
+        positions.emplace_back(1.5f * std::cos(a), 1.5f * std::sin(a), 0.f);
+        positions.emplace_back(1.5f * std::cos(a + da), 1.5f * std::sin(a + da), 0.f);
+        for (int k = 0; k < 3; ++k) normals.emplace_back(0.f, 0.f, 1.f);
+        uvs.emplace_back(0.f, 0.f);
+        uvs.emplace_back(1.f, 0.f);
+        uvs.emplace_back(1.f, 1.f);
+        triangles.emplace_back(base, base + 1, base + 2);
+    }
+    return makeModel(std::move(positions), std::move(normals), std::move(uvs), triangles);
+}
+
+texture::Texture makeCheckerTexture(int size) {
+    texture::Texture tex;
+    tex.width = size;
+    tex.height = size;
+    tex.data.resize(static_cast<size_t>(size) * size);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            const bool dark = ((x / 16) ^ (y / 16)) & 1;
+            tex.data[static_cast<size_t>(y) * size + x] = dark ? texture::packRGBA(40, 40, 60) : texture::packRGBA(220, 200, 160);
+        }
+    }
+    texture::buildMipChain(tex);
+    tex.filter = texture::Filter::Bilinear;
+    tex.isLoaded = true;
+    return tex;
+}
+
+std::vector<Scene> makeScenes() {
+    auto orbit = [](float radius, float height) {
+        return [=](float t) {
+            const float a = 2.f * static_cast<float>(PI) * t;
+            return std::make_pair(vec3(radius * std::sin(a), height, radius * std::cos(a)), vec3(0, 0, 0));
+        };
+    };
+    auto dolly = [](float from, float to) {
+        return [=](float t) {
+            const float z = from + (to - from) * (0.5f - 0.5f * std::cos(2.f * static_cast<float>(PI) * t));
+            return std::make_pair(vec3(0.3f, 0.2f, z), vec3(0, 0, 0));
+        };
+    };
+    std::vector<Scene> scenes;
+    scenes.push_back({ "sphere", "UV sphere, 64x32 segments, orbit", makeSphere(32, 64), orbit(3.f, 1.f) });
+    scenes.push_back({ "sphere_dense", "UV sphere, 512x256 segments, orbit", makeSphere(256, 512), orbit(3.f, 1.f) });
+    scenes.push_back({ "grid", "64x64 quad plane, dolly", makeGrid(64, 2.f), dolly(1.5f, 6.f) });
+    scenes.push_back({ "slivers", "4096 thin triangles across the view, dolly", makeSlivers(4096), dolly(2.f, 4.f) });
+    scenes.push_back({ "overdraw", "16 stacked full-screen quads, back to front, dolly", makeOverdrawStack(16), dolly(3.f, 5.f) });
+    scenes.push_back({ "micro", "512x512 quads in a small patch, sub-pixel triangles, orbit", makeGrid(512, 0.5f), orbit(4.f, 0.5f) });
+    return scenes;
+}
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+struct Result {
+    std::string scene;
+    Resolution res;
+    unsigned threads;
+    int frames;
+    double ms_per_frame;       // wall time / frames, best run
+    double mtri_per_s;
+    double mpix_per_s;
+    double triangles_per_frame;
+    double covered_per_frame;
+    std::string pool_report;   // per-worker scheduler statistics of the timed runs
+};
+
+// Framebuffer and clip-space vertices of one frame.
+struct Context {
+    Picture image;
+    Matrix depth;
+    std::vector<vec4> clip;
+    Context(int w, int h) : image(w, h, PictureFormat::RGBA8), depth(h, w) {}
+};
+
+// View matrices of a recorded fly-through, one per frame, from the same
+// camera the viewer starts with.
+std::vector<Matrix> replayViews(const std::string& path) {
+    InputPlayer player(path);
+    Camera camera(static_cast<float>(PI) / 2.f, 1.f, 1.f, 20.f, vec3(0, 0, 4), vec3(0, 0, 0), vec3(0, -1, 0));
+    std::vector<Matrix> views;
+    while (!player.finished()) {
+        player.update();
+        camera.update(player, static_cast<float>(player.timestep()));
+        views.push_back(camera.view_matrix());
+    }
+    return views;
+}
+
+// replay, if not empty, replaces the scene's scripted path.
+Matrix frameMVP(const Scene& scene, const std::vector<Matrix>& replay, Resolution res, int frame, int frames) {
+    const Matrix projection = getPerspectiveMatrix(60.f * static_cast<float>(PI) / 180.f,
+                                                   static_cast<float>(res.width) / res.height, 0.1f, 50.f);
+    if (!replay.empty()) return projection * replay[frame];
+    auto [eye, target] = scene.path(static_cast<float>(frame) / frames);
+    return projection * getViewMatrix(eye, target, vec3(0, 1, 0));
+}
+
+Result runCase(const Scene& scene, const std::vector<Matrix>& replay, const std::vector<DrawBatch>& batches,
+               Resolution res, unsigned threads, int frames, int repeats, bool pin) {
+    Result result{ scene.name, res, threads, frames, 0, 0, 0, 0, 0, {} };
+
+    // counts from an untimed pass so the timed runs carry no diagnostics
+    Context counting(res.width, res.height);
+    RasterDiagnostics diagnostics;
+    RasterStats totals;
+    for (int f = 0; f < frames; ++f) {
+        model::transformModel(scene.model, frameMVP(scene, replay, res, f, frames), counting.clip);
+        render(scene.model, counting.clip, batches, counting.image, counting.depth, nullptr, &diagnostics);
+        totals += diagnostics.stats;
+    }
+    result.triangles_per_frame = static_cast<double>(totals.triangles) / frames;
+    result.covered_per_frame = static_cast<double>(totals.covered_pixels) / frames;
+
+    Context c(res.width, res.height);
+    ThreadPool pool(threads - 1, pin);
+    double best_ms = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; ++f) {
+            model::transformModel(scene.model, frameMVP(scene, replay, res, f, frames), c.clip, pool);
+            render(scene.model, c.clip, batches, c.image, c.depth, nullptr, nullptr, pool);
+        }
+        best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    result.pool_report = pool.statsReport();
+    result.ms_per_frame = best_ms / frames;
+    result.mtri_per_s = result.triangles_per_frame / result.ms_per_frame / 1000.0;
+    result.mpix_per_s = result.covered_per_frame / result.ms_per_frame / 1000.0;
+    return result;
+}
+
+bool writeJson(const std::vector<Result>& results, int frames, int repeats, const std::string& path) {
+    FILE* out = path == "-" ? stdout : std::fopen(path.c_str(), "w");
+    if (!out) return false;
+    std::fprintf(out, "{\n  \"benchmark\": \"render_bench\",\n  \"frames\": %d,\n  \"repeats\": %d,\n"
+                      "  \"hardware_threads\": %u,\n  \"results\": [\n",
+                 frames, repeats, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        std::fprintf(out, "    {\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %u, "
+                          "\"ms_per_frame\": %.4f, \"mtri_per_s\": %.3f, \"mpix_per_s\": %.3f, "
+                          "\"triangles_per_frame\": %.0f, \"covered_pixels_per_frame\": %.0f}%s\n",
+                     r.scene.c_str(), r.res.width, r.res.height, r.threads, r.ms_per_frame, r.mtri_per_s,
+                     r.mpix_per_s, r.triangles_per_frame, r.covered_per_frame, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(out, "  ]\n}\n");
+    const bool ok = std::ferror(out) == 0;
+    if (out != stdout) std::fclose(out);
+    return ok;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> scene_names;
+    std::vector<Resolution> resolutions;
+    std::vector<unsigned> thread_counts;
+    int frames = 60;
+    int repeats = 3;
+    std::string json_path, replay_path;
+    bool pin = false, pool_stats = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--scene" && i + 1 < argc) scene_names.push_back(argv[++i]);
+        else if (arg == "--res" && i + 1 < argc) {
+            Resolution r{};
+            if (std::sscanf(argv[++i], "%dx%d", &r.width, &r.height) != 2 || r.width <= 0 || r.height <= 0) {
+                std::fprintf(stderr, "invalid resolution %s\n", argv[i]);
+                return 2;
+            }
+            resolutions.push_back(r);
+        }
+        else if (arg == "--threads" && i + 1 < argc) thread_counts.push_back(static_cast<unsigned>(std::max(1, std::stoi(argv[++i]))));
+        else if (arg == "--frames" && i + 1 < argc) frames = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--repeats" && i + 1 < argc) repeats = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--json" && i + 1 < argc) json_path = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replay_path = argv[++i];
+        else if (arg == "--pin") pin = true;
+        else if (arg == "--pool-stats") pool_stats = true;
+        else {
+            std::fprintf(stderr, "usage: render_bench [--scene name]... [--res WxH]... [--threads N]... "
+                                 "[--frames N] [--repeats N] [--json file|-] [--replay input.txt] [--pin] [--pool-stats]\n");
+            return 2;
+        }
+    }
+    if (resolutions.empty()) resolutions = { {320, 240}, {1280, 720}, {1920, 1080} };
+    if (thread_counts.empty()) {
+        thread_counts = { 1 };
+        if (std::thread::hardware_concurrency() > 1) thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+
+    std::vector<Matrix> replay;
+    if (!replay_path.empty()) {
+        try {
+            replay = replayViews(replay_path);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        frames = static_cast<int>(replay.size());
+    }
+
+    const texture::Texture checker = makeCheckerTexture(512);
+    std::vector<Scene> scenes = makeScenes();
+    if (!scene_names.empty()) {
+        std::erase_if(scenes, [&](const Scene& s) {
+            return std::find(scene_names.begin(), scene_names.end(), s.name) == scene_names.end();
+        });
+        if (scenes.empty()) {
+            std::fprintf(stderr, "no such scene\n");
+            return 2;
+        }
+    }
+
+    // with the table on stdout the JSON goes elsewhere and vice versa
+    FILE* table = json_path == "-" ? stderr : stdout;
+    std::fprintf(table, "%d frames per %s, best of %d\n", frames, replay.empty() ? "path" : "replay", repeats);
+    std::fprintf(table, "%-13s %11s %7s %10s %9s %9s %10s %12s\n", "scene", "resolution", "threads", "ms/frame",
+                 "Mtri/s", "Mpix/s", "tri/frame", "pix/frame");
+    std::vector<Result> results;
+    for (const Scene& scene : scenes) {
+        const std::vector<DrawBatch> batches{ {&checker, vec3(255, 255, 255), 0, scene.model.triangleCount()} };
+        for (Resolution res : resolutions) {
+            for (unsigned threads : thread_counts) {
+                Result r = runCase(scene, replay, batches, res, threads, frames, repeats, pin);
+                char resolution[24];
+                std::snprintf(resolution, sizeof(resolution), "%dx%d", res.width, res.height);
+                std::fprintf(table, "%-13s %11s %7u %10.3f %9.2f %9.2f %10.0f %12.0f\n", r.scene.c_str(), resolution,
+                             r.threads, r.ms_per_frame, r.mtri_per_s, r.mpix_per_s, r.triangles_per_frame, r.covered_per_frame);
+                if (pool_stats && threads > 1) std::fprintf(table, "%s", r.pool_report.c_str());
+                results.push_back(r);
+            }
+        }
+    }
+    if (!json_path.empty() && !writeJson(results, frames, repeats, json_path)) {
+        std::fprintf(stderr, "cannot write %s\n", json_path.c_str());
+        return 1;
+    }
+    return 0;
+}
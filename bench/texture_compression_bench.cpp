@@ -0,0 +1,120 @@
+﻿#include "texcompress.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// Compares RGBA8 against the BC1/BC7 block formats: memory, encode time,
+// quality, and texel fetch cost when the block is decoded in the sampler.
+//
+//   texture_compression_bench [texture_size] [screen_size]
+
+namespace {
+
+texture::Texture makeTexture(int size) {
+    texture::Texture tex;
+    tex.width = size;
+    tex.height = size;
+    tex.data.resize(static_cast<size_t>(size) * size);
+    uint32_t seed = 0x9E3779B9u;
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            int noise = static_cast<int>(seed >> 28) - 8;
+            tex.data[static_cast<size_t>(y) * size + x] = texture::packRGBA(
+                static_cast<uint8_t>(std::clamp(x * 255 / size + noise, 0, 255)),
+                static_cast<uint8_t>(std::clamp(y * 255 / size + noise, 0, 255)),
+                static_cast<uint8_t>(std::clamp(((x ^ y) & 63) * 4 + noise, 0, 255)));
+        }
+    }
+    texture::buildMipChain(tex);
+    tex.isLoaded = true;
+    return tex;
+}
+
+double psnr(const texture::Texture& ref, const texture::Texture& tex) {
+    double squared = 0;
+    for (int y = 0; y < ref.height; ++y) {
+        for (int x = 0; x < ref.width; ++x) {
+            uint32_t a = ref.texel(ref.levels[0], x, y), b = tex.texel(tex.levels[0], x, y);
+            for (int c = 0; c < 3; ++c) {
+                double d = static_cast<int>((a >> (8 * c)) & 0xFF) - static_cast<int>((b >> (8 * c)) & 0xFF);
+                squared += d * d;
+            }
+        }
+    }
+    double mse = squared / (3.0 * ref.width * ref.height);
+    return mse == 0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// screen_size^2 fetches in rows of 8 covering the whole texture at the given
+// LOD. Returns ns per fetch.
+double runFetches(const texture::Texture& tex, int screen_size, float lod_value, uint32_t& checksum) {
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 lod = _mm256_set1_ps(lod_value);
+    const float step = 1.f / screen_size;
+
+    __m256i acc = _mm256_setzero_si256();
+    auto start = std::chrono::steady_clock::now();
+    for (int y = 0; y < screen_size; ++y) {
+        __m256 v = _mm256_set1_ps((y + 0.5f) * step);
+        for (int x = 0; x < screen_size; x += 8) {
+            __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(x + 0.5f), lane), _mm256_set1_ps(step));
+            acc = _mm256_xor_si256(acc, tex.sample8(u, v, lod));
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (uint32_t l : lanes) checksum ^= l;
+    return std::chrono::duration<double, std::nano>(end - start).count() / (static_cast<double>(screen_size) * screen_size);
+}
+
+const char* formatName(texture::Format format) {
+    switch (format) {
+        case texture::Format::RGBA8: return "rgba8";
+        case texture::Format::BC1: return "bc1";
+        case texture::Format::BC7: return "bc7";
+    }
+    return "?";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    int texture_size = argc > 1 ? std::stoi(argv[1]) : 4096;
+    int screen_size = argc > 2 ? std::stoi(argv[2]) : 2048;
+    constexpr int kRepeats = 5;
+
+    texture::Texture reference = makeTexture(texture_size);
+    std::vector<texture::Texture> variants;
+    std::printf("texture %dx%d with mips\n", texture_size, texture_size);
+    std::printf("%-6s %12s %8s %10s %8s\n", "format", "bytes", "ratio", "encode_ms", "psnr_db");
+    for (auto format : {texture::Format::RGBA8, texture::Format::BC1, texture::Format::BC7}) {
+        texture::Texture tex = reference;
+        auto start = std::chrono::steady_clock::now();
+        texture::compressTexture(tex, format);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%-6s %12zu %8.2f %10.1f %8.2f\n", formatName(format), tex.byteSize(),
+                    static_cast<double>(reference.byteSize()) / tex.byteSize(), ms, psnr(reference, tex));
+        variants.push_back(std::move(tex));
+    }
+
+    std::printf("\n%dx%d fetches per run, best of %d\n", screen_size, screen_size, kRepeats);
+    std::printf("%-6s %-10s %6s %10s\n", "format", "filter", "lod", "ns/fetch");
+    const float base_lod = std::log2(static_cast<float>(texture_size) / screen_size);
+    uint32_t checksum = 0;
+    for (auto filter : {texture::Filter::NearestMip, texture::Filter::Trilinear}) {
+        for (float lod : {base_lod, base_lod + 2.f}) {
+            for (auto& tex : variants) {
+                tex.filter = filter;
+                double best = 1e30;
+                for (int r = 0; r < kRepeats; ++r) best = std::min(best, runFetches(tex, screen_size, lod, checksum));
+                std::printf("%-6s %-10s %6.1f %10.3f\n", formatName(tex.format),
+                            filter == texture::Filter::NearestMip ? "nearest" : "trilinear", lod, best);
+            }
+        }
+    }
+    std::printf("checksum %08x\n", checksum);
+    return 0;
+}
@@ -0,0 +1,110 @@
+﻿#include "model.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// Measures texel fetch cost of the linear and tiled texture layouts when the
+// UV mapping is rotated relative to the texture axes.
+//
+//   texture_layout_bench [texture_size] [screen_size]
+
+namespace {
+
+texture::Texture makeTexture(int size) {
+    texture::Texture tex;
+    tex.width = size;
+    tex.height = size;
+    tex.data.resize(static_cast<size_t>(size) * size);
+    uint32_t seed = 0x12345678u;
+    for (auto& t : tex.data) {
+        seed = seed * 1664525u + 1013904223u;
+        t = seed | 0xFF000000u;
+    }
+    texture::buildMipChain(tex);
+    tex.isLoaded = true;
+    return tex;
+}
+
+// Walks a screen_size^2 grid in rows of 8 fragments, like the rasterizer does,
+// with one texel per pixel along the rotated axes. Returns ns per fetch.
+double runFetches(const texture::Texture& tex, int screen_size, float angle_deg, uint32_t& checksum) {
+    const float a = angle_deg * static_cast<float>(PI) / 180.f;
+    const float step = 1.f / tex.width;
+    const float ux = std::cos(a) * step, uy = -std::sin(a) * step;
+    const float vx = std::sin(a) * step, vy = std::cos(a) * step;
+    const float u0 = 0.5f - (ux + uy) * screen_size * 0.5f;
+    const float v0 = 0.5f - (vx + vy) * screen_size * 0.5f;
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 lod = _mm256_setzero_ps();
+
+    __m256i acc = _mm256_setzero_si256();
+    auto start = std::chrono::steady_clock::now();
+    for (int y = 0; y < screen_size; ++y) {
+        for (int x = 0; x < screen_size; x += 8) {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), lane);
+            __m256 u = _mm256_fmadd_ps(px, _mm256_set1_ps(ux), _mm256_set1_ps(u0 + uy * y));
+            __m256 v = _mm256_fmadd_ps(px, _mm256_set1_ps(vx), _mm256_set1_ps(v0 + vy * y));
+            acc = _mm256_xor_si256(acc, tex.sample8(u, v, lod));
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (uint32_t l : lanes) checksum ^= l;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / (static_cast<double>(screen_size) * screen_size);
+}
+
+const char* layoutName(texture::Layout layout) {
+    switch (layout) {
+        case texture::Layout::Linear: return "linear";
+        case texture::Layout::Tiled4x4: return "tiled4x4";
+        case texture::Layout::Tiled8x8: return "tiled8x8";
+    }
+    return "?";
+}
+
+const char* filterName(texture::Filter filter) {
+    switch (filter) {
+        case texture::Filter::Nearest: return "nearest";
+        case texture::Filter::NearestMip: return "nearest_mip";
+        case texture::Filter::Bilinear: return "bilinear";
+        case texture::Filter::Trilinear: return "trilinear";
+    }
+    return "?";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    int texture_size = argc > 1 ? std::stoi(argv[1]) : 4096;
+    int screen_size = argc > 2 ? std::stoi(argv[2]) : 2048;
+    constexpr int kRepeats = 5;
+
+    texture::Texture linear = makeTexture(texture_size);
+    texture::Texture tiled4 = linear;
+    texture::applyLayout(tiled4, texture::Layout::Tiled4x4);
+    texture::Texture tiled8 = linear;
+    texture::applyLayout(tiled8, texture::Layout::Tiled8x8);
+
+    std::printf("texture %dx%d, %dx%d fetches per run, best of %d\n",
+                texture_size, texture_size, screen_size, screen_size, kRepeats);
+    std::printf("%-10s %-12s %8s %10s\n", "layout", "filter", "angle", "ns/fetch");
+
+    uint32_t checksum = 0;
+    for (auto filter : {texture::Filter::NearestMip, texture::Filter::Bilinear}) {
+        for (float angle : {0.f, 30.f, 45.f, 90.f}) {
+            for (texture::Texture* tex : {&linear, &tiled4, &tiled8}) {
+                tex->filter = filter;
+                double best = 1e30;
+                for (int r = 0; r < kRepeats; ++r) {
+                    best = std::min(best, runFetches(*tex, screen_size, angle, checksum));
+                }
+                std::printf("%-10s %-12s %8.0f %10.3f\n", layoutName(tex->layout), filterName(filter), angle, best);
+            }
+        }
+    }
+    std::printf("checksum %08x\n", checksum);
+    return 0;
+}
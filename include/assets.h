@@ -0,0 +1,307 @@
+﻿#pragma once
+#include "model.h"
+#include "texcompress.h"
+#include "threadpool.h"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace assets {
+
+using ModelHandle = std::shared_ptr<model::Model>;
+using TextureHandle = std::shared_ptr<texture::Texture>;
+
+struct CacheStats {
+    size_t hits = 0;          // path already cached or loading
+    size_t misses = 0;        // new path
+    size_t content_hits = 0;  // new path whose bytes match a cached asset
+    size_t evictions = 0;
+    size_t failures = 0;
+    size_t entries = 0;
+    size_t bytes_in_use = 0;
+    size_t byte_budget = 0;
+    double load_seconds = 0;  // summed over completed loads
+};
+
+// FNV-1a over the file contents, 0 when the file cannot be read.
+inline uint64_t hashFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return 0;
+    uint64_t hash = 1469598103934665603ull;
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        const auto n = file.gcount();
+        for (std::streamsize i = 0; i < n; ++i) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+inline std::string canonicalPath(const std::string& path) {
+    std::error_code ec;
+    auto canonical = std::filesystem::weakly_canonical(path, ec);
+    return ec ? path : canonical.generic_string();
+}
+
+// Loads models and textures once per canonical path (and once per file
+// content) on the thread pool and hands out shared handles. Cached assets are
+// evicted least-recently-used first when their total size exceeds the byte
+// budget; handles already given out stay valid after eviction.
+class AssetManager {
+private:
+    struct Entry {
+        std::string key;
+        uint64_t hash = 0;
+        size_t bytes = 0;
+        bool ready = false;
+        std::list<std::string>::iterator lru;
+        std::shared_future<ModelHandle> model;
+        std::shared_future<TextureHandle> texture;
+        std::vector<std::function<void()>> waiters;
+        std::vector<std::string> aliases; // entries sharing this asset by content
+    };
+
+    ThreadPool& pool_;
+    mutable std::mutex mutex_;
+    std::condition_variable idle_;
+    size_t in_flight_ = 0;
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<uint64_t, std::string> by_hash_;
+    std::list<std::string> lru_; // front is most recently used
+    CacheStats stats_;
+
+    template <class Asset>
+    static std::shared_future<std::shared_ptr<Asset>>& slot(Entry& e) {
+        if constexpr (std::is_same_v<Asset, model::Model>) return e.model;
+        else return e.texture;
+    }
+
+    void touch(Entry& e) {
+        lru_.splice(lru_.begin(), lru_, e.lru);
+    }
+
+    void erase(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) return;
+        Entry& e = it->second;
+        stats_.bytes_in_use -= e.bytes;
+        if (auto h = by_hash_.find(e.hash); h != by_hash_.end() && h->second == key) by_hash_.erase(h);
+        auto aliases = std::move(e.aliases);
+        lru_.erase(e.lru);
+        entries_.erase(it);
+        for (const auto& alias : aliases) erase(alias);
+    }
+
+    void evictOverBudget() {
+        auto it = lru_.end();
+        while (stats_.bytes_in_use > stats_.byte_budget && it != lru_.begin()) {
+            --it;
+            const Entry& e = entries_.at(*it);
+            if (!e.ready || e.bytes == 0) continue;
+            std::string key = *it;
+            it = lru_.end(); // erase may also drop aliases, restart from the tail
+            erase(key);
+            ++stats_.evictions;
+        }
+    }
+
+    template <class Asset, class Loader>
+    std::shared_future<std::shared_ptr<Asset>> load(const std::string& prefix, const std::string& path, Loader loader,
+                                                    std::function<void(const std::shared_ptr<Asset>&)> on_ready) {
+        using Handle = std::shared_ptr<Asset>;
+        const std::string key = prefix + canonicalPath(path);
+
+        std::unique_lock lock(mutex_);
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            ++stats_.hits;
+            Entry& e = it->second;
+            touch(e);
+            auto future = slot<Asset>(e);
+            if (on_ready) {
+                if (e.ready) {
+                    lock.unlock();
+                    on_ready(future.get());
+                } else {
+                    e.waiters.push_back([future, on_ready] { on_ready(future.get()); });
+                }
+            }
+            return future;
+        }
+
+        ++stats_.misses;
+        auto promise = std::make_shared<std::promise<Handle>>();
+        std::shared_future<Handle> future = promise->get_future().share();
+        Entry& e = entries_[key];
+        e.key = key;
+        slot<Asset>(e) = future;
+        lru_.push_front(key);
+        e.lru = lru_.begin();
+        if (on_ready) e.waiters.push_back([future, on_ready] { on_ready(future.get()); });
+        ++in_flight_;
+        lock.unlock();
+
+        pool_.submit([this, key, prefix, path, promise, loader]() {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t hash = 0;
+            Handle asset;
+            bool shared = false;
+            // a loader that throws (malformed file, out of memory) resolves
+            // the request as a failed load like one that cannot open the file
+            try {
+                hash = hashFile(path) ^ std::hash<std::string>()(prefix);
+                {
+                    std::lock_guard guard(mutex_);
+                    if (auto h = by_hash_.find(hash); h != by_hash_.end()) {
+                        auto other = entries_.find(h->second);
+                        if (other != entries_.end() && other->second.ready) {
+                            asset = slot<Asset>(other->second).get();
+                            other->second.aliases.push_back(key);
+                            ++stats_.content_hits;
+                        }
+                    }
+                }
+                shared = asset != nullptr;
+                if (!asset) asset = std::make_shared<Asset>(loader(path));
+            } catch (const std::exception& e) {
+                std::cerr << "cannot load " << path << ": " << e.what() << std::endl;
+                asset = std::make_shared<Asset>();
+                shared = false;
+            } catch (...) {
+                std::cerr << "cannot load " << path << std::endl;
+                asset = std::make_shared<Asset>();
+                shared = false;
+            }
+
+            std::vector<std::function<void()>> waiters;
+            {
+                std::lock_guard guard(mutex_);
+                stats_.load_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (auto it = entries_.find(key); it != entries_.end()) {
+                    Entry& e = it->second;
+                    e.ready = true;
+                    e.hash = hash;
+                    waiters.swap(e.waiters);
+                    if (!asset->isLoaded) {
+                        // keep failures out of the cache so a later request retries
+                        ++stats_.failures;
+                        erase(key);
+                    } else if (!shared) {
+                        e.bytes = asset->byteSize();
+                        stats_.bytes_in_use += e.bytes;
+                        by_hash_[hash] = key;
+                        evictOverBudget();
+                    }
+                }
+            }
+            promise->set_value(asset);
+            for (auto& waiter : waiters) waiter();
+
+            std::lock_guard guard(mutex_);
+            if (--in_flight_ == 0) idle_.notify_all();
+        });
+        return future;
+    }
+
+public:
+    explicit AssetManager(size_t byte_budget = size_t(1) << 30, ThreadPool& pool = defaultThreadPool())
+        : pool_(pool) {
+        stats_.byte_budget = byte_budget;
+    }
+
+    ~AssetManager() {
+        waitIdle();
+    }
+
+    AssetManager(const AssetManager&) = delete;
+    AssetManager& operator=(const AssetManager&) = delete;
+
+    // on_ready runs on the loading worker, or on the caller when already loaded.
+    // A compact model is converted by the loader and cached, and charged
+    // against the budget, as its own entry.
+    std::shared_future<ModelHandle> loadModelAsync(const std::string& path, bool compact = false,
+                                                   std::function<void(const ModelHandle&)> on_ready = {}) {
+        return load<model::Model>(compact ? "model-compact:" : "model:", path,
+                                  [compact](const std::string& p) {
+                                      model::Model m = model::loadModel(p);
+                                      if (compact && m.isLoaded) model::compactModel(m);
+                                      return m;
+                                  },
+                                  std::move(on_ready));
+    }
+
+    // A block-compressed format (BC1/BC7) is encoded by the loader; the
+    // layout only applies to RGBA8 textures.
+    std::shared_future<TextureHandle> loadTextureAsync(const std::string& path,
+                                                       texture::Layout layout = texture::Layout::Linear,
+                                                       texture::Format format = texture::Format::RGBA8,
+                                                       std::function<void(const TextureHandle&)> on_ready = {}) {
+        if (format != texture::Format::RGBA8) layout = texture::Layout::Linear;
+        std::string prefix = "texture" + std::to_string(static_cast<int>(layout)) + "." +
+                             std::to_string(static_cast<int>(format)) + ":";
+        return load<texture::Texture>(prefix, path,
+                                      [layout, format](const std::string& p) {
+                                          texture::Texture t = texture::loadTexture(p, layout);
+                                          if (t.isLoaded) texture::compressTexture(t, format);
+                                          return t;
+                                      },
+                                      std::move(on_ready));
+    }
+
+    ModelHandle loadModel(const std::string& path, bool compact = false) { return loadModelAsync(path, compact).get(); }
+
+    TextureHandle loadTexture(const std::string& path, texture::Layout layout = texture::Layout::Linear,
+                              texture::Format format = texture::Format::RGBA8) {
+        return loadTextureAsync(path, layout, format).get();
+    }
+
+    // The textures named by the model's materials (map_Kd). Every file goes
+    // through the cache, so models and jobs naming the same file share one
+    // decoded copy.
+    texture::MaterialTextures loadMaterialTextures(const model::Model& model,
+                                                   texture::Layout layout = texture::Layout::Linear,
+                                                   texture::Format format = texture::Format::RGBA8) {
+        texture::MaterialTextures out;
+        std::vector<std::shared_future<TextureHandle>> futures;
+        for (const auto& file : texture::materialTextureFiles(model, out.material_texture))
+            futures.push_back(loadTextureAsync(file, layout, format));
+        for (auto& future : futures) out.textures.push_back(future.get());
+        return out;
+    }
+
+    void waitIdle() {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [this] { return in_flight_ == 0; });
+    }
+
+    void setByteBudget(size_t bytes) {
+        std::lock_guard guard(mutex_);
+        stats_.byte_budget = bytes;
+        evictOverBudget();
+    }
+
+    // Drops every finished entry; loads still in flight are kept.
+    void clear() {
+        std::lock_guard guard(mutex_);
+        std::vector<std::string> done;
+        for (const auto& [key, e] : entries_) if (e.ready) done.push_back(key);
+        for (const auto& key : done) erase(key);
+    }
+
+    CacheStats stats() const {
+        std::lock_guard guard(mutex_);
+        CacheStats s = stats_;
+        s.entries = entries_.size();
+        return s;
+    }
+};
+
+}
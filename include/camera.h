@@ -1,6 +1,7 @@
 ﻿#pragma once
 #include "linear.h"
-#include "inputmanger.h"
+#include "input.h"
+#include <algorithm>
 class Camera {
 private:
     float fov_;
@@ -32,7 +33,7 @@ public:
             PerspectiveMatrix_ = getPerspectiveMatrix(fov_, aspect_ratio_, near_clip_, far_clip_);
         }
     
-    void update(WindowsInputManager& input, float deltaTime) {
+    void update(InputSource& input, float deltaTime) {
         handleMouseInput(input, deltaTime);
         handleKeyboardInput(input, deltaTime);
         updateViewMatrix(position, position + front, up);
@@ -47,11 +48,11 @@ private:
         PerspectiveMatrix_ = getPerspectiveMatrix(fov, aspect_ratio, near_clip, far_clip);
     }
 
-    void handleMouseInput(WindowsInputManager& input, float deltaTime) {
-        auto mouse = input.getMouseState();
+    void handleMouseInput(InputSource& input, float deltaTime) {
+        const InputState& mouse = input.state();
         
-            yaw += mouse.deltaX * deltaTime * 2;
-            pitch -= mouse.deltaY * deltaTime * 2;
+            yaw += mouse.mouse_dx * deltaTime * 2;
+            pitch -= mouse.mouse_dy * deltaTime * 2;
             
             pitch = std::clamp(pitch, -89.0f, 89.0f);
             
@@ -59,21 +60,21 @@ private:
         
     }
     
-    void handleKeyboardInput(WindowsInputManager& input, float deltaTime) {
+    void handleKeyboardInput(InputSource& input, float deltaTime) {
         float velocityMultiplier = 1.0f;
-        if (input.isKeyDown(VK_SHIFT)) velocityMultiplier = 2.0f; // 冲刺
+        if (input.isKeyDown(InputKey::Sprint)) velocityMultiplier = 2.0f; // 冲刺
         
         
         float currentSpeed = movementSpeed * velocityMultiplier * deltaTime;
         
-        if (input.isKeyDown('W')) position =  position + front * currentSpeed;
-        if (input.isKeyDown('S')) position = position - front * currentSpeed;
-        if (input.isKeyDown('A')) position = position - right * currentSpeed;
-        if (input.isKeyDown('D')) position = position + right * currentSpeed;
-        if (input.isKeyDown(VK_CONTROL)) position = position - up * currentSpeed;
-        if (input.isKeyDown(VK_SPACE)) position = position + up * currentSpeed;
+        if (input.isKeyDown(InputKey::Forward)) position =  position + front * currentSpeed;
+        if (input.isKeyDown(InputKey::Back)) position = position - front * currentSpeed;
+        if (input.isKeyDown(InputKey::Left)) position = position - right * currentSpeed;
+        if (input.isKeyDown(InputKey::Right)) position = position + right * currentSpeed;
+        if (input.isKeyDown(InputKey::Down)) position = position - up * currentSpeed;
+        if (input.isKeyDown(InputKey::Up)) position = position + up * currentSpeed;
 
-        if (input.isKeyPressed('R')) {
+        if (input.isKeyPressed(InputKey::Reset)) {
             position = vec3(0, 0, 4);
             yaw = -90.0f;
             pitch = 0.0f;
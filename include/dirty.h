@@ -0,0 +1,143 @@
+﻿#pragma once
+#include "graph.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Framebuffer regions at tile granularity. The renderer records which tiles
+// of a picture it wrote (its coverage); since everything else is the clear
+// colour, the tiles that differ between two frames are the union of both
+// coverages. Presenters use that to copy only the changed rectangles.
+constexpr int kDirtyTileSize = 32;
+
+struct TileRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+class TileMask {
+private:
+    int width_ = 0;
+    int height_ = 0;
+    int tiles_x_ = 0;
+    int tiles_y_ = 0;
+    std::vector<uint8_t> tiles_;
+
+public:
+    TileMask() = default;
+    TileMask(int width, int height) { reset(width, height); }
+
+    // Resizes to the picture and marks nothing.
+    void reset(int width, int height) {
+        width_ = width;
+        height_ = height;
+        tiles_x_ = (width + kDirtyTileSize - 1) / kDirtyTileSize;
+        tiles_y_ = (height + kDirtyTileSize - 1) / kDirtyTileSize;
+        tiles_.assign(static_cast<size_t>(tiles_x_) * tiles_y_, 0);
+    }
+
+    void clear() { std::fill(tiles_.begin(), tiles_.end(), uint8_t(0)); }
+    void markAll() { std::fill(tiles_.begin(), tiles_.end(), uint8_t(1)); }
+
+    // Marks the tiles under pixels x0..x1 (inclusive) of row y.
+    void markSpan(int y, int x0, int x1) {
+        uint8_t* row = tiles_.data() + static_cast<size_t>(y / kDirtyTileSize) * tiles_x_;
+        std::fill(row + x0 / kDirtyTileSize, row + x1 / kDirtyTileSize + 1, uint8_t(1));
+    }
+
+    bool test(int tx, int ty) const { return tiles_[static_cast<size_t>(ty) * tiles_x_ + tx] != 0; }
+
+    // True if any tile under the pixel box [x0, x1) x [y0, y1) is marked.
+    bool any(int x0, int y0, int x1, int y1) const {
+        const int tx1 = (x1 - 1) / kDirtyTileSize, ty1 = (y1 - 1) / kDirtyTileSize;
+        for (int ty = y0 / kDirtyTileSize; ty <= ty1; ++ty) {
+            for (int tx = x0 / kDirtyTileSize; tx <= tx1; ++tx) {
+                if (test(tx, ty)) return true;
+            }
+        }
+        return false;
+    }
+
+    size_t count() const { return static_cast<size_t>(std::count(tiles_.begin(), tiles_.end(), uint8_t(1))); }
+
+    bool sameGrid(const TileMask& other) const { return width_ == other.width_ && height_ == other.height_; }
+    bool matches(const Picture& image) const { return width_ == image.width() && height_ == image.height(); }
+
+    TileMask& operator|=(const TileMask& other) {
+        assert(sameGrid(other));
+        for (size_t i = 0; i < tiles_.size(); ++i) tiles_[i] |= other.tiles_[i];
+        return *this;
+    }
+
+    // Marked tiles as pixel rectangles: runs along each tile row, merged with
+    // the same run on the rows below. Clipped to the picture.
+    std::vector<TileRect> rects() const {
+        std::vector<TileRect> out;
+        std::vector<size_t> open; // rects that ended on the previous tile row
+        for (int ty = 0; ty < tiles_y_; ++ty) {
+            std::vector<size_t> current;
+            const int y = ty * kDirtyTileSize;
+            const int h = std::min(kDirtyTileSize, height_ - y);
+            for (int tx = 0; tx < tiles_x_;) {
+                if (!test(tx, ty)) { ++tx; continue; }
+                int end = tx;
+                while (end < tiles_x_ && test(end, ty)) ++end;
+                const int x = tx * kDirtyTileSize;
+                const int w = std::min(end * kDirtyTileSize, width_) - x;
+                auto same = std::find_if(open.begin(), open.end(), [&](size_t r) {
+                    return out[r].x == x && out[r].width == w;
+                });
+                if (same != open.end()) {
+                    out[*same].height += h;
+                    current.push_back(*same);
+                } else {
+                    out.push_back({ x, y, w, h });
+                    current.push_back(out.size() - 1);
+                }
+                tx = end;
+            }
+            open = std::move(current);
+        }
+        return out;
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int tilesX() const { return tiles_x_; }
+    int tilesY() const { return tiles_y_; }
+    const uint8_t* data() const { return tiles_.data(); }
+    uint8_t* data() { return tiles_.data(); }
+    size_t size() const { return tiles_.size(); }
+};
+
+// Pixel bytes inside the rectangles of a picture with the given bytes per pixel.
+inline size_t rectBytes(const std::vector<TileRect>& rects, int bytes_per_pixel) {
+    size_t bytes = 0;
+    for (const TileRect& r : rects) bytes += static_cast<size_t>(r.width) * r.height * bytes_per_pixel;
+    return bytes;
+}
+
+// For a presenter that keeps the last frame it showed (a texture, a terminal):
+// turns the coverage of each new frame into the tiles that changed since the
+// previous one. Everything is dirty for the first frame, after invalidate(),
+// or when the size changes.
+class DirtyTracker {
+private:
+    TileMask presented_;
+    TileMask dirty_;
+    bool valid_ = false;
+
+public:
+    const TileMask& update(const TileMask& coverage) {
+        dirty_ = coverage;
+        if (valid_ && presented_.sameGrid(coverage)) dirty_ |= presented_;
+        else dirty_.markAll();
+        presented_ = coverage;
+        valid_ = true;
+        return dirty_;
+    }
+
+    void invalidate() { valid_ = false; }
+};
@@ -0,0 +1,357 @@
+﻿#pragma once
+#include "graph.h"
+#include <immintrin.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Streaming rendered frames to a file descriptor, e.g. a pipe into ffmpeg:
+//
+//   raw:  ffmpeg -f rawvideo -pix_fmt rgba -s 1920x1080 -r 30 -i - out.mp4
+//   y4m:  ffmpeg -i - out.mp4
+namespace imageio {
+
+// BT.601 limited range, the default ffmpeg assumes for yuv420p.
+inline uint8_t lumaBT601(int r, int g, int b) {
+    return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+// Chroma from the sums of four pixels.
+inline void chromaBT601(int r4, int g4, int b4, uint8_t& u, uint8_t& v) {
+    u = static_cast<uint8_t>(((-38 * r4 - 74 * g4 + 112 * b4 + 512) >> 10) + 128);
+    v = static_cast<uint8_t>(((112 * r4 - 94 * g4 - 18 * b4 + 512) >> 10) + 128);
+}
+
+namespace detail {
+    inline void pixelRGB(const Picture& image, int x, int y, int& r, int& g, int& b) {
+        const uint8_t* p = image.row_ptr(y) + static_cast<size_t>(x) * image.channels();
+        r = p[image.red_offset()];
+        g = p[1];
+        b = p[image.blue_offset()];
+    }
+
+    // Scalar conversion of columns [x0, width) of the row pair (y0, y1).
+    inline void yuv420Scalar(const Picture& image, int y0, int y1, int x0,
+                             uint8_t* luma0, uint8_t* luma1, uint8_t* u, uint8_t* v) {
+        const int width = image.width();
+        for (int x = x0; x < width; x += 2) {
+            const int x1 = std::min(x + 1, width - 1);
+            int r4 = 0, g4 = 0, b4 = 0;
+            for (int k = 0; k < 4; ++k) {
+                const int px = (k & 1) ? x1 : x, py = (k & 2) ? y1 : y0;
+                int r, g, b;
+                pixelRGB(image, px, py, r, g, b);
+                r4 += r; g4 += g; b4 += b;
+                if (px == x + (k & 1)) {
+                    uint8_t* row = (k & 2) ? luma1 : luma0;
+                    if (row) row[px] = lumaBT601(r, g, b);
+                }
+            }
+            chromaBT601(r4, g4, b4, u[x / 2], v[x / 2]);
+        }
+    }
+
+    // Luma of 8 packed pixels as 32-bit lanes. rb holds the red/blue weights
+    // for the two 16-bit halves of the low bytes, in memory order.
+    inline __m256i luma8(__m256i px, __m256i rb_weights) {
+        const __m256i low = _mm256_and_si256(px, _mm256_set1_epi32(0x00FF00FF));
+        const __m256i high = _mm256_srli_epi16(px, 8);
+        __m256i y = _mm256_add_epi32(_mm256_madd_epi16(low, rb_weights),
+                                     _mm256_madd_epi16(high, _mm256_set1_epi32(129)));
+        y = _mm256_srli_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(128)), 8);
+        return _mm256_add_epi32(y, _mm256_set1_epi32(16));
+    }
+
+    // 16 32-bit lanes (a then b) to 16 bytes.
+    inline __m128i packBytes16(__m256i a, __m256i b) {
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    }
+}
+
+// Converts the picture to planar YUV 4:2:0. Luma is width x height, each
+// chroma plane (width+1)/2 x (height+1)/2; odd edges repeat the last pixel.
+// Packed pictures take the AVX2 path 16 pixels at a time.
+inline void toYUV420(const Picture& image, uint8_t* luma, uint8_t* u, uint8_t* v) {
+    const int width = image.width(), height = image.height();
+    const int chroma_width = (width + 1) / 2;
+    const bool bgra = image.format() == PictureFormat::BGRA8;
+
+    // madd weights for the (byte 0, byte 2) and (byte 1, byte 3) 16-bit pairs
+    auto pair = [](int lo, int hi) { return _mm256_set1_epi32((hi << 16) | (lo & 0xFFFF)); };
+    const __m256i y_rb = bgra ? pair(25, 66) : pair(66, 25);
+    const __m256i u_rb = bgra ? pair(112, -38) : pair(-38, 112);
+    const __m256i v_rb = bgra ? pair(-18, 112) : pair(112, -18);
+    const __m256i u_g = pair(-74, 0), v_g = pair(-94, 0);
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+
+    for (int y = 0; y < height; y += 2) {
+        const int y1 = std::min(y + 1, height - 1);
+        uint8_t* luma0 = luma + static_cast<size_t>(y) * width;
+        uint8_t* luma1 = y + 1 < height ? luma0 + width : nullptr;
+        uint8_t* urow = u + static_cast<size_t>(y / 2) * chroma_width;
+        uint8_t* vrow = v + static_cast<size_t>(y / 2) * chroma_width;
+
+        int x = 0;
+        if (image.isPacked()) {
+            const uint32_t* row0 = image.row32(y);
+            const uint32_t* row1 = image.row32(y1);
+            for (; x + 16 <= width; x += 16) {
+                __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + x));
+                __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + x + 8));
+                __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + x));
+                __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + x + 8));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(luma0 + x),
+                                 detail::packBytes16(detail::luma8(a0, y_rb), detail::luma8(b0, y_rb)));
+                if (luma1) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(luma1 + x),
+                                     detail::packBytes16(detail::luma8(a1, y_rb), detail::luma8(b1, y_rb)));
+                }
+
+                // vertical then horizontal pair sums, per 16-bit channel
+                const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+                auto sums = [&](__m256i p0, __m256i p1, __m256i& low, __m256i& high) {
+                    low = _mm256_add_epi16(_mm256_and_si256(p0, mask), _mm256_and_si256(p1, mask));
+                    high = _mm256_add_epi16(_mm256_srli_epi16(p0, 8), _mm256_srli_epi16(p1, 8));
+                    low = _mm256_add_epi16(low, _mm256_srli_epi64(low, 32));
+                    high = _mm256_add_epi16(high, _mm256_srli_epi64(high, 32));
+                };
+                __m256i la, ha, lb, hb;
+                sums(a0, a1, la, ha);
+                sums(b0, b1, lb, hb);
+
+                auto chroma = [&](__m256i rb, __m256i g, __m256i low, __m256i high) {
+                    __m256i c = _mm256_add_epi32(_mm256_madd_epi16(low, rb), _mm256_madd_epi16(high, g));
+                    c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(512)), 10);
+                    return _mm256_add_epi32(c, _mm256_set1_epi32(128));
+                };
+                // even lanes hold the 8 results of a and b; gather them in order
+                auto gather = [&](__m256i ca, __m256i cb) {
+                    __m256i lo = _mm256_permutevar8x32_epi32(ca, even);
+                    __m256i hi = _mm256_permutevar8x32_epi32(cb, even);
+                    __m256i both = _mm256_permute2x128_si256(lo, hi, 0x20);
+                    __m128i bytes = detail::packBytes16(both, _mm256_setzero_si256());
+                    return _mm_cvtsi128_si64(bytes);
+                };
+                const long long u8 = gather(chroma(u_rb, u_g, la, ha), chroma(u_rb, u_g, lb, hb));
+                const long long v8 = gather(chroma(v_rb, v_g, la, ha), chroma(v_rb, v_g, lb, hb));
+                std::memcpy(urow + x / 2, &u8, 8);
+                std::memcpy(vrow + x / 2, &v8, 8);
+            }
+        }
+        detail::yuv420Scalar(image, y, y1, x, luma0, luma1, urow, vrow);
+    }
+}
+
+enum class StreamFormat {
+    Raw, // the picture's own bytes: rgb24, rgba or bgra
+    Y4M, // YUV4MPEG2, 4:2:0
+};
+
+// Name of the picture's raw layout for ffmpeg's -pix_fmt.
+inline const char* rawPixelFormat(PictureFormat format) {
+    switch (format) {
+        case PictureFormat::RGB8: return "rgb24";
+        case PictureFormat::RGBA8: return "rgba";
+        case PictureFormat::BGRA8: return "bgra";
+    }
+    return "rgb24";
+}
+
+// Writes frames to a file descriptor. Raw frames go out straight from the
+// picture's storage; Y4M frames are converted into planes reused across
+// frames and written together with the frame header in one call.
+class FrameSink {
+private:
+    int fd_ = -1;
+    FILE* pipe_ = nullptr;   // opened with popen
+    bool owns_fd_ = false;
+    StreamFormat format_ = StreamFormat::Raw;
+    int fps_ = 30;
+    int width_ = 0;
+    int height_ = 0;
+    bool failed_ = false;
+    uint64_t frames_ = 0;
+    uint64_t bytes_ = 0;
+    std::vector<uint8_t> planes_;
+
+    struct Span {
+        const void* data;
+        size_t size;
+    };
+
+    bool writeAll(const Span* spans, int count) {
+#ifdef _WIN32
+        for (int i = 0; i < count; ++i) {
+            const char* p = static_cast<const char*>(spans[i].data);
+            size_t left = spans[i].size;
+            while (left > 0) {
+                int n = ::_write(fd_, p, static_cast<unsigned>(std::min<size_t>(left, 1u << 30)));
+                if (n <= 0) return false;
+                p += n;
+                left -= static_cast<size_t>(n);
+                bytes_ += static_cast<uint64_t>(n);
+            }
+        }
+        return true;
+#else
+        iovec iov[4];
+        for (int i = 0; i < count; ++i) iov[i] = { const_cast<void*>(spans[i].data), spans[i].size };
+        int first = 0;
+        while (first < count) {
+            ssize_t n = ::writev(fd_, iov + first, count - first);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            bytes_ += static_cast<uint64_t>(n);
+            // skip what was written, possibly part of an iovec
+            while (first < count && static_cast<size_t>(n) >= iov[first].iov_len) {
+                n -= static_cast<ssize_t>(iov[first].iov_len);
+                ++first;
+            }
+            if (first < count) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                iov[first].iov_len -= static_cast<size_t>(n);
+            }
+        }
+        return true;
+#endif
+    }
+
+public:
+    FrameSink() = default;
+
+    FrameSink(int fd, StreamFormat format, int fps = 30, bool owns_fd = false)
+        : fd_(fd), owns_fd_(owns_fd), format_(format), fps_(std::max(fps, 1)) {}
+
+    // Runs command through the shell with the stream on its stdin.
+    static FrameSink openCommand(const std::string& command, StreamFormat format, int fps = 30) {
+#ifdef _WIN32
+        FILE* pipe = ::_popen(command.c_str(), "wb");
+        FrameSink sink(pipe ? ::_fileno(pipe) : -1, format, fps);
+#else
+        FILE* pipe = ::popen(command.c_str(), "w");
+        FrameSink sink(pipe ? ::fileno(pipe) : -1, format, fps);
+#endif
+        sink.pipe_ = pipe;
+        return sink;
+    }
+
+    static FrameSink openFile(const std::string& filename, StreamFormat format, int fps = 30) {
+        FILE* file = std::fopen(filename.c_str(), "wb");
+        if (!file) return FrameSink(-1, format, fps);
+#ifdef _WIN32
+        int fd = ::_dup(::_fileno(file));
+#else
+        int fd = ::dup(::fileno(file));
+#endif
+        std::fclose(file);
+        return FrameSink(fd, format, fps, true);
+    }
+
+    FrameSink(FrameSink&& other) noexcept { *this = std::move(other); }
+
+    FrameSink& operator=(FrameSink&& other) noexcept {
+        if (this != &other) {
+            close();
+            fd_ = std::exchange(other.fd_, -1);
+            pipe_ = std::exchange(other.pipe_, nullptr);
+            owns_fd_ = std::exchange(other.owns_fd_, false);
+            format_ = other.format_;
+            fps_ = other.fps_;
+            width_ = other.width_;
+            height_ = other.height_;
+            failed_ = other.failed_;
+            frames_ = other.frames_;
+            bytes_ = other.bytes_;
+            planes_ = std::move(other.planes_);
+        }
+        return *this;
+    }
+
+    FrameSink(const FrameSink&) = delete;
+    FrameSink& operator=(const FrameSink&) = delete;
+
+    ~FrameSink() {
+        close();
+    }
+
+    // Every frame must have the size of the first one.
+    bool write(const Picture& image) {
+        if (!good() || !image.isValid()) return false;
+        if (frames_ == 0) {
+            width_ = image.width();
+            height_ = image.height();
+            if (format_ == StreamFormat::Y4M) {
+                char header[96];
+                int n = std::snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                                      width_, height_, fps_);
+                Span span{ header, static_cast<size_t>(n) };
+                if (!writeAll(&span, 1)) return fail();
+            }
+        } else if (image.width() != width_ || image.height() != height_) {
+            return false;
+        }
+
+        if (format_ == StreamFormat::Raw) {
+            Span span{ image.data(), static_cast<size_t>(width_) * height_ * image.channels() };
+            if (!writeAll(&span, 1)) return fail();
+        } else {
+            const size_t luma = static_cast<size_t>(width_) * height_;
+            const size_t chroma = static_cast<size_t>((width_ + 1) / 2) * ((height_ + 1) / 2);
+            planes_.resize(luma + 2 * chroma);
+            toYUV420(image, planes_.data(), planes_.data() + luma, planes_.data() + luma + chroma);
+            static const char frame[] = "FRAME\n";
+            Span spans[2] = { { frame, sizeof(frame) - 1 }, { planes_.data(), planes_.size() } };
+            if (!writeAll(spans, 2)) return fail();
+        }
+        ++frames_;
+        return true;
+    }
+
+    bool good() const { return fd_ >= 0 && !failed_; }
+    uint64_t frames() const { return frames_; }
+    uint64_t bytes() const { return bytes_; }
+
+    // For pipes, waits for the command and returns false if it failed.
+    bool close() {
+        bool ok = !failed_;
+        if (pipe_) {
+#ifdef _WIN32
+            ok = ::_pclose(pipe_) == 0 && ok;
+#else
+            ok = ::pclose(pipe_) == 0 && ok;
+#endif
+        } else if (owns_fd_ && fd_ >= 0) {
+#ifdef _WIN32
+            ok = ::_close(fd_) == 0 && ok;
+#else
+            ok = ::close(fd_) == 0 && ok;
+#endif
+        }
+        pipe_ = nullptr;
+        fd_ = -1;
+        owns_fd_ = false;
+        return ok;
+    }
+
+private:
+    bool fail() {
+        failed_ = true;
+        return false;
+    }
+};
+
+}
@@ -2,38 +2,108 @@
 #include <vector>
 #include <cstdint>
 #include <cassert>
+#include <cstring>
 #include <utility>
+#include <new>
+#include <immintrin.h>
+
+template <class T, size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+    template <class U> struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T* p, size_t) noexcept {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+    template <class U> bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+};
+
+// RGB8 is 3 bytes per pixel. RGBA8/BGRA8 are one 32-bit word per pixel in
+// memory byte order, so rows can be written through row32() with SIMD stores.
+enum class PictureFormat {
+    RGB8,
+    RGBA8,
+    BGRA8,
+};
 
 class Picture {
 private:
-    std::vector<uint8_t> data_;
+    std::vector<uint8_t, AlignedAllocator<uint8_t, 32>> data_;
     int width_ = 0;
     int height_ = 0;
     int channels_ = 0;
     size_t stride_ = 0;
+    PictureFormat format_ = PictureFormat::RGB8;
+    // data_ for owning pictures, caller memory for views
+    uint8_t* pixels_ = nullptr;
+    size_t size_ = 0;
 
 public:
     Picture() = default;
     
     Picture(int w, int h, int ch) 
         : width_(w), height_(h), channels_(ch),
-          stride_(static_cast<size_t>(w) * ch)
+          stride_(static_cast<size_t>(w) * ch),
+          format_(ch == 4 ? PictureFormat::RGBA8 : PictureFormat::RGB8)
     {
         if (w > 0 && h > 0 && ch > 0) {
             data_.resize(height_ * stride_);
+            pixels_ = data_.data();
+            size_ = data_.size();
         }
     }
 
-    Picture(const Picture& other) = default;
+    Picture(int w, int h, PictureFormat format)
+        : Picture(w, h, format == PictureFormat::RGB8 ? 3 : 4)
+    {
+        format_ = format;
+    }
+
+    // Picture over memory owned by the caller (a mapped frame slot, for
+    // instance); rows are stride bytes apart and the memory must outlive it.
+    // Copies of a view are views of the same memory.
+    static Picture view(uint8_t* pixels, int w, int h, PictureFormat format, size_t stride = 0) {
+        Picture pic;
+        pic.width_ = w;
+        pic.height_ = h;
+        pic.channels_ = format == PictureFormat::RGB8 ? 3 : 4;
+        pic.stride_ = stride ? stride : static_cast<size_t>(w) * pic.channels_;
+        pic.format_ = format;
+        pic.pixels_ = pixels;
+        pic.size_ = pic.stride_ * h;
+        return pic;
+    }
+
+    Picture(const Picture& other)
+        : data_(other.data_),
+          width_(other.width_),
+          height_(other.height_),
+          channels_(other.channels_),
+          stride_(other.stride_),
+          format_(other.format_),
+          pixels_(other.isView() ? other.pixels_ : data_.data()),
+          size_(other.size_) {}
     
-    Picture& operator=(const Picture& other) = default;
+    Picture& operator=(const Picture& other) {
+        if (this != &other) *this = Picture(other);
+        return *this;
+    }
     
     Picture(Picture&& other) noexcept
         : data_(std::move(other.data_)),
           width_(std::exchange(other.width_, 0)),
           height_(std::exchange(other.height_, 0)),
           channels_(std::exchange(other.channels_, 0)),
-          stride_(std::exchange(other.stride_, 0)) {}
+          stride_(std::exchange(other.stride_, 0)),
+          format_(std::exchange(other.format_, PictureFormat::RGB8)),
+          pixels_(std::exchange(other.pixels_, nullptr)),
+          size_(std::exchange(other.size_, 0)) {}
     
     Picture& operator=(Picture&& other) noexcept {
         if (this != &other) {
@@ -42,6 +112,9 @@ public:
             height_ = std::exchange(other.height_, 0);
             channels_ = std::exchange(other.channels_, 0);
             stride_ = std::exchange(other.stride_, 0);
+            format_ = std::exchange(other.format_, PictureFormat::RGB8);
+            pixels_ = std::exchange(other.pixels_, nullptr);
+            size_ = std::exchange(other.size_, 0);
         }
         return *this;
     }
@@ -50,52 +123,128 @@ public:
 
     uint8_t& at(int x, int y, int ch) {
         assert(x >= 0 && x < width_ && y >= 0 && y < height_ && ch >= 0 && ch < channels_);
-        return data_[y * stride_ + x * channels_ + ch];
+        return pixels_[y * stride_ + x * channels_ + ch];
     }
     
     const uint8_t& at(int x, int y, int ch) const {
         assert(x >= 0 && x < width_ && y >= 0 && y < height_ && ch >= 0 && ch < channels_);
-        return data_[y * stride_ + x * channels_ + ch];
+        return pixels_[y * stride_ + x * channels_ + ch];
     }
 
     uint8_t* row_ptr(int y) { 
         assert(y >= 0 && y < height_);
-        return data_.data() + y * stride_; 
+        return pixels_ + y * stride_; 
     }
     
     const uint8_t* row_ptr(int y) const { 
         assert(y >= 0 && y < height_);
-        return data_.data() + y * stride_; 
+        return pixels_ + y * stride_; 
+    }
+
+    uint32_t* row32(int y) {
+        assert(channels_ == 4 && y >= 0 && y < height_);
+        return reinterpret_cast<uint32_t*>(pixels_ + y * stride_);
+    }
+
+    const uint32_t* row32(int y) const {
+        assert(channels_ == 4 && y >= 0 && y < height_);
+        return reinterpret_cast<const uint32_t*>(pixels_ + y * stride_);
+    }
+
+    // Pixels [x, x + count) of row y.
+    uint32_t* span32(int x, int y, [[maybe_unused]] int count) {
+        assert(x >= 0 && count >= 0 && x + count <= width_);
+        return row32(y) + x;
     }
 
+    bool isPacked() const { return channels_ == 4; }
+    bool isView() const { return pixels_ != nullptr && data_.empty(); }
+    PictureFormat format() const { return format_; }
     int width() const { return width_; }
     int height() const { return height_; }
     int channels() const { return channels_; }
     size_t stride() const { return stride_; }
-    uint8_t* data() { return data_.data(); }
-    const uint8_t* data() const { return data_.data(); }
+    uint8_t* data() { return pixels_; }
+    const uint8_t* data() const { return pixels_; }
 
     void fill(uint8_t value) {
-        std::fill(data_.begin(), data_.end(), value);
+        std::fill(pixels_, pixels_ + size_, value);
+    }
+
+    // Packed formats only: sets every pixel to the 32-bit value.
+    void fill32(uint32_t value) {
+        assert(channels_ == 4);
+        const __m256i v = _mm256_set1_epi32(static_cast<int>(value));
+        uint8_t* p = pixels_;
+        const size_t bytes = size_;
+        size_t i = 0;
+        for (; i + 32 <= bytes; i += 32) _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), v);
+        for (; i < bytes; i += 4) std::memcpy(p + i, &value, 4);
     }
 
     void clear() {
-        data_.assign(data_.size(), 0);
+        fill(0);
     }
 
+    // Channel offsets of red, green and blue inside a pixel.
+    int red_offset() const { return format_ == PictureFormat::BGRA8 ? 2 : 0; }
+    int blue_offset() const { return format_ == PictureFormat::BGRA8 ? 0 : 2; }
+
     uint8_t get_color(int x, int y) const {
         if (x < 0 || x >= width_ || y < 0 || y >= height_ || channels_ < 3) {
             return 0;
         }
         
-        uint8_t ri = at(x, y, 0) * 5 / 255;
+        uint8_t ri = at(x, y, red_offset()) * 5 / 255;
         uint8_t gi = at(x, y, 1) * 5 / 255;
-        uint8_t bi = at(x, y, 2) * 5 / 255;
+        uint8_t bi = at(x, y, blue_offset()) * 5 / 255;
         return 16 + 36 * ri + 6 * gi + bi;
     }
+
+    // Tightly packed RGB copy of rows [first_row, first_row + rows), for
+    // consumers that want 3 channels.
+    void copyRowsToRGB(int first_row, int rows, uint8_t* dst) const {
+        assert(first_row >= 0 && rows >= 0 && first_row + rows <= height_);
+        if (rows > 1 && stride_ != static_cast<size_t>(width_) * channels_) {
+            // padded rows (views) go one at a time
+            for (int r = 0; r < rows; ++r) copyRowsToRGB(first_row + r, 1, dst + static_cast<size_t>(r) * width_ * 3);
+            return;
+        }
+        const uint8_t* src = pixels_ + first_row * stride_;
+        const size_t pixels = static_cast<size_t>(width_) * rows;
+        if (!isPacked()) {
+            std::memcpy(dst, src, pixels * 3);
+            return;
+        }
+        const bool bgra = format_ == PictureFormat::BGRA8;
+        const __m128i shuffle = bgra
+            ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+            : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        size_t i = 0;
+        // 16 bytes are written per 4 pixels, so stop while 4 spare bytes remain
+        for (; i + 6 <= pixels; i += 4) {
+            __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * i), _mm_shuffle_epi8(px, shuffle));
+        }
+        for (; i < pixels; ++i) {
+            dst[3 * i + 0] = src[4 * i + red_offset()];
+            dst[3 * i + 1] = src[4 * i + 1];
+            dst[3 * i + 2] = src[4 * i + blue_offset()];
+        }
+    }
+
+    void copyToRGB(uint8_t* dst) const {
+        copyRowsToRGB(0, height_, dst);
+    }
+
+    Picture toRGB() const {
+        Picture out(width_, height_, 3);
+        copyToRGB(out.data());
+        return out;
+    }
     
     bool isValid() const {
-        return width_ > 0 && height_ > 0 && channels_ > 0 && !data_.empty();
+        return width_ > 0 && height_ > 0 && channels_ > 0 && pixels_ != nullptr;
     }
     
     void reset() {
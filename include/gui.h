@@ -4,6 +4,7 @@
 #include <string>
 
 class Picture; 
+class TileMask;
 class RaylibPictureRendererImpl;
 
 class RaylibPictureRenderer {
@@ -19,6 +20,25 @@ public:
 
     bool initialize(const Picture& pic);
     void updateTexture(const Picture& pic);
+
+    // Swap chain: the presenter owns bufferCount RGBA8 pictures of the given
+    // size. acquireBackBuffer() hands out a free one to render into (blocking
+    // while all are in use, so it may be called from another thread) and
+    // present() uploads it straight from that buffer and makes it the front
+    // buffer, releasing the previous one. present() must run on the window
+    // thread. No picture is copied on either side.
+    //
+    // Each buffer has a coverage mask to pass to render(). present() then
+    // uploads only the tiles that changed since the previously presented
+    // frame and returns the bytes uploaded.
+    bool initializeSwapChain(int width, int height, int bufferCount = 2);
+    int acquireBackBuffer();
+    Picture& buffer(int index);
+    TileMask& coverage(int index);
+    size_t present(int index);
+    // Returns an acquired buffer without presenting it.
+    void releaseBackBuffer(int index);
+    int bufferCount() const;
     void draw();
     bool shouldClose() const;
     void close();
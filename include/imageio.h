@@ -0,0 +1,285 @@
+﻿#pragma once
+#include "graph.h"
+#include "threadpool.h"
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Writing rendered pictures to disk.
+namespace imageio {
+
+struct FileCloser {
+    void operator()(FILE* f) const { if (f) std::fclose(f); }
+};
+
+// Binary PPM (P6). Packed pictures are converted to RGB first.
+inline bool writePPM(const Picture& image, const std::string& filename) {
+    std::unique_ptr<FILE, FileCloser> file(std::fopen(filename.c_str(), "wb"));
+    if (!file) return false;
+    std::fprintf(file.get(), "P6\n%d %d\n255\n", image.width(), image.height());
+
+    const size_t bytes = static_cast<size_t>(image.width()) * image.height() * 3;
+    if (image.isPacked()) {
+        std::vector<uint8_t> rgb(bytes);
+        image.copyToRGB(rgb.data());
+        return std::fwrite(rgb.data(), 1, bytes, file.get()) == bytes;
+    }
+    return std::fwrite(image.data(), 1, bytes, file.get()) == bytes;
+}
+
+struct PngOptions {
+    // 0 writes stored deflate blocks without filtering (memcpy speed, large
+    // files); 1-2 use the Sub filter on every row; 3-9 pick the filter per
+    // row and trade speed for size like zlib's levels.
+    int level = 1;
+    // rows per independently compressed stripe, 0 picks from the pool size
+    int stripe_rows = 0;
+};
+
+namespace detail {
+    inline void putBE32(std::vector<uint8_t>& out, uint32_t v) {
+        out.push_back(static_cast<uint8_t>(v >> 24));
+        out.push_back(static_cast<uint8_t>(v >> 16));
+        out.push_back(static_cast<uint8_t>(v >> 8));
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    // Appends a complete chunk: length, type, data, CRC over type and data.
+    inline void putChunk(std::vector<uint8_t>& out, const char type[4], const uint8_t* data, size_t size) {
+        putBE32(out, static_cast<uint32_t>(size));
+        const size_t type_pos = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + size);
+        putBE32(out, static_cast<uint32_t>(crc32(0, out.data() + type_pos, static_cast<uInt>(size + 4))));
+    }
+
+    inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        return pb <= pc ? b : c;
+    }
+
+    // Writes the filter type byte and the filtered row to out. prior is the
+    // unfiltered row above, all zero for the first image row.
+    inline void filterRow(int type, const uint8_t* row, const uint8_t* prior, size_t bytes, int bpp, uint8_t* out) {
+        out[0] = static_cast<uint8_t>(type);
+        ++out;
+        const size_t head = std::min<size_t>(bpp, bytes);
+        switch (type) {
+            case 0:
+                std::copy(row, row + bytes, out);
+                break;
+            case 1:
+                std::copy(row, row + head, out);
+                for (size_t i = head; i < bytes; ++i) out[i] = static_cast<uint8_t>(row[i] - row[i - bpp]);
+                break;
+            case 2:
+                for (size_t i = 0; i < bytes; ++i) out[i] = static_cast<uint8_t>(row[i] - prior[i]);
+                break;
+            case 3:
+                for (size_t i = 0; i < head; ++i) out[i] = static_cast<uint8_t>(row[i] - (prior[i] >> 1));
+                for (size_t i = head; i < bytes; ++i)
+                    out[i] = static_cast<uint8_t>(row[i] - ((row[i - bpp] + prior[i]) >> 1));
+                break;
+            default:
+                for (size_t i = 0; i < head; ++i) out[i] = static_cast<uint8_t>(row[i] - prior[i]);
+                for (size_t i = head; i < bytes; ++i)
+                    out[i] = static_cast<uint8_t>(row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]));
+                break;
+        }
+    }
+
+    // Minimum sum of absolute differences over the five filters.
+    inline void filterRowAdaptive(const uint8_t* row, const uint8_t* prior, size_t bytes, int bpp,
+                                  uint8_t* out, std::vector<uint8_t>& scratch) {
+        scratch.resize(bytes + 1);
+        uint64_t best_cost = ~0ull;
+        for (int type = 0; type < 5; ++type) {
+            filterRow(type, row, prior, bytes, bpp, scratch.data());
+            uint64_t cost = 0;
+            for (size_t i = 1; i <= bytes; ++i) cost += static_cast<uint64_t>(std::abs(static_cast<int8_t>(scratch[i])));
+            if (cost < best_cost) {
+                best_cost = cost;
+                std::copy(scratch.begin(), scratch.end(), out);
+            }
+        }
+    }
+
+    // Raw deflate of one stripe. The previous stripe's last 32 KiB primes the
+    // window; all but the last stripe end on a byte boundary without the final
+    // bit, so the stripes concatenate into one stream. On failure out is
+    // left empty.
+    inline bool deflateStripe(const uint8_t* data, size_t size, const uint8_t* dict, size_t dict_size,
+                              int level, bool last, std::vector<uint8_t>& out) {
+        out.clear();
+        z_stream zs{};
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        if (dict_size > 0 && deflateSetDictionary(&zs, dict, static_cast<uInt>(dict_size)) != Z_OK) {
+            deflateEnd(&zs);
+            return false;
+        }
+        out.resize(deflateBound(&zs, static_cast<uLong>(size)) + 16);
+        zs.next_in = const_cast<Bytef*>(data);
+        zs.avail_in = static_cast<uInt>(size);
+        zs.next_out = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+        int rc = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+        // Z_OK with output space left means the flush completed
+        const bool ok = last ? rc == Z_STREAM_END : rc == Z_OK && zs.avail_in == 0 && zs.avail_out > 0;
+        out.resize(ok ? zs.total_out : 0);
+        deflateEnd(&zs);
+        return ok;
+    }
+
+    // Stored blocks of at most 65535 bytes.
+    inline void storeStripe(const uint8_t* data, size_t size, bool last, std::vector<uint8_t>& out) {
+        out.clear();
+        out.reserve(size + (size / 65535 + 1) * 5);
+        do {
+            const size_t n = std::min<size_t>(size, 65535);
+            const bool final_block = last && n == size;
+            out.push_back(final_block ? 1 : 0);
+            out.push_back(static_cast<uint8_t>(n));
+            out.push_back(static_cast<uint8_t>(n >> 8));
+            out.push_back(static_cast<uint8_t>(~n));
+            out.push_back(static_cast<uint8_t>(~n >> 8));
+            out.insert(out.end(), data, data + n);
+            data += n;
+            size -= n;
+        } while (size > 0);
+    }
+}
+
+// Encodes the picture as an 8-bit RGB PNG (packed pictures drop their
+// always-opaque alpha). Rows are split into stripes that are converted,
+// filtered and deflated in parallel; each stripe becomes its own IDAT chunk
+// and the Adler-32 of the whole stream is combined from per-stripe sums.
+// Returns false, with png empty, when zlib fails on any stripe.
+inline bool encodePNG(const Picture& image, std::vector<uint8_t>& png, const PngOptions& options = {},
+                      ThreadPool& pool = defaultThreadPool()) {
+    png.clear();
+    const int width = image.width(), height = image.height();
+    const int level = std::clamp(options.level, 0, 9);
+    const size_t row_bytes = static_cast<size_t>(width) * 3;
+    const size_t line = row_bytes + 1;
+    constexpr size_t kWindow = 32768;
+
+    int stripe_rows = options.stripe_rows;
+    if (stripe_rows <= 0) {
+        const int stripes = static_cast<int>(std::max<size_t>(1, pool.size() * 2));
+        stripe_rows = std::max(16, (height + stripes - 1) / stripes);
+    }
+    const int stripes = std::max(1, (height + stripe_rows - 1) / stripe_rows);
+
+    // filtered scanlines of the whole image; stripes read the tail of the
+    // previous stripe's range as their dictionary
+    std::vector<uint8_t> filtered(line * height);
+    std::vector<std::vector<uint8_t>> chunks(stripes);
+    std::vector<uLong> adlers(stripes);
+    std::vector<size_t> sizes(stripes);
+    std::atomic<bool> failed{false};
+
+    pool.parallelFor(0, stripes, 1, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> rgb, scratch;
+        for (size_t s = begin; s < end; ++s) {
+            const int y0 = static_cast<int>(s) * stripe_rows;
+            const int rows = std::min(stripe_rows, height - y0);
+            // the row above the stripe is the Up/Avg/Paeth prior of its
+            // first row, zeros above the image
+            rgb.resize(row_bytes * (rows + 1));
+            if (y0 > 0) image.copyRowsToRGB(y0 - 1, rows + 1, rgb.data());
+            else {
+                std::fill(rgb.begin(), rgb.begin() + row_bytes, 0);
+                image.copyRowsToRGB(0, rows, rgb.data() + row_bytes);
+            }
+
+            for (int r = 0; r < rows; ++r) {
+                const uint8_t* row = rgb.data() + (r + 1) * row_bytes;
+                const uint8_t* prior = row - row_bytes;
+                uint8_t* out = filtered.data() + (y0 + r) * line;
+                if (level == 0) {
+                    out[0] = 0;
+                    std::copy(row, row + row_bytes, out + 1);
+                } else if (level <= 2) {
+                    detail::filterRow(1, row, prior, row_bytes, 3, out);
+                } else {
+                    detail::filterRowAdaptive(row, prior, row_bytes, 3, out, scratch);
+                }
+            }
+        }
+    });
+
+    pool.parallelFor(0, stripes, 1, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> compressed;
+        for (size_t s = begin; s < end; ++s) {
+            const size_t offset = s * stripe_rows * line;
+            const size_t size = std::min<size_t>(stripe_rows * line, filtered.size() - offset);
+            const uint8_t* data = filtered.data() + offset;
+            const bool last = s + 1 == static_cast<size_t>(stripes);
+
+            if (level == 0) {
+                detail::storeStripe(data, size, last, compressed);
+            } else {
+                const size_t dict = std::min(offset, kWindow);
+                if (!detail::deflateStripe(data, size, data - dict, dict, level, last, compressed)) {
+                    failed = true;
+                    return;
+                }
+            }
+            adlers[s] = adler32(adler32(0, nullptr, 0), data, static_cast<uInt>(size));
+            sizes[s] = size;
+
+            std::vector<uint8_t>& chunk = chunks[s];
+            chunk.reserve(compressed.size() + 16);
+            if (s == 0) {
+                // zlib header: deflate, 32K window, FLEVEL from the level
+                const uint8_t flevel = level == 0 || level == 1 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+                uint8_t header[2] = { 0x78, static_cast<uint8_t>(flevel << 6) };
+                header[1] |= static_cast<uint8_t>((31 - ((header[0] << 8) | header[1]) % 31) % 31);
+                compressed.insert(compressed.begin(), header, header + 2);
+            }
+            detail::putChunk(chunk, "IDAT", compressed.data(), compressed.size());
+        }
+    });
+
+    if (failed) return false;
+
+    uLong adler = adler32(0, nullptr, 0);
+    for (int s = 0; s < stripes; ++s) adler = adler32_combine(adler, adlers[s], static_cast<z_off_t>(sizes[s]));
+
+    size_t total = 64;
+    for (const auto& c : chunks) total += c.size();
+    png.reserve(total);
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    png.insert(png.end(), signature, signature + 8);
+
+    std::vector<uint8_t> ihdr;
+    detail::putBE32(ihdr, static_cast<uint32_t>(width));
+    detail::putBE32(ihdr, static_cast<uint32_t>(height));
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 }); // 8-bit RGB, deflate, adaptive filtering, no interlace
+    detail::putChunk(png, "IHDR", ihdr.data(), ihdr.size());
+
+    for (const auto& c : chunks) png.insert(png.end(), c.begin(), c.end());
+    std::vector<uint8_t> trailer;
+    detail::putBE32(trailer, static_cast<uint32_t>(adler));
+    detail::putChunk(png, "IDAT", trailer.data(), trailer.size());
+    detail::putChunk(png, "IEND", nullptr, 0);
+    return true;
+}
+
+inline bool writePNG(const Picture& image, const std::string& filename, const PngOptions& options = {},
+                     ThreadPool& pool = defaultThreadPool()) {
+    std::vector<uint8_t> png;
+    if (!encodePNG(image, png, options, pool)) return false;
+    std::unique_ptr<FILE, FileCloser> file(std::fopen(filename.c_str(), "wb"));
+    if (!file) return false;
+    return std::fwrite(png.data(), 1, png.size(), file.get()) == png.size();
+}
+
+}
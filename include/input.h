@@ -0,0 +1,159 @@
+﻿#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Camera input independent of where it comes from: a window, a terminal or a
+// recording. Sources only produce InputState snapshots; edge detection and
+// the queries the camera uses live in InputSource.
+enum class InputKey : uint8_t {
+    Forward,
+    Back,
+    Left,
+    Right,
+    Up,
+    Down,
+    Sprint,
+    Reset,
+    kCount,
+};
+
+struct InputState {
+    uint32_t keys = 0;        // bit per InputKey held down
+    float mouse_dx = 0.f;     // pointer motion since the previous state
+    float mouse_dy = 0.f;
+
+    bool isDown(InputKey key) const { return (keys >> static_cast<unsigned>(key)) & 1u; }
+    void press(InputKey key) { keys |= 1u << static_cast<unsigned>(key); }
+};
+
+class InputSource {
+private:
+    InputState current_;
+    InputState previous_;
+
+protected:
+    // Next snapshot, called once per update().
+    virtual InputState poll() = 0;
+
+public:
+    virtual ~InputSource() = default;
+
+    // Samples the source; call once per frame before reading it.
+    void update() {
+        previous_ = current_;
+        current_ = poll();
+    }
+
+    const InputState& state() const { return current_; }
+    bool isKeyDown(InputKey key) const { return current_.isDown(key); }
+    // went down with the last update
+    bool isKeyPressed(InputKey key) const { return current_.isDown(key) && !previous_.isDown(key); }
+};
+
+// Passes another source through and writes every state it produces with the
+// time since the first update, one frame per line:
+//
+//   <seconds> <keys, hex> <mouse dx> <mouse dy>
+//
+// Floats are written with enough digits to read back bit-exactly.
+class InputRecorder : public InputSource {
+private:
+    InputSource& source_;
+    std::ofstream out_;
+    std::chrono::steady_clock::time_point start_;
+    bool started_ = false;
+
+protected:
+    InputState poll() override {
+        source_.update();
+        const auto now = std::chrono::steady_clock::now();
+        if (!started_) {
+            start_ = now;
+            started_ = true;
+        }
+        const InputState& s = source_.state();
+        char line[96];
+        const int n = std::snprintf(line, sizeof(line), "%.6f %x %.9g %.9g\n",
+                                    std::chrono::duration<double>(now - start_).count(), s.keys, s.mouse_dx, s.mouse_dy);
+        out_.write(line, n);
+        return s;
+    }
+
+public:
+    InputRecorder(InputSource& source, const std::string& path) : source_(source), out_(path) {
+        if (!out_) throw std::runtime_error("cannot write input recording " + path);
+        out_ << "# input recording v1: seconds keys mouse_dx mouse_dy\n";
+    }
+};
+
+// Plays a recording back at a fixed timestep. Update k covers the recorded
+// interval [k * timestep, (k + 1) * timestep) and yields the keys held in
+// any sample there and the summed mouse motion, so nothing is lost when the
+// recording ran at another frame rate; an interval without samples keeps the
+// keys and has no motion. Playback depends only on the file and the
+// timestep, so every replay drives the camera along bit-identical paths.
+class InputPlayer : public InputSource {
+private:
+    struct Sample {
+        double time;
+        InputState state;
+    };
+    std::vector<Sample> samples_;
+    double timestep_ = 1.0 / 60;
+    size_t next_ = 0;
+    size_t step_ = 0;
+    uint32_t held_ = 0;
+
+protected:
+    InputState poll() override {
+        InputState s;
+        s.keys = held_;
+        const double end = static_cast<double>(step_ + 1) * timestep_;
+        bool any = false;
+        for (; next_ < samples_.size() && samples_[next_].time < end; ++next_) {
+            const InputState& r = samples_[next_].state;
+            s.keys = any ? s.keys | r.keys : r.keys;
+            s.mouse_dx += r.mouse_dx;
+            s.mouse_dy += r.mouse_dy;
+            any = true;
+        }
+        if (any) held_ = samples_[next_ - 1].state.keys;
+        ++step_;
+        return s;
+    }
+
+public:
+    // timestep 0 uses the recording's mean frame interval.
+    explicit InputPlayer(const std::string& path, double timestep = 0) {
+        std::ifstream in(path);
+        if (!in) throw std::runtime_error("cannot open input recording " + path);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream iss(line);
+            Sample s;
+            if (!(iss >> s.time >> std::hex >> s.state.keys >> std::dec >> s.state.mouse_dx >> s.state.mouse_dy))
+                throw std::runtime_error("invalid input recording line: " + line);
+            samples_.push_back(s);
+        }
+        if (samples_.empty()) throw std::runtime_error("empty input recording " + path);
+        // time is relative to the first sample
+        const double first = samples_.front().time;
+        for (Sample& s : samples_) s.time -= first;
+        if (timestep > 0) timestep_ = timestep;
+        else if (samples_.size() > 1) timestep_ = samples_.back().time / static_cast<double>(samples_.size() - 1);
+        if (!(timestep_ > 0)) timestep_ = 1.0 / 60;
+    }
+
+    double timestep() const { return timestep_; }
+    // updates that play the whole recording
+    size_t frames() const { return static_cast<size_t>(std::floor(samples_.back().time / timestep_)) + 1; }
+    bool finished() const { return next_ >= samples_.size(); }
+};
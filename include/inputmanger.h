@@ -1,8 +1,9 @@
 ﻿#pragma once
 #include <Windows.h>
+#include "input.h"
 #include <unordered_map>
 #include <vector>
-class WindowsInputManager {
+class WindowsInputManager : public InputSource {
 public:
     struct MouseState {
         float deltaX = 0.0f;
@@ -31,11 +32,8 @@ public:
         resetMousePosition();
     }
     
-    // 每帧更新
-    void update() {
-        updateKeyboardState();
-        updateMouseState();
-    }
+    using InputSource::isKeyDown;
+    using InputSource::isKeyPressed;
     
     // 鼠标控制
     void captureMouse(bool capture) {
@@ -69,12 +67,31 @@ public:
     float getMovementSpeed() const { return movementSpeed_; }
     void setMovementSpeed(float speed) { movementSpeed_ = speed; }
 
+protected:
+    // Samples keyboard and mouse and maps the virtual keys to camera keys.
+    InputState poll() override {
+        updateKeyboardState();
+        updateMouseState();
+        InputState state;
+        const struct { int vk; InputKey key; } bindings[] = {
+            { 'W', InputKey::Forward }, { 'S', InputKey::Back }, { 'A', InputKey::Left }, { 'D', InputKey::Right },
+            { VK_SPACE, InputKey::Up }, { VK_CONTROL, InputKey::Down }, { VK_SHIFT, InputKey::Sprint },
+            { 'R', InputKey::Reset },
+        };
+        for (const auto& b : bindings) {
+            if (isKeyDown(b.vk)) state.press(b.key);
+        }
+        state.mouse_dx = mouseState_.deltaX;
+        state.mouse_dy = mouseState_.deltaY;
+        return state;
+    }
+
 private:
     void updateKeyboardState() {
         prevKeyStates_ = keyStates_;
         
         int keysToCheck[] = {
-            'W', 'S', 'A', 'D', 'Q', 'E', VK_SPACE, VK_SHIFT, VK_CONTROL,
+            'W', 'S', 'A', 'D', 'Q', 'E', 'R', VK_SPACE, VK_SHIFT, VK_CONTROL,
             VK_ESCAPE, VK_UP, VK_DOWN, VK_LEFT, VK_RIGHT, VK_RBUTTON, VK_LBUTTON
         };
         
@@ -3,6 +3,11 @@
 #include <vector>
 #include <iomanip>
 #include <math.h>
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <stdexcept>
+#include <immintrin.h>
 
 #define PI 3.14159265358979323846
 
@@ -305,6 +310,71 @@ inline void transform_batch_aos(
     }
 }
 
+// Same as transform_batch_aos but reads 16-bit quantized positions. The
+// dequantization p = lo + q * scale is folded into the matrix columns, so the
+// loop only adds a widen + convert per lane.
+inline void transform_batch_quantized(
+    vec4* out, const float* M,
+    const uint16_t* qx, const uint16_t* qy, const uint16_t* qz,
+    size_t n, const vec3& lo, const vec3& scale) noexcept
+{
+    alignas(16) float Q[16];
+    for (int r = 0; r < 4; ++r) {
+        Q[0 + r]  = M[0 + r] * scale.x;
+        Q[4 + r]  = M[4 + r] * scale.y;
+        Q[8 + r]  = M[8 + r] * scale.z;
+        Q[12 + r] = M[0 + r] * lo.x + M[4 + r] * lo.y + M[8 + r] * lo.z + M[12 + r];
+    }
+    const __m128 c0 = _mm_load_ps(Q + 0);
+    const __m128 c1 = _mm_load_ps(Q + 4);
+    const __m128 c2 = _mm_load_ps(Q + 8);
+    const __m128 c3 = _mm_load_ps(Q + 12);
+
+    auto widen = [](const uint16_t* p) {
+        return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+    };
+
+    for (size_t i = 0; i + 3 < n; i += 4) {
+        __m128 X = widen(qx + i);
+        __m128 Y = widen(qy + i);
+        __m128 Z = widen(qz + i);
+
+        __m128 T0 = \
+            _mm_fmadd_ps(_mm_shuffle_ps(X, X, _MM_SHUFFLE(0,0,0,0)), c0,
+            _mm_fmadd_ps(_mm_shuffle_ps(Y, Y, _MM_SHUFFLE(0,0,0,0)), c1,
+            _mm_fmadd_ps(_mm_shuffle_ps(Z, Z, _MM_SHUFFLE(0,0,0,0)), c2, c3)));
+
+        __m128 T1 = \
+            _mm_fmadd_ps(_mm_shuffle_ps(X, X, _MM_SHUFFLE(1,1,1,1)), c0,
+            _mm_fmadd_ps(_mm_shuffle_ps(Y, Y, _MM_SHUFFLE(1,1,1,1)), c1,
+            _mm_fmadd_ps(_mm_shuffle_ps(Z, Z, _MM_SHUFFLE(1,1,1,1)), c2, c3)));
+
+        __m128 T2 = \
+            _mm_fmadd_ps(_mm_shuffle_ps(X, X, _MM_SHUFFLE(2,2,2,2)), c0,
+            _mm_fmadd_ps(_mm_shuffle_ps(Y, Y, _MM_SHUFFLE(2,2,2,2)), c1,
+            _mm_fmadd_ps(_mm_shuffle_ps(Z, Z, _MM_SHUFFLE(2,2,2,2)), c2, c3)));
+
+        __m128 T3 = \
+            _mm_fmadd_ps(_mm_shuffle_ps(X, X, _MM_SHUFFLE(3,3,3,3)), c0,
+            _mm_fmadd_ps(_mm_shuffle_ps(Y, Y, _MM_SHUFFLE(3,3,3,3)), c1,
+            _mm_fmadd_ps(_mm_shuffle_ps(Z, Z, _MM_SHUFFLE(3,3,3,3)), c2, c3)));
+
+        _mm_storeu_ps((float*)out + 4*i, T0);
+        _mm_storeu_ps((float*)out + 4*i + 4, T1);
+        _mm_storeu_ps((float*)out + 4*i + 8, T2);
+        _mm_storeu_ps((float*)out + 4*i + 12, T3);
+    }
+
+    for (size_t i = n & ~3; i < n; ++i) {
+        float x = qx[i], y = qy[i], z = qz[i];
+        out[i] = vec4{
+            Q[0]*x + Q[4]*y + Q[ 8]*z + Q[12],
+            Q[1]*x + Q[5]*y + Q[ 9]*z + Q[13],
+            Q[2]*x + Q[6]*y + Q[10]*z + Q[14],
+            Q[3]*x + Q[7]*y + Q[11]*z + Q[15] };
+    }
+}
+
 
 Matrix getRotateMatrix(float x_angle, float y_angle, float z_angle){
     Matrix Rx(4,4);
@@ -1,12 +1,20 @@
 ﻿#pragma once 
 
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <optional>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <iostream>
-#include <format>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
 #include "linear.h"
+#include "profiler.h"
+#include "threadpool.h"
 
 class Model;
 
@@ -22,6 +30,47 @@ namespace model{
     std::vector<float> x, y, z;
     };
 
+    struct Material {
+        std::string name;
+        vec3 diffuse{1.f, 1.f, 1.f};   // Kd
+        std::string diffuse_map;       // map_Kd, resolved against the .mtl directory
+    };
+
+    // Triangles [first, first + count) all use materials[material].
+    struct MaterialRange {
+        unsigned int material;
+        size_t first;
+        size_t count;
+    };
+
+    // Index stream that drops to 16-bit storage when every index fits.
+    struct IndexBuffer {
+        std::vector<uint16_t> narrow;
+        std::vector<Triangle> wide;
+
+        size_t size() const { return narrow.empty() ? wide.size() : narrow.size() / 3; }
+        bool empty() const { return size() == 0; }
+
+        Triangle operator[](size_t i) const {
+            if (narrow.empty()) return wide[i];
+            return Triangle(narrow[3 * i], narrow[3 * i + 1], narrow[3 * i + 2]);
+        }
+    };
+
+    // Quantized vertex data: positions are 16-bit unorm inside the model AABB,
+    // normals are octahedral snorm16 pairs and texcoords are half floats.
+    struct CompactMesh {
+        vec3 bounds_min;
+        vec3 bounds_scale; // p = bounds_min + q * bounds_scale
+        std::vector<uint16_t> qx, qy, qz;
+        std::vector<uint32_t> normals;
+        std::vector<uint32_t> texcoords;
+
+        IndexBuffer verticle_idx;
+        IndexBuffer texture_idx;
+        IndexBuffer normal_idx;
+    };
+
     class Model {
     public:
         Model() = default;
@@ -39,8 +88,185 @@ namespace model{
 
         std::vector<vec4> transfromed_vertices;
         MeshSoA mesh;
+
+        // Triangles are sorted by material at load time, one range per material.
+        std::vector<Material> materials;
+        std::vector<MaterialRange> material_ranges;
+        std::vector<std::string> groups; // names from 'o' and 'g'
+
+        bool isCompact = false;
+        CompactMesh compact;
+
+        size_t vertexCount() const { return isCompact ? compact.qx.size() : vertices.size(); }
+
+        size_t triangleCount() const {
+            return isCompact ? compact.verticle_idx.size() : verticle_idx.size();
+        }
+        size_t texcoordTriangleCount() const {
+            return isCompact ? compact.texture_idx.size() : texture_idx.size();
+        }
+        size_t normalTriangleCount() const {
+            return isCompact ? compact.normal_idx.size() : normal_idx.size();
+        }
+
+        Triangle positionTriangle(size_t i) const {
+            return isCompact ? compact.verticle_idx[i] : verticle_idx[i];
+        }
+        Triangle texcoordTriangle(size_t i) const {
+            return isCompact ? compact.texture_idx[i] : texture_idx[i];
+        }
+        Triangle normalTriangle(size_t i) const {
+            return isCompact ? compact.normal_idx[i] : normal_idx[i];
+        }
+
+        vec3 normal(unsigned int i) const;
+        Point2D texcoord(unsigned int i) const;
+
+        size_t byteSize() const {
+            auto bytes = [](const auto& v) { return v.capacity() * sizeof(v[0]); };
+            return bytes(vertices) + bytes(vertex_norm) + bytes(texcoords) +
+                   bytes(verticle_idx) + bytes(texture_idx) + bytes(normal_idx) +
+                   bytes(transfromed_vertices) + bytes(mesh.x) + bytes(mesh.y) + bytes(mesh.z) +
+                   bytes(compact.qx) + bytes(compact.qy) + bytes(compact.qz) +
+                   bytes(compact.normals) + bytes(compact.texcoords) +
+                   bytes(compact.verticle_idx.narrow) + bytes(compact.verticle_idx.wide) +
+                   bytes(compact.texture_idx.narrow) + bytes(compact.texture_idx.wide) +
+                   bytes(compact.normal_idx.narrow) + bytes(compact.normal_idx.wide);
+        }
     }; 
 
+    inline uint32_t encodeOctahedral(const vec3& n) {
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (l1 < 1e-12f) return 0;
+        float px = n.x / l1;
+        float py = n.y / l1;
+        if (n.z < 0) {
+            float ox = (1.f - std::abs(py)) * (px >= 0 ? 1.f : -1.f);
+            float oy = (1.f - std::abs(px)) * (py >= 0 ? 1.f : -1.f);
+            px = ox; py = oy;
+        }
+        auto snorm = [](float v) {
+            return static_cast<uint16_t>(static_cast<int16_t>(std::lround(std::clamp(v, -1.f, 1.f) * 32767.f)));
+        };
+        return static_cast<uint32_t>(snorm(px)) | (static_cast<uint32_t>(snorm(py)) << 16);
+    }
+
+    inline vec3 decodeOctahedral(uint32_t packed) {
+        float px = static_cast<int16_t>(packed & 0xFFFF) * (1.f / 32767.f);
+        float py = static_cast<int16_t>(packed >> 16) * (1.f / 32767.f);
+        vec3 n(px, py, 1.f - std::abs(px) - std::abs(py));
+        float t = std::max(-n.z, 0.f);
+        n.x += n.x >= 0 ? -t : t;
+        n.y += n.y >= 0 ? -t : t;
+        return n.normalize();
+    }
+
+    inline uint32_t encodeHalf2(const Point2D& p) {
+        return static_cast<uint32_t>(_cvtss_sh(p.x, _MM_FROUND_TO_NEAREST_INT)) |
+               (static_cast<uint32_t>(_cvtss_sh(p.y, _MM_FROUND_TO_NEAREST_INT)) << 16);
+    }
+
+    inline Point2D decodeHalf2(uint32_t packed) {
+        return Point2D(_cvtsh_ss(static_cast<unsigned short>(packed & 0xFFFF)),
+                       _cvtsh_ss(static_cast<unsigned short>(packed >> 16)));
+    }
+
+    inline vec3 Model::normal(unsigned int i) const {
+        return isCompact ? decodeOctahedral(compact.normals[i]) : vertex_norm[i];
+    }
+
+    inline Point2D Model::texcoord(unsigned int i) const {
+        return isCompact ? decodeHalf2(compact.texcoords[i]) : texcoords[i];
+    }
+
+    inline IndexBuffer packIndices(std::vector<Triangle>& src, size_t attribute_count) {
+        IndexBuffer out;
+        if (attribute_count <= 0x10000) {
+            out.narrow.reserve(src.size() * 3);
+            for (const auto& t : src) {
+                out.narrow.push_back(static_cast<uint16_t>(t.v0));
+                out.narrow.push_back(static_cast<uint16_t>(t.v1));
+                out.narrow.push_back(static_cast<uint16_t>(t.v2));
+            }
+        } else {
+            out.wide = std::move(src);
+        }
+        std::vector<Triangle>().swap(src);
+        return out;
+    }
+
+    // Converts a loaded model to the compact representation and releases the
+    // full precision arrays. transfromed_vertices keeps its size.
+    inline void compactModel(Model& model) {
+        if (!model.isLoaded || model.isCompact) return;
+        CompactMesh& c = model.compact;
+
+        vec3 lo(0, 0, 0), hi(0, 0, 0);
+        if (!model.vertices.empty()) {
+            lo = hi = model.vertices[0];
+            for (const auto& v : model.vertices) {
+                lo = vec3(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+                hi = vec3(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+            }
+        }
+        vec3 extent = hi - lo;
+        c.bounds_min = lo;
+        c.bounds_scale = extent / 65535.f;
+        auto quantize = [](float v, float lo, float extent) {
+            if (extent <= 0) return static_cast<uint16_t>(0);
+            return static_cast<uint16_t>(std::lround(std::clamp((v - lo) / extent, 0.f, 1.f) * 65535.f));
+        };
+
+        const size_t n = model.vertices.size();
+        c.qx.resize(n); c.qy.resize(n); c.qz.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            c.qx[i] = quantize(model.vertices[i].x, lo.x, extent.x);
+            c.qy[i] = quantize(model.vertices[i].y, lo.y, extent.y);
+            c.qz[i] = quantize(model.vertices[i].z, lo.z, extent.z);
+        }
+
+        c.normals.reserve(model.vertex_norm.size());
+        for (const auto& nrm : model.vertex_norm) c.normals.push_back(encodeOctahedral(nrm));
+        c.texcoords.reserve(model.texcoords.size());
+        for (const auto& uv : model.texcoords) c.texcoords.push_back(encodeHalf2(uv));
+
+        c.verticle_idx = packIndices(model.verticle_idx, n);
+        c.texture_idx = packIndices(model.texture_idx, model.texcoords.size());
+        c.normal_idx = packIndices(model.normal_idx, model.vertex_norm.size());
+
+        std::vector<vec3>().swap(model.vertices);
+        std::vector<vec3>().swap(model.vertex_norm);
+        std::vector<Point2D>().swap(model.texcoords);
+        model.mesh = MeshSoA{};
+        model.isCompact = true;
+    }
+
+    // Writes the clip-space vertices into out, leaving the model untouched so
+    // several renders can share one loaded model. Batches of vertices are
+    // transformed as jobs on pool.
+    inline void transformModel(const Model& model, const Matrix& MVP, std::vector<vec4>& out,
+                               ThreadPool& pool = defaultThreadPool()) {
+        PROFILE_ZONE("transform");
+        out.resize(model.vertexCount());
+        pool.parallelFor(0, out.size(), 16384, [&](size_t begin, size_t end) {
+            PROFILE_WORK("transform");
+            if (model.isCompact) {
+                const CompactMesh& c = model.compact;
+                transform_batch_quantized(out.data() + begin, MVP.data().data(),
+                    c.qx.data() + begin, c.qy.data() + begin, c.qz.data() + begin, end - begin,
+                    c.bounds_min, c.bounds_scale);
+            } else {
+                transform_batch_aos(out.data() + begin, MVP.data().data(),
+                    model.mesh.x.data() + begin, model.mesh.y.data() + begin, model.mesh.z.data() + begin,
+                    end - begin);
+            }
+        });
+    }
+
+    inline void transformModel(Model& model, const Matrix& MVP, ThreadPool& pool = defaultThreadPool()) {
+        transformModel(model, MVP, model.transfromed_vertices, pool);
+    }
+
 
 
     inline MeshSoA to_soa(const std::vector<vec3>& vertices) {
@@ -54,7 +280,81 @@ namespace model{
     }
     return out;
 }
+    // Rest of the line after the keyword, without leading blanks or the '\r'
+    // left by CRLF files.
+    inline std::string restOfLine(std::istringstream& iss) {
+        std::string rest;
+        std::getline(iss >> std::ws, rest);
+        if (!rest.empty() && rest.back() == '\r') rest.pop_back();
+        return rest;
+    }
+
+    inline void loadMaterialLibrary(const std::filesystem::path& filename, std::vector<Material>& materials){
+        std::ifstream fin(filename, std::ios::in);
+        if (!fin) {
+            std::cerr << "Fail to open material library: " << filename.string() << std::endl;
+            return;
+        }
+        const auto base_dir = filename.parent_path();
+
+        Material* current = nullptr;
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.empty()) continue;
+
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            if (token == "newmtl") {
+                Material m;
+                m.name = restOfLine(iss);
+                materials.push_back(std::move(m));
+                current = &materials.back();
+            } else if (!current) {
+                continue;
+            } else if (token == "Kd") {
+                float r, g, b;
+                if (iss >> r >> g >> b) current->diffuse = vec3(r, g, b);
+            } else if (token == "map_Kd") {
+                // options such as -bm or -o come first, the file name is last
+                std::string arg, path;
+                while (iss >> arg) path = arg;
+                if (!path.empty()) current->diffuse_map = (base_dir / path).generic_string();
+            }
+        }
+    }
+
+    // Stable-sorts triangles by material and records one range per material.
+    inline void sortByMaterial(Model& model, const std::vector<unsigned int>& tri_material){
+        const size_t n = model.verticle_idx.size();
+        std::vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return tri_material[a] < tri_material[b];
+        });
+
+        auto permute = [&](std::vector<Triangle>& tris) {
+            if (tris.size() != n) return;
+            std::vector<Triangle> sorted;
+            sorted.reserve(n);
+            for (size_t i : order) sorted.push_back(tris[i]);
+            tris = std::move(sorted);
+        };
+        permute(model.verticle_idx);
+        permute(model.texture_idx);
+        permute(model.normal_idx);
+
+        model.material_ranges.clear();
+        for (size_t i = 0; i < n; ++i) {
+            unsigned int m = tri_material[order[i]];
+            if (model.material_ranges.empty() || model.material_ranges.back().material != m)
+                model.material_ranges.push_back({m, i, 0});
+            model.material_ranges.back().count++;
+        }
+    }
+
     Model loadModel(const std::string& filename){
+        PROFILE_ZONE("loadModel");
         Model model_dst;
         std::ifstream  fin;
         fin.open(filename,std::ios::in);
@@ -71,6 +371,12 @@ namespace model{
         model_dst.texture_idx.clear();
         model_dst.normal_idx.clear();
 
+        constexpr unsigned int kNoMaterial = ~0u;
+        const auto obj_dir = std::filesystem::path(filename).parent_path();
+        std::unordered_map<std::string, unsigned int> material_lookup;
+        std::vector<unsigned int> tri_material;
+        unsigned int current_material = kNoMaterial;
+
         std::string line;
         while (std::getline(fin, line)) {
             if (line.empty()) continue;
@@ -101,6 +407,26 @@ namespace model{
                 } else {
                     std::cerr << "Invalid verticle: " << line << std::endl;
                 }
+            }else if (token == "mtllib") {
+                const std::string lib = restOfLine(iss);
+                size_t first = model_dst.materials.size();
+                loadMaterialLibrary(obj_dir / lib, model_dst.materials);
+                for (size_t m = first; m < model_dst.materials.size(); ++m)
+                    material_lookup.try_emplace(model_dst.materials[m].name, static_cast<unsigned int>(m));
+            }else if (token == "usemtl") {
+                const std::string name = restOfLine(iss);
+                auto it = material_lookup.find(name);
+                if (it == material_lookup.end()) {
+                    // referenced but never defined: keep it as its own batch
+                    Material m;
+                    m.name = name;
+                    model_dst.materials.push_back(std::move(m));
+                    it = material_lookup.emplace(name, static_cast<unsigned int>(model_dst.materials.size() - 1)).first;
+                }
+                current_material = it->second;
+            }else if (token == "o" || token == "g") {
+                const std::string name = restOfLine(iss);
+                model_dst.groups.push_back(name);
             }else if (token == "f") {
                 std::string faceToken;
 
@@ -154,6 +480,7 @@ namespace model{
                 if (n >= 3) {
                     for (size_t i = 1; i + 1 < n; ++i) {
                         model_dst.verticle_idx.emplace_back(v_idx[0], v_idx[i], v_idx[i + 1]);
+                        tri_material.push_back(current_material);
 
                         if (vt_idx.size() == n)
                             model_dst.texture_idx.emplace_back(vt_idx[0], vt_idx[i], vt_idx[i + 1]);
@@ -168,10 +495,21 @@ namespace model{
         }
 
         fin.close();
-        printf("Veticles count:%d\n", model_dst.vertices.size());
-        printf("Normal count:%d\n", model_dst.vertex_norm.size());
-        printf("TextureCoord count:%d\n", model_dst.texcoords.size());
-        printf("Face count:%d\n", model_dst.verticle_idx.size());
+
+        if (std::find(tri_material.begin(), tri_material.end(), kNoMaterial) != tri_material.end()) {
+            Material m;
+            m.name = "default";
+            model_dst.materials.push_back(std::move(m));
+            auto default_id = static_cast<unsigned int>(model_dst.materials.size() - 1);
+            std::replace(tri_material.begin(), tri_material.end(), kNoMaterial, default_id);
+        }
+        sortByMaterial(model_dst, tri_material);
+
+        printf("Veticles count:%zu\n", model_dst.vertices.size());
+        printf("Normal count:%zu\n", model_dst.vertex_norm.size());
+        printf("TextureCoord count:%zu\n", model_dst.texcoords.size());
+        printf("Face count:%zu\n", model_dst.verticle_idx.size());
+        printf("Material count:%zu\n", model_dst.materials.size());
         model_dst.isLoaded = true;
         model_dst.transfromed_vertices.resize(model_dst.vertices.size());
         model_dst.mesh = to_soa(model_dst.vertices);
@@ -182,26 +520,478 @@ namespace model{
 #include <png.h>
 namespace texture {
 
+// Texels are packed RGBA8 with R in the lowest byte, i.e. the byte order
+// libpng produces for RGBA rows.
+inline uint32_t packRGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) {
+    return static_cast<uint32_t>(r) | (static_cast<uint32_t>(g) << 8) |
+           (static_cast<uint32_t>(b) << 16) | (static_cast<uint32_t>(a) << 24);
+}
+
+inline vec3 unpackRGB(uint32_t c) {
+    return vec3(static_cast<float>(c & 0xFF), static_cast<float>((c >> 8) & 0xFF),
+                static_cast<float>((c >> 16) & 0xFF));
+}
+
+struct SrgbTables {
+    static constexpr int kEncodeSteps = 4096;
+    float to_linear[256];
+    uint32_t from_linear[kEncodeSteps + 1];
+
+    SrgbTables() {
+        for (int i = 0; i < 256; ++i) {
+            float c = i / 255.f;
+            to_linear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for (int i = 0; i <= kEncodeSteps; ++i) {
+            float l = static_cast<float>(i) / kEncodeSteps;
+            float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.f / 2.4f) - 0.055f;
+            from_linear[i] = static_cast<uint32_t>(std::lround(std::clamp(c, 0.f, 1.f) * 255.f));
+        }
+    }
+};
+
+inline const SrgbTables& srgbTables() {
+    static const SrgbTables tables;
+    return tables;
+}
+
+// Scales the colour of a texel by brightness, in linear light when srgb is set.
+inline uint32_t shadeTexel(uint32_t texel, float brightness, bool srgb) {
+    uint32_t ch[3] = { texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF };
+    if (srgb) {
+        const auto& t = srgbTables();
+        for (auto& c : ch) {
+            int idx = static_cast<int>(t.to_linear[c] * brightness * SrgbTables::kEncodeSteps + 0.5f);
+            c = t.from_linear[std::clamp(idx, 0, SrgbTables::kEncodeSteps)];
+        }
+    } else {
+        for (auto& c : ch) c = static_cast<uint32_t>(std::clamp(c * brightness, 0.f, 255.f));
+    }
+    return ch[0] | (ch[1] << 8) | (ch[2] << 16) | (texel & 0xFF000000u);
+}
+
+// 8-wide shadeTexel.
+inline __m256i shadeTexels8(__m256i texels, float brightness, bool srgb) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i ch[3] = {
+        _mm256_and_si256(texels, mask),
+        _mm256_and_si256(_mm256_srli_epi32(texels, 8), mask),
+        _mm256_and_si256(_mm256_srli_epi32(texels, 16), mask),
+    };
+    const __m256 b = _mm256_set1_ps(brightness);
+    if (srgb) {
+        const auto& t = srgbTables();
+        const __m256 steps = _mm256_set1_ps(static_cast<float>(SrgbTables::kEncodeSteps));
+        const __m256i hi = _mm256_set1_epi32(SrgbTables::kEncodeSteps);
+        for (auto& c : ch) {
+            __m256 l = _mm256_mul_ps(_mm256_i32gather_ps(t.to_linear, c, 4), b);
+            __m256i idx = _mm256_cvtps_epi32(_mm256_mul_ps(l, steps));
+            idx = _mm256_min_epi32(_mm256_max_epi32(idx, _mm256_setzero_si256()), hi);
+            c = _mm256_i32gather_epi32(reinterpret_cast<const int*>(t.from_linear), idx, 4);
+        }
+    } else {
+        for (auto& c : ch) {
+            __m256i v = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(c), b));
+            c = _mm256_min_epi32(_mm256_max_epi32(v, _mm256_setzero_si256()), mask);
+        }
+    }
+    __m256i alpha = _mm256_and_si256(texels, _mm256_set1_epi32(static_cast<int>(0xFF000000u)));
+    return _mm256_or_si256(_mm256_or_si256(ch[0], _mm256_slli_epi32(ch[1], 8)),
+                           _mm256_or_si256(_mm256_slli_epi32(ch[2], 16), alpha));
+}
+
+enum class Filter {
+    Nearest,    // level 0 only
+    NearestMip, // nearest texel of the nearest mip
+    Bilinear,   // bilinear within the nearest mip
+    Trilinear,  // bilinear in two mips, blended by the LOD fraction
+};
+
+// Texel order inside each mip level.
+enum class Layout {
+    Linear,   // row-major, data[offset + y * pitch + x]
+    Tiled4x4, // 4x4 tiles of 64 bytes, Z-order inside a tile, tiles row-major
+    Tiled8x8, // 8x8 tiles, Z-order inside a tile, tiles row-major
+};
+
+inline int tileShift(Layout layout) {
+    return layout == Layout::Tiled4x4 ? 2 : layout == Layout::Tiled8x8 ? 3 : 0;
+}
+
+// Spreads the low 3 bits of v to even bit positions.
+inline uint32_t spreadBits3(uint32_t v) {
+    v = (v | (v << 2)) & 0x13;
+    return (v | (v << 1)) & 0x15;
+}
+
+inline __m256i spreadBits3(__m256i v) {
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)), _mm256_set1_epi32(0x13));
+    return _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 1)), _mm256_set1_epi32(0x15));
+}
+
+// Storage of the texels. The block formats keep 4x4 blocks in Texture::data
+// (BC1: 2 words per block, BC7: 4 words) and ignore Layout.
+enum class Format {
+    RGBA8,
+    BC1, // 4 bpp, opaque colour
+    BC7, // 8 bpp, RGBA; only mode 6 (single subset, 4-bit indices) is decoded
+};
+
+inline int blockWords(Format format) {
+    return format == Format::BC1 ? 2 : format == Format::BC7 ? 4 : 1;
+}
+
+inline uint32_t rgb565ToRGBA(uint32_t c) {
+    uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return packRGBA(static_cast<uint8_t>((r << 3) | (r >> 2)), static_cast<uint8_t>((g << 2) | (g >> 4)),
+                    static_cast<uint8_t>((b << 3) | (b >> 2)));
+}
+
+// Texel i (row-major inside the block) of a BC1 block.
+inline uint32_t decodeBC1Texel(const uint32_t* block, int i) {
+    const uint32_t c0 = block[0] & 0xFFFF, c1 = block[0] >> 16;
+    const uint32_t sel = (block[1] >> (2 * i)) & 3;
+    if (sel < 2) return rgb565ToRGBA(sel == 0 ? c0 : c1);
+    const uint32_t a = rgb565ToRGBA(c0), b = rgb565ToRGBA(c1);
+    uint32_t out = 0xFF000000u;
+    for (int shift = 0; shift < 24; shift += 8) {
+        uint32_t ca = (a >> shift) & 0xFF, cb = (b >> shift) & 0xFF;
+        uint32_t c;
+        if (c0 > c1) c = sel == 2 ? (2 * ca + cb) / 3 : (ca + 2 * cb) / 3;
+        else if (sel == 2) c = (ca + cb) / 2;
+        else return 0; // transparent black in 3-colour mode
+        out |= c << shift;
+    }
+    return out;
+}
+
+inline uint32_t blockBits(const uint32_t* block, int pos, int count) {
+    uint64_t pair = block[pos >> 5];
+    if ((pos >> 5) < 3) pair |= static_cast<uint64_t>(block[(pos >> 5) + 1]) << 32;
+    return static_cast<uint32_t>(pair >> (pos & 31)) & ((1u << count) - 1);
+}
+
+inline constexpr uint8_t kBC7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Texel i of a BC7 mode 6 block; other modes decode as magenta.
+inline uint32_t decodeBC7Texel(const uint32_t* block, int i) {
+    if ((block[0] & 0x7F) != 0x40) return packRGBA(255, 0, 255);
+    const uint32_t p0 = blockBits(block, 63, 1), p1 = blockBits(block, 64, 1);
+    const uint32_t index = i == 0 ? blockBits(block, 65, 3) : blockBits(block, 68 + (i - 1) * 4, 4);
+    const uint32_t w = kBC7Weights4[index];
+    uint32_t out = 0;
+    for (int c = 0; c < 4; ++c) {
+        uint32_t e0 = (blockBits(block, 7 + c * 14, 7) << 1) | p0;
+        uint32_t e1 = (blockBits(block, 14 + c * 14, 7) << 1) | p1;
+        out |= (((64 - w) * e0 + w * e1 + 32) >> 6) << (8 * c);
+    }
+    return out;
+}
+
+// Texel ranges of one mip inside Texture::data. Plain ints so the sampler can
+// fetch the fields of a per-lane level with gathers. pitch is the row length
+// in texels for Linear and in tiles for the tiled layouts.
+struct MipLevel {
+    int width;
+    int height;
+    int offset;
+    int pitch;
+};
+
+// Per-lane copy of a MipLevel.
+struct MipLanes {
+    __m256i width, height, offset, pitch;
+    __m256 fwidth, fheight;
+};
+
+// Blends each RGBA8 channel of a towards b by t.
+inline __m256i lerpTexels8(__m256i a, __m256i b, __m256 t) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i out = _mm256_setzero_si256();
+    for (int shift = 0; shift < 32; shift += 8) {
+        __m256 ca = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(a, shift), mask));
+        __m256 cb = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(b, shift), mask));
+        __m256i c = _mm256_cvtps_epi32(_mm256_fmadd_ps(_mm256_sub_ps(cb, ca), t, ca));
+        out = _mm256_or_si256(out, _mm256_slli_epi32(c, shift));
+    }
+    return out;
+}
+
 struct Texture {
     int width;
     int height;
-    std::vector<vec3> data; // RGB format
+    std::vector<uint32_t> data; // packed RGBA8 (see packRGBA), every mip level back to back
+    std::vector<MipLevel> levels;
+    bool srgb = true;           // colour values are sRGB encoded
+    Filter filter = Filter::Trilinear;
+    Layout layout = Layout::Linear;
+    Format format = Format::RGBA8;
     int isLoaded = false;
 
-    vec3 getColor(float u, float v) const {
-        if(data.empty()) return vec3(255,255,255); // white color as default
-        
+    // Decoded texel at integer coordinates of a level, any layout or format.
+    uint32_t texel(const MipLevel& level, int x, int y) const {
+        if (format == Format::RGBA8) return data[texelIndex(level, x, y)];
+        const uint32_t* block = data.data() + level.offset +
+            (static_cast<size_t>(y >> 2) * level.pitch + (x >> 2)) * blockWords(format);
+        const int i = (y & 3) * 4 + (x & 3);
+        return format == Format::BC1 ? decodeBC1Texel(block, i) : decodeBC7Texel(block, i);
+    }
+
+    size_t texelIndex(const MipLevel& level, int x, int y) const {
+        const int shift = tileShift(layout);
+        if (shift == 0) return level.offset + static_cast<size_t>(y) * level.pitch + x;
+        const int mask = (1 << shift) - 1;
+        size_t tile = static_cast<size_t>(y >> shift) * level.pitch + (x >> shift);
+        return level.offset + (tile << (2 * shift)) + (spreadBits3(x & mask) | (spreadBits3(y & mask) << 1));
+    }
+
+    uint32_t fetch(float u, float v) const {
+        if(data.empty()) return packRGBA(255, 255, 255); // white color as default
+
         int x = std::clamp(static_cast<int>(u * width), 0, width - 1);
         int y = std::clamp(static_cast<int>((1 - v) * height), 0, height - 1);
-        
-        if (x < 0 || x >= width || y < 0 || y >= height) {
-            return vec3(255, 0, 255);
+        if (levels.empty()) return data[y * width + x];
+        return texel(levels[0], x, y);
+    }
+
+    vec3 getColor(float u, float v) const {
+        return unpackRGB(fetch(u, v));
+    }
+
+    // Nearest fetch of 8 texels from level 0 with one AVX2 gather.
+    __m256i sample8(__m256 u, __m256 v) const {
+        if (data.empty()) return _mm256_set1_epi32(static_cast<int>(packRGBA(255, 255, 255)));
+        return nearest8(level0Lanes(), u, v);
+    }
+
+    void sample8(const float* u, const float* v, uint32_t* out) const {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), sample8(_mm256_loadu_ps(u), _mm256_loadu_ps(v)));
+    }
+
+    // Filtered fetch of 8 texels; lod is log2 of the texel footprint at level 0.
+    __m256i sample8(__m256 u, __m256 v, __m256 lod) const {
+        if (data.empty()) return _mm256_set1_epi32(static_cast<int>(packRGBA(255, 255, 255)));
+        if (filter == Filter::Nearest || levels.size() < 2) {
+            return filter == Filter::Bilinear || filter == Filter::Trilinear
+                ? bilinear8(level0Lanes(), u, v) : nearest8(level0Lanes(), u, v);
         }
-        
-        return data[y * width + x];
+
+        const __m256 last = _mm256_set1_ps(static_cast<float>(levels.size() - 1));
+        const __m256 zero = _mm256_setzero_ps();
+        if (filter == Filter::Trilinear) {
+            __m256 l = _mm256_min_ps(_mm256_max_ps(lod, zero), last);
+            __m256 l0 = _mm256_floor_ps(l);
+            __m256 l1 = _mm256_min_ps(_mm256_add_ps(l0, _mm256_set1_ps(1.f)), last);
+            __m256i a = bilinear8(levelLanes(_mm256_cvtps_epi32(l0)), u, v);
+            __m256i b = bilinear8(levelLanes(_mm256_cvtps_epi32(l1)), u, v);
+            return lerpTexels8(a, b, _mm256_sub_ps(l, l0));
+        }
+
+        __m256 l = _mm256_min_ps(_mm256_max_ps(_mm256_round_ps(lod, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), zero), last);
+        MipLanes lanes = levelLanes(_mm256_cvtps_epi32(l));
+        return filter == Filter::Bilinear ? bilinear8(lanes, u, v) : nearest8(lanes, u, v);
+    }
+
+    // LOD from screen-space UV derivatives: log2 of the longer footprint axis
+    // in level-0 texels. Uses the exponent bits as a cheap log2.
+    __m256 lod8(__m256 dudx, __m256 dudy, __m256 dvdx, __m256 dvdy) const {
+        const __m256 w = _mm256_set1_ps(static_cast<float>(width));
+        const __m256 h = _mm256_set1_ps(static_cast<float>(height));
+        dudx = _mm256_mul_ps(dudx, w); dudy = _mm256_mul_ps(dudy, w);
+        dvdx = _mm256_mul_ps(dvdx, h); dvdy = _mm256_mul_ps(dvdy, h);
+        __m256 px = _mm256_fmadd_ps(dudx, dudx, _mm256_mul_ps(dvdx, dvdx));
+        __m256 py = _mm256_fmadd_ps(dudy, dudy, _mm256_mul_ps(dvdy, dvdy));
+        __m256 rho2 = _mm256_max_ps(px, py);
+        __m256 log2_rho2 = _mm256_sub_ps(
+            _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(rho2)), _mm256_set1_ps(1.f / (1 << 23))),
+            _mm256_set1_ps(127.f));
+        return _mm256_mul_ps(log2_rho2, _mm256_set1_ps(0.5f));
+    }
+
+    size_t byteSize() const { return data.size() * sizeof(uint32_t); }
+
+private:
+    MipLanes level0Lanes() const {
+        const int pitch = levels.empty() ? width : levels[0].pitch;
+        return { _mm256_set1_epi32(width), _mm256_set1_epi32(height), _mm256_setzero_si256(), _mm256_set1_epi32(pitch),
+                 _mm256_set1_ps(static_cast<float>(width)), _mm256_set1_ps(static_cast<float>(height)) };
+    }
+
+    MipLanes levelLanes(__m256i level) const {
+        const int* table = reinterpret_cast<const int*>(levels.data());
+        __m256i base = _mm256_slli_epi32(level, 2);
+        MipLanes lanes;
+        lanes.width = _mm256_i32gather_epi32(table, base, 4);
+        lanes.height = _mm256_i32gather_epi32(table, _mm256_add_epi32(base, _mm256_set1_epi32(1)), 4);
+        lanes.offset = _mm256_i32gather_epi32(table, _mm256_add_epi32(base, _mm256_set1_epi32(2)), 4);
+        lanes.pitch = _mm256_i32gather_epi32(table, _mm256_add_epi32(base, _mm256_set1_epi32(3)), 4);
+        lanes.fwidth = _mm256_cvtepi32_ps(lanes.width);
+        lanes.fheight = _mm256_cvtepi32_ps(lanes.height);
+        return lanes;
+    }
+
+    __m256i gather8(const MipLanes& lanes, __m256i x, __m256i y) const {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi32(1);
+        x = _mm256_min_epi32(_mm256_max_epi32(x, zero), _mm256_sub_epi32(lanes.width, one));
+        y = _mm256_min_epi32(_mm256_max_epi32(y, zero), _mm256_sub_epi32(lanes.height, one));
+        if (format != Format::RGBA8) {
+            // block formats decode lane by lane
+            alignas(32) int xs[8], ys[8], offsets[8], pitches[8];
+            alignas(32) uint32_t out[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(xs), x);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(ys), y);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(offsets), lanes.offset);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(pitches), lanes.pitch);
+            for (int l = 0; l < 8; ++l) out[l] = texel(MipLevel{0, 0, offsets[l], pitches[l]}, xs[l], ys[l]);
+            return _mm256_load_si256(reinterpret_cast<const __m256i*>(out));
+        }
+        __m256i idx;
+        const int shift = tileShift(layout);
+        if (shift == 0) {
+            idx = _mm256_add_epi32(lanes.offset, _mm256_add_epi32(_mm256_mullo_epi32(y, lanes.pitch), x));
+        } else {
+            const __m128i count = _mm_cvtsi32_si128(shift);
+            const __m256i mask = _mm256_set1_epi32((1 << shift) - 1);
+            __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(y, count), lanes.pitch),
+                                            _mm256_srl_epi32(x, count));
+            __m256i inner = _mm256_or_si256(spreadBits3(_mm256_and_si256(x, mask)),
+                                            _mm256_slli_epi32(spreadBits3(_mm256_and_si256(y, mask)), 1));
+            idx = _mm256_add_epi32(lanes.offset,
+                                   _mm256_add_epi32(_mm256_sll_epi32(tile, _mm_cvtsi32_si128(2 * shift)), inner));
+        }
+        return _mm256_i32gather_epi32(reinterpret_cast<const int*>(data.data()), idx, 4);
+    }
+
+    __m256i nearest8(const MipLanes& lanes, __m256 u, __m256 v) const {
+        __m256 fx = _mm256_mul_ps(u, lanes.fwidth);
+        __m256 fy = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), v), lanes.fheight);
+        return gather8(lanes, _mm256_cvttps_epi32(fx), _mm256_cvttps_epi32(fy));
+    }
+
+    __m256i bilinear8(const MipLanes& lanes, __m256 u, __m256 v) const {
+        const __m256 half = _mm256_set1_ps(0.5f);
+        __m256 fx = _mm256_fmsub_ps(u, lanes.fwidth, half);
+        __m256 fy = _mm256_fmsub_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), v), lanes.fheight, half);
+        __m256 x0f = _mm256_floor_ps(fx);
+        __m256 y0f = _mm256_floor_ps(fy);
+        __m256 tx = _mm256_sub_ps(fx, x0f);
+        __m256 ty = _mm256_sub_ps(fy, y0f);
+        __m256i x0 = _mm256_cvttps_epi32(x0f);
+        __m256i y0 = _mm256_cvttps_epi32(y0f);
+        __m256i x1 = _mm256_add_epi32(x0, _mm256_set1_epi32(1));
+        __m256i y1 = _mm256_add_epi32(y0, _mm256_set1_epi32(1));
+
+        __m256i top = lerpTexels8(gather8(lanes, x0, y0), gather8(lanes, x1, y0), tx);
+        __m256i bottom = lerpTexels8(gather8(lanes, x0, y1), gather8(lanes, x1, y1), tx);
+        return lerpTexels8(top, bottom, ty);
     }
 };
 
+// 2x2 box filter of src into dst (rows [y_begin, y_end) of dst).
+inline void downsampleRows(const uint32_t* src, int src_w, int src_h,
+                           uint32_t* dst, int dst_w, int y_begin, int y_end) {
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for (int y = y_begin; y < y_end; ++y) {
+        const uint32_t* r0 = src + static_cast<size_t>(std::min(2 * y, src_h - 1)) * src_w;
+        const uint32_t* r1 = src + static_cast<size_t>(std::min(2 * y + 1, src_h - 1)) * src_w;
+        uint32_t* out = dst + static_cast<size_t>(y) * dst_w;
+
+        int x = 0;
+        if (src_w >= 2) {
+            // 8 source texels per row -> 4 output texels
+            for (; x + 4 <= dst_w; x += 4) {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r0 + 2 * x));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r1 + 2 * x));
+                __m256i vert = _mm256_permutevar8x32_epi32(_mm256_avg_epu8(a, b), even);
+                __m128i pair = _mm_avg_epu8(_mm256_castsi256_si128(vert), _mm256_extracti128_si256(vert, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), pair);
+            }
+        }
+        for (; x < dst_w; ++x) {
+            int x0 = std::min(2 * x, src_w - 1);
+            int x1 = std::min(2 * x + 1, src_w - 1);
+            uint32_t texels[4] = { r0[x0], r0[x1], r1[x0], r1[x1] };
+            uint32_t c = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                uint32_t sum = 2;
+                for (uint32_t t : texels) sum += (t >> shift) & 0xFF;
+                c |= (sum / 4) << shift;
+            }
+            out[x] = c;
+        }
+    }
+}
+
+// Fills levels and appends every mip below level 0 to data. Rows of each
+// level are split across the pool.
+inline void buildMipChain(Texture& texture, ThreadPool& pool = defaultThreadPool()) {
+    texture.layout = Layout::Linear;
+    texture.levels.assign(1, MipLevel{texture.width, texture.height, 0, texture.width});
+    if (texture.data.empty()) return;
+
+    size_t total = static_cast<size_t>(texture.width) * texture.height;
+    for (int w = texture.width, h = texture.height; w > 1 || h > 1;) {
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+        texture.levels.push_back(MipLevel{w, h, static_cast<int>(total), w});
+        total += static_cast<size_t>(w) * h;
+    }
+    texture.data.resize(total); // no reallocation when the loader reserved the chain
+
+    for (size_t i = 1; i < texture.levels.size(); ++i) {
+        const MipLevel& src = texture.levels[i - 1];
+        const MipLevel& dst = texture.levels[i];
+        const uint32_t* src_data = texture.data.data() + src.offset;
+        uint32_t* dst_data = texture.data.data() + dst.offset;
+        const size_t grain = std::max<size_t>(1, 16384 / dst.width);
+        pool.parallelFor(0, dst.height, grain, [&](size_t y0, size_t y1) {
+            downsampleRows(src_data, src.width, src.height, dst_data, dst.width,
+                           static_cast<int>(y0), static_cast<int>(y1));
+        });
+    }
+}
+
+// Re-lays every mip level of a linear texture in the given layout. Levels are
+// padded to whole tiles; the padding repeats the edge texels.
+inline void applyLayout(Texture& texture, Layout layout) {
+    if (texture.layout == layout || texture.data.empty() || texture.format != Format::RGBA8) return;
+    if (texture.layout != Layout::Linear) return; // only converts from the load layout
+
+    const int shift = tileShift(layout);
+    const int tile = 1 << shift;
+    std::vector<MipLevel> levels;
+    size_t total = 0;
+    for (const auto& level : texture.levels) {
+        int tiles_x = (level.width + tile - 1) / tile;
+        int tiles_y = (level.height + tile - 1) / tile;
+        levels.push_back(MipLevel{level.width, level.height, static_cast<int>(total), tiles_x});
+        total += static_cast<size_t>(tiles_x) * tiles_y * tile * tile;
+    }
+
+    Texture out;
+    out.width = texture.width;
+    out.height = texture.height;
+    out.layout = layout;
+    out.levels = levels;
+    out.data.resize(total);
+    for (size_t l = 0; l < levels.size(); ++l) {
+        const MipLevel& src = texture.levels[l];
+        const MipLevel& dst = levels[l];
+        const int padded_w = dst.pitch * tile;
+        const int padded_h = ((dst.height + tile - 1) / tile) * tile;
+        for (int y = 0; y < padded_h; ++y) {
+            const uint32_t* row = texture.data.data() + src.offset + static_cast<size_t>(std::min(y, src.height - 1)) * src.pitch;
+            for (int x = 0; x < padded_w; ++x) {
+                out.data[out.texelIndex(dst, x, y)] = row[std::min(x, src.width - 1)];
+            }
+        }
+    }
+    texture.data = std::move(out.data);
+    texture.levels = std::move(levels);
+    texture.layout = layout;
+}
+
 class TextureLoadError : public std::runtime_error {
 public:
     TextureLoadError(const std::string& message) : std::runtime_error(message) {}
@@ -212,43 +1002,40 @@ namespace {
         return png_sig_cmp(const_cast<uint8_t*>(data), 0, 8) == 0;
     }
 
-    std::vector<uint8_t> readFileToMemory(const std::string& filename) {
-        std::ifstream file(filename, std::ios::binary | std::ios::ate);
-        if (!file.is_open()) {
-            throw TextureLoadError("Cannot open file: " + filename);
-        }
-        
-        std::streamsize size = file.tellg();
-        file.seekg(0, std::ios::beg);
-        
-        std::vector<uint8_t> buffer(size);
-        if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
-            throw TextureLoadError("Failed to read file: " + filename);
-        }
-        
-        return buffer;
-    }
+    struct FileCloser {
+        void operator()(FILE* f) const { if (f) std::fclose(f); }
+    };
+}
 
-    void readPngFromMemory(png_structp png_ptr, png_bytep data, png_size_t length) {
-        uint8_t** buffer_ptr = static_cast<uint8_t**>(png_get_io_ptr(png_ptr));
-        std::memcpy(data, *buffer_ptr, length);
-        *buffer_ptr += length;
+inline size_t mipChainTexels(int width, int height) {
+    size_t total = static_cast<size_t>(width) * height;
+    for (int w = width, h = height; w > 1 || h > 1;) {
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+        total += static_cast<size_t>(w) * h;
     }
+    return total;
 }
 
-Texture loadTexture(const std::string& filename) {
+Texture loadTexture(const std::string& filename, Layout layout = Layout::Linear) {
+    PROFILE_ZONE("loadTexture");
     Texture texture;
     texture.width = 0;
     texture.height = 0;
     texture.data.clear();
     
     try {
-        std::vector<uint8_t> file_data = readFileToMemory(filename);
-        if (file_data.empty()) {
+        std::unique_ptr<FILE, FileCloser> file(std::fopen(filename.c_str(), "rb"));
+        if (!file) {
+            throw TextureLoadError("Cannot open file: " + filename);
+        }
+
+        uint8_t signature[8];
+        if (std::fread(signature, 1, sizeof(signature), file.get()) != sizeof(signature)) {
             throw TextureLoadError("File is empty: " + filename);
         }
         
-        if (!isPNG(file_data.data())) {
+        if (!isPNG(signature)) {
             throw TextureLoadError("Not a valid PNG file: " + filename);
         }
         
@@ -269,9 +1056,7 @@ Texture loadTexture(const std::string& filename) {
             throw TextureLoadError("PNG decoding error: " + filename);
         }
 
-        // skip PNG signature
-        uint8_t* data_ptr = file_data.data() + 8; 
-        png_set_read_fn(png_ptr, &data_ptr, readPngFromMemory);
+        png_init_io(png_ptr, file.get());
         png_set_sig_bytes(png_ptr, 8); 
         
         png_read_info(png_ptr, info_ptr);
@@ -280,7 +1065,15 @@ Texture loadTexture(const std::string& filename) {
         texture.height = png_get_image_height(png_ptr, info_ptr);
         png_byte color_type = png_get_color_type(png_ptr, info_ptr);
         png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+        // untagged images are assumed sRGB; an explicit linear gAMA opts out
+        double file_gamma = 0.0;
+        if (!png_get_valid(png_ptr, info_ptr, PNG_INFO_sRGB) &&
+            png_get_gAMA(png_ptr, info_ptr, &file_gamma) && std::abs(file_gamma - 1.0) < 0.01) {
+            texture.srgb = false;
+        }
         
+        // every colour type is expanded to 8-bit RGBA, which is the texel layout
         if (bit_depth == 16) {
             png_set_strip_16(png_ptr);
         }
@@ -292,61 +1085,42 @@ Texture loadTexture(const std::string& filename) {
         if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
             png_set_expand_gray_1_2_4_to_8(png_ptr);
         }
+
+        if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+            png_set_gray_to_rgb(png_ptr);
+        }
         
         if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
             png_set_tRNS_to_alpha(png_ptr);
-        } else if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY) {
-
+        } else if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
             png_set_add_alpha(png_ptr, 0xFF, PNG_FILLER_AFTER);
         }
-        
-
-        if (color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
-
-        }
-        
 
+        const int passes = png_set_interlace_handling(png_ptr);
         png_read_update_info(png_ptr, info_ptr);
-        
-
-        int rowbytes = png_get_rowbytes(png_ptr, info_ptr);
-        std::vector<png_bytep> row_pointers(texture.height);
-        texture.data.resize(texture.width * texture.height);
-        
 
-        for (int y = 0; y < texture.height; y++) {
-            row_pointers[y] = new png_byte[rowbytes];
+        if (png_get_rowbytes(png_ptr, info_ptr) != static_cast<size_t>(texture.width) * 4) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+            throw TextureLoadError("Unsupported PNG pixel layout: " + filename);
         }
-        
-
-        png_read_image(png_ptr, row_pointers.data());
-        
 
-        for (int y = 0; y < texture.height; y++) {
-            png_bytep row = row_pointers[y];
-            for (int x = 0; x < texture.width; x++) {
-
-                png_byte* ptr = &(row[x * 4]); 
-                
-                if (png_get_rowbytes(png_ptr, info_ptr) == texture.width * 3) {
-                    // RGB
-                    texture.data[y * texture.width + x] = vec3(
-                        ptr[0], ptr[1], ptr[2]
-                    );
-                } else {
-                    // RGBA
-                    texture.data[y * texture.width + x] = vec3(
-                        ptr[0], ptr[1], ptr[2]
-                    );
-                }
+        // one allocation for level 0 and the mips built after it; rows are
+        // decoded straight into their final place
+        texture.data.reserve(mipChainTexels(texture.width, texture.height));
+        texture.data.resize(static_cast<size_t>(texture.width) * texture.height);
+        for (int pass = 0; pass < passes; ++pass) {
+            for (int y = 0; y < texture.height; ++y) {
+                png_read_row(png_ptr, reinterpret_cast<png_bytep>(texture.data.data() + static_cast<size_t>(y) * texture.width), nullptr);
             }
-            delete[] row_pointers[y];
         }
+        png_read_end(png_ptr, nullptr);
         
         png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
         
         std::cout << "Successfully loaded texture: " << filename 
                   << " (" << texture.width << "x" << texture.height << ")" << std::endl;
+        buildMipChain(texture);
+        applyLayout(texture, layout);
         texture.isLoaded = true;
     } catch (const TextureLoadError& e) {
         std::cerr << "Texture loading failed: " << e.what() << std::endl;
@@ -354,7 +1128,8 @@ Texture loadTexture(const std::string& filename) {
         texture.width = 1;
         texture.height = 1;
         texture.data.clear();
-        texture.data.emplace_back(255, 255, 255);
+        texture.data.push_back(packRGBA(255, 255, 255));
+        texture.levels.assign(1, MipLevel{1, 1, 0, 1});
         texture.isLoaded = false;
 
     } catch (const std::exception& e) {
@@ -362,7 +1137,8 @@ Texture loadTexture(const std::string& filename) {
         texture.width = 1;
         texture.height = 1;
         texture.data.clear();
-        texture.data.emplace_back(255, 0, 255); // red means error
+        texture.data.push_back(packRGBA(255, 0, 255)); // red means error
+        texture.levels.assign(1, MipLevel{1, 1, 0, 1});
         texture.isLoaded = false;
 
     }
@@ -371,6 +1147,58 @@ Texture loadTexture(const std::string& filename) {
     return texture;
 }
 
+// One texture per distinct map_Kd; materials refer to it by index. Textures
+// are shared, e.g. with an asset cache.
+struct MaterialTextures {
+    std::vector<std::shared_ptr<const Texture>> textures;
+    std::vector<int> material_texture; // -1 when the material has no map
+
+    const Texture* forMaterial(unsigned int material) const {
+        if (material >= material_texture.size() || material_texture[material] < 0) return nullptr;
+        const Texture* t = textures[material_texture[material]].get();
+        return t && t->isLoaded ? t : nullptr;
+    }
+};
+
+// Decodes the files in parallel, one task per file; the result keeps the
+// order of filenames.
+std::vector<Texture> loadTextures(const std::vector<std::string>& filenames, Layout layout = Layout::Linear,
+                                  ThreadPool& pool = defaultThreadPool()) {
+    std::vector<Texture> textures(filenames.size());
+    pool.parallelFor(0, filenames.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) textures[i] = loadTexture(filenames[i], layout);
+    });
+    return textures;
+}
+
+// The distinct map_Kd files of the model's materials; material_texture gets
+// each material's index into them, -1 when it has no map.
+std::vector<std::string> materialTextureFiles(const model::Model& model, std::vector<int>& material_texture) {
+    std::unordered_map<std::string, int> seen;
+    std::vector<std::string> files;
+    material_texture.clear();
+    material_texture.reserve(model.materials.size());
+    for (const auto& material : model.materials) {
+        if (material.diffuse_map.empty()) {
+            material_texture.push_back(-1);
+            continue;
+        }
+        auto [it, inserted] = seen.try_emplace(material.diffuse_map, static_cast<int>(files.size()));
+        if (inserted) files.push_back(material.diffuse_map);
+        material_texture.push_back(it->second);
+    }
+    return files;
+}
+
+// Decodes the model's textures for this caller alone; see
+// AssetManager::loadMaterialTextures to share them.
+MaterialTextures loadMaterialTextures(const model::Model& model) {
+    MaterialTextures out;
+    for (auto& t : loadTextures(materialTextureFiles(model, out.material_texture)))
+        out.textures.push_back(std::make_shared<const Texture>(std::move(t)));
+    return out;
+}
+
 // class RenderTarget{
 //     model::Model model_;
 //     texture::Texture texture_;
@@ -0,0 +1,160 @@
+﻿#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters of the calling thread (Linux perf_event).
+// The events are opened as one group so they are scheduled together and
+// comparable; values are scaled up when the kernel had to multiplex them.
+// Events the CPU, kernel or container does not allow are left out, and
+// without perf_event support (or on other systems) nothing is available and
+// every read returns false.
+namespace perf {
+
+enum Counter {
+    Cycles,
+    Instructions,
+    L1DMisses,       // L1 data cache read misses
+    LLCMisses,       // last level cache misses
+    BranchMisses,
+    kCounterCount,
+};
+
+inline const char* counterName(int counter) {
+    static const char* names[kCounterCount] = { "cycles", "instructions", "L1d misses", "LLC misses", "branch misses" };
+    return names[counter];
+}
+
+struct CounterValues {
+    uint64_t value[kCounterCount] = {};
+    uint32_t valid = 0;        // bit per Counter
+
+    bool has(int counter) const { return (valid >> counter) & 1u; }
+
+    CounterValues& operator+=(const CounterValues& other) {
+        for (int i = 0; i < kCounterCount; ++i) value[i] += other.value[i];
+        valid |= other.valid;
+        return *this;
+    }
+};
+
+inline CounterValues operator-(const CounterValues& end, const CounterValues& start) {
+    CounterValues delta;
+    delta.valid = end.valid & start.valid;
+    for (int i = 0; i < kCounterCount; ++i) {
+        if (delta.has(i)) delta.value[i] = end.value[i] >= start.value[i] ? end.value[i] - start.value[i] : 0;
+    }
+    return delta;
+}
+
+class CounterGroup {
+private:
+    int fds_[kCounterCount];
+    uint64_t ids_[kCounterCount] = {};
+    int leader_ = -1;
+    uint32_t opened_ = 0;
+    std::string error_;
+
+#ifdef __linux__
+    static int openEvent(uint32_t type, uint64_t config, int group_fd) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = group_fd < 0 ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+#endif
+
+public:
+    // Opens and starts the counters for the calling thread.
+    CounterGroup() {
+        for (int& fd : fds_) fd = -1;
+#ifdef __linux__
+        const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const struct { uint32_t type; uint64_t config; } events[kCounterCount] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, l1d_read_miss },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+        for (int i = 0; i < kCounterCount; ++i) {
+            fds_[i] = openEvent(events[i].type, events[i].config, leader_);
+            if (fds_[i] < 0) {
+                if (error_.empty()) error_ = std::string(counterName(i)) + ": " + std::strerror(errno);
+                continue;
+            }
+            if (leader_ < 0) leader_ = fds_[i];
+            if (::ioctl(fds_[i], PERF_EVENT_IOC_ID, &ids_[i]) != 0) {
+                ::close(fds_[i]);
+                fds_[i] = -1;
+                continue;
+            }
+            opened_ |= 1u << i;
+        }
+        if (leader_ >= 0) {
+            ::ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ::ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#else
+        error_ = "hardware counters need Linux perf_event";
+#endif
+    }
+
+    ~CounterGroup() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+    }
+
+    CounterGroup(const CounterGroup&) = delete;
+    CounterGroup& operator=(const CounterGroup&) = delete;
+
+    bool available() const { return opened_ != 0; }
+    uint32_t opened() const { return opened_; }
+    // Why the first event that failed could not be opened, empty if none did.
+    const std::string& error() const { return error_; }
+
+    // Current totals since the group was opened, scaled for multiplexing.
+    bool read(CounterValues& out) const {
+        out = CounterValues{};
+#ifdef __linux__
+        if (leader_ < 0) return false;
+        uint64_t buffer[3 + 2 * kCounterCount];
+        const ssize_t n = ::read(leader_, buffer, sizeof(buffer));
+        if (n < static_cast<ssize_t>(3 * sizeof(uint64_t))) return false;
+        const uint64_t count = buffer[0], enabled = buffer[1], running = buffer[2];
+        if (running == 0) return false;
+        const double scale = static_cast<double>(enabled) / static_cast<double>(running);
+        for (uint64_t k = 0; k < count && k < kCounterCount; ++k) {
+            const uint64_t value = buffer[3 + 2 * k], id = buffer[4 + 2 * k];
+            for (int i = 0; i < kCounterCount; ++i) {
+                if ((opened_ >> i & 1u) && ids_[i] == id) {
+                    out.value[i] = static_cast<uint64_t>(static_cast<double>(value) * scale);
+                    out.valid |= 1u << i;
+                }
+            }
+        }
+        return out.valid != 0;
+#else
+        return false;
+#endif
+    }
+};
+
+}
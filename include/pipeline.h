@@ -0,0 +1,242 @@
+﻿#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+class Picture;
+
+// Latency: the render thread starts frame N+1 only after the presenter has
+// taken frame N, so input is sampled as late as possible and at most one
+// finished frame waits. Throughput: the render thread runs ahead until the
+// queue is full or every back buffer is in use.
+enum class PipelineMode {
+    Latency,
+    Throughput,
+};
+
+using PipelineClock = std::chrono::steady_clock;
+
+inline double elapsedMs(PipelineClock::time_point from, PipelineClock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// Runs f() and adds its duration in ms to stage.
+template <class F>
+decltype(auto) timeStage(double& stage, F&& f) {
+    auto start = PipelineClock::now();
+    struct Add {
+        double& stage;
+        PipelineClock::time_point start;
+        ~Add() { stage += elapsedMs(start, PipelineClock::now()); }
+    } add{stage, start};
+    return f();
+}
+
+struct FrameTimings {
+    uint64_t frame = 0;
+    int buffer = -1;
+    PipelineClock::time_point begin;  // render thread starts waiting for a buffer
+    PipelineClock::time_point queued; // frame handed to the presenter
+    double acquire_ms = 0;            // waiting for a free back buffer
+    double update_ms = 0;             // input and camera
+    double transform_ms = 0;
+    double raster_ms = 0;
+    double enqueue_ms = 0;            // waiting for room in the queue
+    double dequeue_ms = 0;            // frame finished, presenter not ready yet
+    double present_ms = 0;            // upload and draw
+    double latency_ms = 0;            // begin to presented
+    size_t upload_bytes = 0;          // pixels the presenter copied
+};
+
+struct PipelineStats {
+    uint64_t frames = 0;
+    double wall_ms = 0;
+    double fps = 0;
+    // per-frame averages
+    double acquire_ms = 0;
+    double update_ms = 0;
+    double transform_ms = 0;
+    double raster_ms = 0;
+    double enqueue_ms = 0;
+    double dequeue_ms = 0;
+    double present_ms = 0;
+    double latency_ms = 0;
+    double upload_bytes = 0;
+    // busy time of each thread over the wall time; their sum above 1 is the
+    // share of the run where rendering and presenting overlapped
+    double render_busy = 0;
+    double present_busy = 0;
+    double overlap = 0;
+};
+
+// Owns the render thread. Frames are rendered into the presenter's swap-chain
+// buffers (acquireBackBuffer / releaseBackBuffer / buffer) and passed through
+// a bounded queue to the thread that calls nextFrame() and presents them,
+// normally the window thread.
+template <class Presenter>
+class FramePipeline {
+public:
+    // Fills timings.update_ms/transform_ms/raster_ms; returning false stops
+    // the pipeline after this frame is presented.
+    using RenderFn = std::function<bool(Picture& target, FrameTimings& timings)>;
+
+    FramePipeline(Presenter& presenter, PipelineMode mode, size_t max_queued = 0)
+        : presenter_(presenter), mode_(mode) {
+        const size_t buffers = static_cast<size_t>(std::max(presenter.bufferCount(), 2));
+        // one buffer is always the front buffer
+        capacity_ = mode == PipelineMode::Latency ? 1 : buffers - 1;
+        if (max_queued > 0) capacity_ = std::min(capacity_, max_queued);
+    }
+
+    ~FramePipeline() {
+        stop();
+    }
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    PipelineMode mode() const { return mode_; }
+
+    void start(RenderFn render) {
+        stop();
+        stopping_ = false;
+        finished_ = false;
+        started_ = PipelineClock::now();
+        thread_ = std::thread([this, render = std::move(render)] { renderLoop(render); });
+    }
+
+    // Blocks until the next frame is rendered. Returns nothing once the
+    // pipeline has stopped and every queued frame was taken.
+    std::optional<FrameTimings> nextFrame() {
+        std::unique_lock lock(mutex_);
+        changed_.wait(lock, [this] { return !queue_.empty() || finished_; });
+        if (queue_.empty()) return std::nullopt;
+        FrameTimings frame = queue_.front();
+        queue_.pop_front();
+        frame.dequeue_ms = elapsedMs(frame.queued, PipelineClock::now());
+        taken_ = frame.frame + 1;
+        lock.unlock();
+        changed_.notify_all();
+        return frame;
+    }
+
+    Picture& target(const FrameTimings& frame) { return presenter_.buffer(frame.buffer); }
+
+    // Call once the frame has been presented, with present_ms and
+    // upload_bytes filled in.
+    void presented(FrameTimings& frame) {
+        frame.latency_ms = elapsedMs(frame.begin, PipelineClock::now());
+        std::lock_guard lock(mutex_);
+        totals_.frames++;
+        totals_.acquire_ms += frame.acquire_ms;
+        totals_.update_ms += frame.update_ms;
+        totals_.transform_ms += frame.transform_ms;
+        totals_.raster_ms += frame.raster_ms;
+        totals_.enqueue_ms += frame.enqueue_ms;
+        totals_.dequeue_ms += frame.dequeue_ms;
+        totals_.present_ms += frame.present_ms;
+        totals_.latency_ms += frame.latency_ms;
+        totals_.upload_bytes += static_cast<double>(frame.upload_bytes);
+    }
+
+    // Stops the render thread; frames still queued are released unpresented.
+    // Call it from the presenting thread with no frame taken but unpresented,
+    // otherwise the render thread may wait for a buffer forever.
+    void stop() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+            for (const auto& frame : queue_) presenter_.releaseBackBuffer(frame.buffer);
+            queue_.clear();
+        }
+        changed_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    PipelineStats stats() const {
+        std::lock_guard lock(mutex_);
+        PipelineStats s = totals_;
+        s.wall_ms = elapsedMs(started_, PipelineClock::now());
+        if (s.frames == 0 || s.wall_ms <= 0) return s;
+        const double n = static_cast<double>(s.frames);
+        s.fps = n * 1000.0 / s.wall_ms;
+        s.render_busy = (s.update_ms + s.transform_ms + s.raster_ms) / s.wall_ms;
+        s.present_busy = s.present_ms / s.wall_ms;
+        s.overlap = std::max(0.0, s.render_busy + s.present_busy - 1.0);
+        s.acquire_ms /= n;
+        s.update_ms /= n;
+        s.transform_ms /= n;
+        s.raster_ms /= n;
+        s.enqueue_ms /= n;
+        s.dequeue_ms /= n;
+        s.present_ms /= n;
+        s.latency_ms /= n;
+        s.upload_bytes /= n;
+        return s;
+    }
+
+private:
+    Presenter& presenter_;
+    PipelineMode mode_;
+    size_t capacity_ = 1;
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<FrameTimings> queue_;
+    bool stopping_ = false;
+    bool finished_ = false;
+    uint64_t taken_ = 0; // frames the presenter has taken off the queue
+    PipelineClock::time_point started_;
+    PipelineStats totals_;
+
+    void renderLoop(const RenderFn& render) {
+        for (uint64_t n = 0;; ++n) {
+            FrameTimings frame;
+            frame.frame = n;
+            frame.begin = PipelineClock::now();
+            if (mode_ == PipelineMode::Latency) {
+                std::unique_lock lock(mutex_);
+                changed_.wait(lock, [&] { return stopping_ || taken_ >= n; });
+                if (stopping_) break;
+                frame.begin = PipelineClock::now();
+            }
+
+            frame.buffer = timeStage(frame.acquire_ms, [&] { return presenter_.acquireBackBuffer(); });
+            if (frame.buffer < 0) break;
+            {
+                std::lock_guard lock(mutex_);
+                if (stopping_) {
+                    presenter_.releaseBackBuffer(frame.buffer);
+                    break;
+                }
+            }
+
+            const bool more = render(presenter_.buffer(frame.buffer), frame);
+
+            std::unique_lock lock(mutex_);
+            auto wait_start = PipelineClock::now();
+            changed_.wait(lock, [this] { return stopping_ || queue_.size() < capacity_; });
+            if (stopping_) {
+                presenter_.releaseBackBuffer(frame.buffer);
+                break;
+            }
+            frame.queued = PipelineClock::now();
+            frame.enqueue_ms = elapsedMs(wait_start, frame.queued);
+            queue_.push_back(frame);
+            lock.unlock();
+            changed_.notify_all();
+            if (!more) break;
+        }
+        {
+            std::lock_guard lock(mutex_);
+            finished_ = true;
+        }
+        changed_.notify_all();
+    }
+};
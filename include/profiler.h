@@ -0,0 +1,481 @@
+﻿#pragma once
+#include "perfcounters.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hierarchical frame profiler. Scoped zones record their start and duration
+// on the calling thread; PROFILE_FRAME() closes a frame and moves everything
+// recorded since the previous one into a ring of the last N frames. From the
+// ring, summary() gives p50/p95/p99 of every zone's time per frame and
+// writeChromeTrace() a trace for chrome://tracing or Perfetto.
+//
+// The PROFILE_* macros only expand to code with RENDER_PROFILE defined
+// (cmake -DRENDER_PROFILE=ON); otherwise they compile to nothing.
+//
+// Splits cover work too fine-grained for a zone each (per triangle, per 8
+// fragments): the intervals are summed and recorded as one zone, which is
+// part of the summary but not of the trace.
+//
+// enableCounters() additionally reads the thread's hardware counters
+// (perf::CounterGroup) at both ends of every zone; counterReport() then gives
+// IPC and misses per rendered pixel (PROFILE_PIXELS) for each zone. A read
+// costs a system call, so leave them off when only timing. Counters only see
+// their own thread: a PROFILE_WORK(name) scope in the body of a parallelFor
+// adds what the pool workers spend on a zone's chunks to that zone. Splits
+// carry no counters and are left out of counterReport().
+namespace profiler {
+
+using Clock = std::chrono::steady_clock;
+
+inline uint64_t nowNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count());
+}
+
+enum class EventKind : uint8_t {
+    Zone,
+    Split,
+    Work,                      // a worker's share of a zone on another thread
+};
+
+struct ZoneEvent {
+    const char* name;          // string literal
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t depth;            // nesting on its thread, 0 = outermost
+    uint32_t thread;
+    EventKind kind;
+    perf::CounterValues counters; // over the zone, children included
+};
+
+struct ThreadLog {
+    std::mutex mutex;          // only contended while a frame is collected
+    std::vector<ZoneEvent> events;
+    std::string name;
+    uint32_t id = 0;
+    uint32_t depth = 0;
+    std::unique_ptr<perf::CounterGroup> counters; // opened on first use
+};
+
+struct FrameRecord {
+    uint64_t number = 0;
+    uint64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+    uint64_t pixels = 0;
+    std::vector<ZoneEvent> events;
+};
+
+struct ZoneSummary {
+    std::string name;
+    uint32_t depth = 0;
+    size_t frames = 0;         // frames the zone occurred in
+    double calls = 0;          // per such frame
+    double mean_ms = 0;
+    double p50_ms = 0;
+    double p95_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+    perf::CounterValues counters; // summed over the kept frames
+    uint64_t pixels = 0;          // rendered in the frames the zone occurred in
+};
+
+class Profiler {
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadLog>> threads_; // kept after their thread exits
+    std::deque<FrameRecord> frames_;
+    size_t capacity_ = 512;
+    uint64_t frame_start_ns_ = nowNs();
+    uint64_t frame_number_ = 0;
+    std::atomic<uint64_t> frame_pixels_{0};
+    std::atomic<bool> counters_enabled_{false};
+
+    // s as the contents of a JSON string.
+    static std::string jsonEscape(const std::string& s) {
+        std::string out;
+        out.reserve(s.size());
+        for (const char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+                out += code;
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    static double percentile(const std::vector<double>& sorted, double p) {
+        const size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+public:
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    ThreadLog& threadLog() {
+        thread_local ThreadLog* log = nullptr;
+        if (!log) {
+            std::lock_guard lock(mutex_);
+            threads_.push_back(std::make_unique<ThreadLog>());
+            log = threads_.back().get();
+            log->id = static_cast<uint32_t>(threads_.size());
+        }
+        return *log;
+    }
+
+    void setThreadName(const std::string& name) {
+        ThreadLog& log = threadLog();
+        std::lock_guard lock(log.mutex);
+        log.name = name;
+    }
+
+    // Starts reading hardware counters in zones. Returns false, with the
+    // reason in *error, when the calling thread cannot open any; threads that
+    // cannot open them later just record zones without counters.
+    bool enableCounters(std::string* error = nullptr) {
+        perf::CounterGroup* group = counterGroup(threadLog());
+        if (!group->available()) {
+            if (error) *error = group->error();
+            return false;
+        }
+        counters_enabled_ = true;
+        return true;
+    }
+
+    bool countersEnabled() const { return counters_enabled_.load(std::memory_order_relaxed); }
+
+    // The thread's counter group, opened on first use.
+    perf::CounterGroup* counterGroup(ThreadLog& log) {
+        if (!log.counters) log.counters = std::make_unique<perf::CounterGroup>();
+        return log.counters.get();
+    }
+
+    // Pixels rendered in the current frame, the unit of counterReport().
+    void addPixels(uint64_t pixels) { frame_pixels_.fetch_add(pixels, std::memory_order_relaxed); }
+
+    // Frames kept for summaries and traces.
+    void setCapacity(size_t frames) {
+        std::lock_guard lock(mutex_);
+        capacity_ = std::max<size_t>(frames, 1);
+        while (frames_.size() > capacity_) frames_.pop_front();
+    }
+
+    // Ends the current frame on every thread: zones finished since the last
+    // call belong to it.
+    void endFrame() {
+        const uint64_t now = nowNs();
+        FrameRecord frame;
+        std::lock_guard lock(mutex_);
+        frame.number = frame_number_++;
+        frame.start_ns = frame_start_ns_;
+        frame.duration_ns = now - frame_start_ns_;
+        frame.pixels = frame_pixels_.exchange(0, std::memory_order_relaxed);
+        frame_start_ns_ = now;
+        for (auto& log : threads_) {
+            std::lock_guard log_lock(log->mutex);
+            frame.events.insert(frame.events.end(), log->events.begin(), log->events.end());
+            log->events.clear();
+        }
+        // zones are logged when they end; parents first reads better
+        std::sort(frame.events.begin(), frame.events.end(), [](const ZoneEvent& a, const ZoneEvent& b) {
+            return a.thread != b.thread ? a.thread < b.thread : a.start_ns != b.start_ns ? a.start_ns < b.start_ns : a.depth < b.depth;
+        });
+        frames_.push_back(std::move(frame));
+        if (frames_.size() > capacity_) frames_.pop_front();
+    }
+
+    void clear() {
+        std::lock_guard lock(mutex_);
+        frames_.clear();
+    }
+
+    // One entry per zone name over the kept frames, in order of first
+    // appearance, preceded by "frame" for the whole frame time. Work events
+    // add their counters to the zone of their name but not their time, which
+    // the zone's own thread already spent waiting for them.
+    std::vector<ZoneSummary> summary() const {
+        std::lock_guard lock(mutex_);
+        struct Samples {
+            uint32_t depth = ~0u;
+            size_t calls = 0;
+            std::vector<double> per_frame;
+            perf::CounterValues counters;
+            uint64_t pixels = 0;
+        };
+        std::vector<std::string> order{ "frame" };
+        std::map<std::string, Samples> zones;
+        Samples& whole = zones["frame"];
+        whole.depth = 0;
+        for (const FrameRecord& frame : frames_) {
+            whole.per_frame.push_back(frame.duration_ns / 1e6);
+            whole.calls++;
+            std::map<std::string, double> totals;
+            for (const ZoneEvent& e : frame.events) {
+                auto [it, inserted] = zones.try_emplace(e.name);
+                if (inserted) order.push_back(e.name);
+                it->second.counters += e.counters;
+                if (e.kind == EventKind::Work) continue;
+                it->second.depth = std::min(it->second.depth, e.depth + 1);
+                it->second.calls++;
+                totals[e.name] += e.duration_ns / 1e6;
+            }
+            for (const auto& [name, ms] : totals) {
+                zones[name].per_frame.push_back(ms);
+                zones[name].pixels += frame.pixels;
+            }
+        }
+
+        std::vector<ZoneSummary> out;
+        for (const std::string& name : order) {
+            Samples& s = zones[name];
+            if (s.per_frame.empty()) continue; // work without its zone
+            std::sort(s.per_frame.begin(), s.per_frame.end());
+            ZoneSummary z;
+            z.name = name;
+            z.depth = s.depth;
+            z.frames = s.per_frame.size();
+            z.calls = static_cast<double>(s.calls) / z.frames;
+            for (double ms : s.per_frame) z.mean_ms += ms;
+            z.mean_ms /= z.frames;
+            z.p50_ms = percentile(s.per_frame, 0.50);
+            z.p95_ms = percentile(s.per_frame, 0.95);
+            z.p99_ms = percentile(s.per_frame, 0.99);
+            z.max_ms = s.per_frame.back();
+            z.counters = s.counters;
+            z.pixels = s.pixels;
+            out.push_back(z);
+        }
+        return out;
+    }
+
+    // The zone column of a report row: the name indented by nesting depth
+    // and padded to 26 columns, or left longer than that.
+    static std::string zoneColumn(const ZoneSummary& z) {
+        std::string name = std::string(2 * z.depth, ' ') + z.name;
+        if (name.size() < 26) name.resize(26, ' ');
+        return name;
+    }
+
+    // summary() as a text table, zones indented by nesting depth.
+    std::string report() const {
+        std::string out = "zone                        frames  calls    mean     p50     p95     p99     max (ms)\n";
+        char values[128];
+        for (const ZoneSummary& z : summary()) {
+            std::snprintf(values, sizeof(values), " %7zu %6.1f %7.3f %7.3f %7.3f %7.3f %7.3f\n",
+                          z.frames, z.calls, z.mean_ms, z.p50_ms, z.p95_ms, z.p99_ms, z.max_ms);
+            out += zoneColumn(z) + values;
+        }
+        return out;
+    }
+
+    // Hardware counters per zone: cycles per frame, instructions per cycle,
+    // and misses per rendered pixel. Zones include their children.
+    std::string counterReport() const {
+        std::string out = "zone                        Mcycles/frame    IPC  L1d miss/px  LLC miss/px  br miss/px\n";
+        auto per_pixel = [](const ZoneSummary& z, int counter) {
+            return z.counters.has(counter) && z.pixels > 0 ? static_cast<double>(z.counters.value[counter]) / z.pixels : -1.0;
+        };
+        // v right-aligned in width columns after a space, "-" when missing
+        auto field = [](double v, const char* format, size_t width) {
+            char buf[32] = "-";
+            if (v >= 0) std::snprintf(buf, sizeof(buf), format, v);
+            const std::string value = buf;
+            return std::string(1 + width - std::min(width, value.size()), ' ') + value;
+        };
+        for (const ZoneSummary& z : summary()) {
+            if (!z.counters.valid) continue;
+            const bool cycles = z.counters.has(perf::Cycles), instructions = z.counters.has(perf::Instructions);
+            out += zoneColumn(z);
+            out += field(cycles ? z.counters.value[perf::Cycles] / 1e6 / z.frames : -1.0, "%.3f", 14);
+            out += field(cycles && instructions && z.counters.value[perf::Cycles] > 0
+                ? static_cast<double>(z.counters.value[perf::Instructions]) / z.counters.value[perf::Cycles] : -1.0, "%.2f", 6);
+            out += field(per_pixel(z, perf::L1DMisses), "%.3f", 12);
+            out += field(per_pixel(z, perf::LLCMisses), "%.4f", 12);
+            out += field(per_pixel(z, perf::BranchMisses), "%.3f", 11);
+            out += '\n';
+        }
+        if (out.find('\n') == out.size() - 1) out += "(no counter data)\n";
+        return out;
+    }
+
+    // Chrome trace event format: one complete event per zone, one per frame
+    // on a separate "frames" track, and thread names as metadata.
+    bool writeChromeTrace(const std::string& path) const {
+        std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(path.c_str(), "w"), &std::fclose);
+        if (!file) return false;
+        std::lock_guard lock(mutex_);
+        FILE* f = file.get();
+        const uint64_t origin = frames_.empty() ? 0 : frames_.front().start_ns;
+        auto us = [origin](uint64_t ns) { return (static_cast<double>(ns) - static_cast<double>(origin)) / 1000.0; };
+
+        std::fprintf(f, "{\"traceEvents\":[\n");
+        std::fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"frames\"}}");
+        for (const auto& log : threads_) {
+            std::lock_guard log_lock(log->mutex);
+            const std::string name = log->name.empty() ? "thread " + std::to_string(log->id) : log->name;
+            std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                         log->id, jsonEscape(name).c_str());
+        }
+        for (const FrameRecord& frame : frames_) {
+            std::fprintf(f, ",\n{\"name\":\"frame %llu\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+                         static_cast<unsigned long long>(frame.number), us(frame.start_ns), frame.duration_ns / 1000.0);
+            for (const ZoneEvent& e : frame.events) {
+                if (e.kind == EventKind::Split) continue;
+                std::fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                             jsonEscape(e.name).c_str(), e.thread, us(e.start_ns), e.duration_ns / 1000.0);
+            }
+        }
+        std::fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        return std::ferror(f) == 0;
+    }
+};
+
+class Zone {
+private:
+    ThreadLog& log_;
+    const char* name_;
+    uint64_t start_;
+    uint32_t depth_;
+    perf::CounterGroup* counters_ = nullptr;
+    perf::CounterValues start_counters_;
+
+public:
+    explicit Zone(const char* name)
+        : log_(Profiler::instance().threadLog()), name_(name), depth_(log_.depth++) {
+        if (Profiler::instance().countersEnabled()) {
+            counters_ = Profiler::instance().counterGroup(log_);
+            counters_->read(start_counters_);
+        }
+        start_ = nowNs();
+    }
+    ~Zone() {
+        const uint64_t end = nowNs();
+        perf::CounterValues counters;
+        if (counters_ && counters_->read(counters)) counters = counters - start_counters_;
+        log_.depth--;
+        std::lock_guard lock(log_.mutex);
+        log_.events.push_back({ name_, start_, end - start_, depth_, log_.id, EventKind::Zone, counters });
+    }
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+};
+
+// A pool worker's share of a zone opened on another thread, such as one
+// parallelFor chunk. Only records on a thread outside any zone: the thread
+// that opened the zone and runs chunks itself already counts them there.
+class Work {
+private:
+    ThreadLog* log_ = nullptr;
+    const char* name_;
+    uint64_t start_ = 0;
+    perf::CounterGroup* counters_ = nullptr;
+    perf::CounterValues start_counters_;
+
+public:
+    explicit Work(const char* name) : name_(name) {
+        ThreadLog& log = Profiler::instance().threadLog();
+        if (log.depth > 0) return;
+        log_ = &log;
+        log_->depth++;
+        if (Profiler::instance().countersEnabled()) {
+            counters_ = Profiler::instance().counterGroup(log);
+            counters_->read(start_counters_);
+        }
+        start_ = nowNs();
+    }
+    ~Work() {
+        if (!log_) return;
+        const uint64_t end = nowNs();
+        perf::CounterValues counters;
+        if (counters_ && counters_->read(counters)) counters = counters - start_counters_;
+        log_->depth--;
+        std::lock_guard lock(log_->mutex);
+        log_->events.push_back({ name_, start_, end - start_, 0, log_->id, EventKind::Work, counters });
+    }
+    Work(const Work&) = delete;
+    Work& operator=(const Work&) = delete;
+};
+
+// Sums intervals and records them as one zone nested in the current one.
+// begin() while an interval is open closes it first, so a loop may begin at
+// the top of every iteration without ending on each early continue.
+class Split {
+private:
+    uint64_t start_ = 0;
+    uint64_t total_ = 0;
+    uint64_t first_ = 0;
+    bool open_ = false;
+
+public:
+    void begin() {
+        const uint64_t now = nowNs();
+        if (open_) total_ += now - start_;
+        else if (first_ == 0) first_ = now;
+        start_ = now;
+        open_ = true;
+    }
+    void end() {
+        if (!open_) return;
+        total_ += nowNs() - start_;
+        open_ = false;
+    }
+    void record(const char* name) {
+        end();
+        if (first_ == 0) return;
+        ThreadLog& log = Profiler::instance().threadLog();
+        std::lock_guard lock(log.mutex);
+        log.events.push_back({ name, first_, total_, log.depth, log.id, EventKind::Split, {} });
+    }
+
+    struct Scope {
+        Split& split;
+        explicit Scope(Split& s) : split(s) { split.begin(); }
+        ~Scope() { split.end(); }
+    };
+};
+
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef RENDER_PROFILE
+#define PROFILE_ZONE(name) ::profiler::Zone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#define PROFILE_WORK(name) ::profiler::Work PROFILE_CONCAT(profile_work_, __LINE__)(name)
+#define PROFILE_SPLIT(var) ::profiler::Split var
+#define PROFILE_SPLIT_BEGIN(var) (var).begin()
+#define PROFILE_SPLIT_END(var) (var).end()
+#define PROFILE_SPLIT_SCOPE(var) ::profiler::Split::Scope PROFILE_CONCAT(profile_split_, __LINE__)(var)
+#define PROFILE_SPLIT_RECORD(var, name) (var).record(name)
+#define PROFILE_FRAME() ::profiler::Profiler::instance().endFrame()
+#define PROFILE_THREAD(name) ::profiler::Profiler::instance().setThreadName(name)
+#define PROFILE_PIXELS(count) ::profiler::Profiler::instance().addPixels(count)
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_WORK(name) ((void)0)
+#define PROFILE_SPLIT(var) ((void)0)
+#define PROFILE_SPLIT_BEGIN(var) ((void)0)
+#define PROFILE_SPLIT_END(var) ((void)0)
+#define PROFILE_SPLIT_SCOPE(var) ((void)0)
+#define PROFILE_SPLIT_RECORD(var, name) ((void)0)
+#define PROFILE_FRAME() ((void)0)
+#define PROFILE_THREAD(name) ((void)0)
+#define PROFILE_PIXELS(count) ((void)0)
+#endif
@@ -1,10 +1,13 @@
 ﻿#pragma once
 #include "graph.h"
+#include "dirty.h"
+#include "profiler.h"
 #include "linear.h"
 #include "model.h"
 #include <vector>
 #include <algorithm>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 #include <ranges>
 #include <tuple>
@@ -87,151 +90,536 @@ bool isTriangleInNDC(const vec3& a, const vec3& b, const vec3& c) {
     return vertices_in_frustum > 0; // 至少有一个顶点在视锥内
 }
 
-bool render(const model::Model& render_model, const texture::Texture& render_texture, Picture& image, Matrix& depthBuffer){
-    depthBuffer.fill(1.f);
-    image.fill(0);
+// Shaded colours are packed RGBA (R in the low byte). Packed framebuffers get
+// them opaque and, for BGRA8, with red and blue swapped.
+inline uint32_t toFramebufferPixel(uint32_t rgba, PictureFormat format) {
+    if (format == PictureFormat::BGRA8) {
+        rgba = (rgba & 0x0000FF00u) | ((rgba & 0xFFu) << 16) | ((rgba >> 16) & 0xFFu);
+    }
+    return rgba | 0xFF000000u;
+}
 
-    vec3 lightDir = vec3(1, 2, 3).normalize();
+inline __m256i toFramebufferPixels8(__m256i rgba, PictureFormat format) {
+    if (format == PictureFormat::BGRA8) {
+        const __m256i swap = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                              2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        rgba = _mm256_shuffle_epi8(rgba, swap);
+    }
+    return _mm256_or_si256(rgba, _mm256_set1_epi32(static_cast<int>(0xFF000000u)));
+}
 
-    struct TriangleBounds {
-        int minX, maxX, minY, maxY;
-        bool valid;
-    };
-    std::vector<TriangleBounds> triangleBounds(render_model.verticle_idx.size());
-
-    std::vector<float> w_weights(render_model.transfromed_vertices.size());
-    std::vector<vec3> ndc_points(render_model.transfromed_vertices.size());
-    for (size_t idx = 0; idx < render_model.transfromed_vertices.size(); ++idx) {
-        float w = render_model.transfromed_vertices[idx].w;
-        if (std::abs(w) < 1e-6f || std::isnan(w) || std::isinf(w)) {
-            w_weights[idx] = 1.0f / 1e-6f;
-            ndc_points[idx] = vec3(0,0,1);
-        } else {
-            w_weights[idx] = 1.0f / w;
-            ndc_points[idx] = homoToNdc(render_model.transfromed_vertices[idx]);
-        }
+inline void storePixel(Picture& image, int x, int y, uint32_t rgba) {
+    if (image.isPacked()) {
+        image.row32(y)[x] = toFramebufferPixel(rgba, image.format());
+        return;
     }
+    uint8_t* p = image.row_ptr(y) + static_cast<size_t>(x) * 3;
+    p[0] = static_cast<uint8_t>(rgba & 0xFF);
+    p[1] = static_cast<uint8_t>((rgba >> 8) & 0xFF);
+    p[2] = static_cast<uint8_t>((rgba >> 16) & 0xFF);
+}
 
-    for (size_t i = 0; i < render_model.verticle_idx.size(); ++i) {
-        auto posIdx = render_model.verticle_idx[i];
-        
-        auto pa_ndc = ndc_points[posIdx.v0];
-        auto pb_ndc = ndc_points[posIdx.v1];
-        auto pc_ndc = ndc_points[posIdx.v2];
+// Screen-space gradients of the perspective-correct UV numerators
+// (sum b_i * uv_i / w_i) and denominator (sum b_i / w_i). Both are affine in
+// screen space, so per pixel du/dx = (du_dx - u * dq_dx) / q.
+struct UVGradients {
+    float du_dx, du_dy, dv_dx, dv_dy, dq_dx, dq_dy;
+};
 
-        if (!isTriangleInNDC(pa_ndc, pb_ndc, pc_ndc)) {
-            triangleBounds[i] = {-1, -1, -1, -1, false};
-            continue;
-        }
-        
-        auto pa_screen = ndcToScreen(pa_ndc, image.width(), image.height());
-        auto pb_screen = ndcToScreen(pb_ndc, image.width(), image.height());
-        auto pc_screen = ndcToScreen(pc_ndc, image.width(), image.height());
-        
-        if (shouldCullTriangle(pa_screen, pb_screen, pc_screen, 
-                              image.width(), image.height())) {
-            triangleBounds[i] = {-1, -1, -1, -1, false};
-            continue;
-        }
+UVGradients uvGradients(const Pixel2D& pa, const Pixel2D& pb, const Pixel2D& pc, float inv_area,
+                        float invW0, float invW1, float invW2,
+                        Point2D uv0, Point2D uv1, Point2D uv2) {
+    const float db0_dx = (pc.y - pb.y) * inv_area, db0_dy = (pb.x - pc.x) * inv_area;
+    const float db1_dx = (pa.y - pc.y) * inv_area, db1_dy = (pc.x - pa.x) * inv_area;
+    const float db2_dx = (pb.y - pa.y) * inv_area, db2_dy = (pa.x - pb.x) * inv_area;
+    UVGradients g;
+    g.dq_dx = db0_dx * invW0 + db1_dx * invW1 + db2_dx * invW2;
+    g.dq_dy = db0_dy * invW0 + db1_dy * invW1 + db2_dy * invW2;
+    g.du_dx = db0_dx * invW0 * uv0.x + db1_dx * invW1 * uv1.x + db2_dx * invW2 * uv2.x;
+    g.du_dy = db0_dy * invW0 * uv0.x + db1_dy * invW1 * uv1.x + db2_dy * invW2 * uv2.x;
+    g.dv_dx = db0_dx * invW0 * uv0.y + db1_dx * invW1 * uv1.y + db2_dx * invW2 * uv2.y;
+    g.dv_dy = db0_dy * invW0 * uv0.y + db1_dy * invW1 * uv1.y + db2_dy * invW2 * uv2.y;
+    return g;
+}
 
-        auto [minX, maxX] = std::minmax({pa_screen.x,pb_screen.x,pc_screen.x});
-        auto [minY, maxY] = std::minmax({pa_screen.y,pb_screen.y,pc_screen.y});
+// Work done by one render(). Every setup chunk and band counts into locals
+// and adds them to the totals once, so the counters cost a few register
+// increments.
+struct RasterStats {
+    uint64_t triangles = 0;         // submitted
+    uint64_t depth_culled = 0;      // no vertex between the near and far plane
+    uint64_t offscreen_culled = 0;  // bounding box outside the viewport
+    uint64_t zero_area = 0;
+    uint64_t backfacing = 0;        // clockwise on screen; drawn anyway, nothing culls by winding
+    uint64_t bbox_pixels = 0;       // pixels whose coverage was tested
+    uint64_t covered_pixels = 0;    // inside the triangle
+    uint64_t depth_passed = 0;
+    uint64_t depth_failed = 0;
+    uint64_t texture_fetches = 0;   // texels sampled, one per textured fragment
 
-        triangleBounds[i] = {
-            max(static_cast<int>(minX), 0),
-            min(static_cast<int>(maxX), image.width() - 1),
-            max(static_cast<int>(minY), 0),
-            min(static_cast<int>(maxY), image.height() - 1),
-            true
-        };
+    RasterStats& operator+=(const RasterStats& o) {
+        triangles += o.triangles;
+        depth_culled += o.depth_culled;
+        offscreen_culled += o.offscreen_culled;
+        zero_area += o.zero_area;
+        backfacing += o.backfacing;
+        bbox_pixels += o.bbox_pixels;
+        covered_pixels += o.covered_pixels;
+        depth_passed += o.depth_passed;
+        depth_failed += o.depth_failed;
+        texture_fetches += o.texture_fetches;
+        return *this;
     }
-    for (size_t i = 0; i < render_model.verticle_idx.size(); ++i) {
-         if (!triangleBounds[i].valid) continue;
 
-        auto posIdx = render_model.verticle_idx[i];
-        auto bounds = triangleBounds[i];
+    uint64_t rasterized() const { return triangles - depth_culled - offscreen_culled - zero_area; }
+};
 
-        std::optional<model::Triangle> texIdx;
-        std::optional<model::Triangle> normIdx;
+// Optional instrumentation for render(): the counters above and, if
+// capture_overdraw is set, how many covered fragments each pixel received
+// (depth tested, whether they passed or not).
+struct RasterDiagnostics {
+    RasterStats stats;
+    bool capture_overdraw = false;
+    int width = 0;
+    int height = 0;
+    std::vector<uint16_t> overdraw;
 
-        if (i < render_model.texture_idx.size())
-            texIdx = render_model.texture_idx[i];
-        if (i < render_model.normal_idx.size())
-            normIdx = render_model.normal_idx[i];
+    void reset() {
+        stats = RasterStats{};
+        std::fill(overdraw.begin(), overdraw.end(), uint16_t(0));
+    }
 
-        auto pa_ndc = ndc_points[posIdx.v0];
-        auto pb_ndc = ndc_points[posIdx.v1];
-        auto pc_ndc = ndc_points[posIdx.v2];
+    uint16_t maxOverdraw() const {
+        return overdraw.empty() ? 0 : *std::max_element(overdraw.begin(), overdraw.end());
+    }
 
-        if (!isTriangleInNDC(pa_ndc, pb_ndc, pc_ndc)) {
-            continue;
+    // Overdraw as a heat map: black for untouched pixels, then blue, cyan,
+    // green, yellow and red up to max_level (the frame's maximum if 0) and
+    // white above it.
+    Picture heatMap(int max_level = 0) const {
+        Picture map(width, height, PictureFormat::RGB8);
+        if (overdraw.empty()) return map;
+        const int top = max_level > 0 ? max_level : std::max<int>(1, maxOverdraw());
+        static const uint8_t ramp[6][3] = { {0, 0, 255}, {0, 255, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}, {255, 255, 255} };
+        for (int y = 0; y < height; ++y) {
+            uint8_t* row = map.row_ptr(y);
+            for (int x = 0; x < width; ++x) {
+                const int n = overdraw[static_cast<size_t>(y) * width + x];
+                uint8_t* px = row + 3 * x;
+                if (n == 0) {
+                    px[0] = px[1] = px[2] = 0;
+                    continue;
+                }
+                // 1..top spread over the first five ramp entries
+                const float t = std::min(1.f, static_cast<float>(n - 1) / std::max(1, top - 1)) * 4.f;
+                const int k = n > top ? 5 : std::min(3, static_cast<int>(t));
+                const float f = n > top ? 0.f : t - k;
+                for (int c = 0; c < 3; ++c) {
+                    const int next = n > top ? ramp[5][c] : ramp[k + 1][c];
+                    px[c] = static_cast<uint8_t>(ramp[k][c] + (next - ramp[k][c]) * f);
+                }
+            }
         }
-        
-        auto pa_screen = ndcToScreen(pa_ndc, image.width(), image.height());
-        auto pb_screen = ndcToScreen(pb_ndc, image.width(), image.height());
-        auto pc_screen = ndcToScreen(pc_ndc, image.width(), image.height());
-        
-
-        float area_screen = edgeFunction(pa_screen, pb_screen, pc_screen);
-        const  float inv_area = 1.0f / area_screen;
-        if (std::abs(area_screen) < 1e-6f) continue;
- 
-        for(int y = bounds.minY; y <= bounds.maxY; ++y){
-            //auto img_row = image.row_ptr(y);s
-            for(int x = bounds.minX; x <= bounds.maxX; ++x){  
+        return map;
+    }
+};
+
+struct DrawBatch {
+    const texture::Texture* texture; // nullptr draws the flat material colour
+    vec3 color;
+    size_t first;
+    size_t count;
+};
+
+// One batch per material range, ordered so that batches sharing a texture are
+// drawn back to back: untextured first, then by texture slot, then by material
+// index, so the draw order is the same on every run.
+std::vector<DrawBatch> buildDrawBatches(const model::Model& render_model,
+                                        const texture::MaterialTextures& textures){
+    struct Keyed {
+        int slot;
+        unsigned int material;
+        DrawBatch batch;
+    };
+    std::vector<Keyed> keyed;
+    for (const auto& range : render_model.material_ranges) {
+        const texture::Texture* tex = textures.forMaterial(range.material);
+        vec3 color = tex ? vec3(255, 255, 255)
+                         : render_model.materials[range.material].diffuse * 255.f;
+        keyed.push_back({tex ? textures.material_texture[range.material] : -1, range.material,
+                         {tex, color, range.first, range.count}});
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const Keyed& a, const Keyed& b) {
+        return a.slot != b.slot ? a.slot < b.slot : a.material < b.material;
+    });
+    std::vector<DrawBatch> batches;
+    batches.reserve(keyed.size());
+    for (const Keyed& k : keyed) batches.push_back(k.batch);
+    return batches;
+}
+
+// Rows per rasterization task. Bands line up with the dirty tiles so that
+// concurrent bands never write the same byte of the coverage mask.
+constexpr int kRasterBandRows = kDirtyTileSize;
+// Triangles set up per pass; bounds the setup scratch of huge batches.
+constexpr size_t kSetupWindow = 16384;
+
+// Everything a band needs to rasterize one triangle, computed once by the
+// setup pass. minY > maxY marks a culled triangle.
+struct TriangleSetup {
+    Pixel2D a, b, c;
+    float za, zb, zc;
+    float invW0, invW1, invW2;
+    float inv_area;
+    int minX, maxX, minY, maxY;
+    Point2D uvA, uvB, uvC;
+    UVGradients grad;
+    float brightness;
+    uint32_t flat_color;
+};
+
+template <bool Textured, bool Lit>
+void setupTriangle(const model::Model& render_model, const DrawBatch& batch, size_t i,
+                   const std::vector<vec3>& ndc_points, const std::vector<float>& w_weights,
+                   const vec3& lightDir, int width, int height, TriangleSetup& t, RasterStats& stats) {
+    t.minY = 1;
+    t.maxY = 0;
+    auto posIdx = render_model.positionTriangle(i);
+
+    auto pa_ndc = ndc_points[posIdx.v0];
+    auto pb_ndc = ndc_points[posIdx.v1];
+    auto pc_ndc = ndc_points[posIdx.v2];
+
+    if (!isTriangleInNDC(pa_ndc, pb_ndc, pc_ndc)) {
+        ++stats.depth_culled;
+        return;
+    }
+
+    t.a = ndcToScreen(pa_ndc, width, height);
+    t.b = ndcToScreen(pb_ndc, width, height);
+    t.c = ndcToScreen(pc_ndc, width, height);
+
+    if (shouldCullTriangle(t.a, t.b, t.c, width, height)) {
+        ++stats.offscreen_culled;
+        return;
+    }
+
+    float area_screen = edgeFunction(t.a, t.b, t.c);
+    if (std::abs(area_screen) < 1e-6f) {
+        ++stats.zero_area;
+        return;
+    }
+    stats.backfacing += area_screen < 0;
+    t.inv_area = 1.0f / area_screen;
+
+    auto [minX, maxX] = std::minmax({t.a.x, t.b.x, t.c.x});
+    auto [minY, maxY] = std::minmax({t.a.y, t.b.y, t.c.y});
+    t.minX = std::max(minX, 0);
+    t.maxX = std::min(maxX, width - 1);
+    t.minY = std::max(minY, 0);
+    t.maxY = std::min(maxY, height - 1);
+
+    t.za = pa_ndc.z;
+    t.zb = pb_ndc.z;
+    t.zc = pc_ndc.z;
+    t.invW0 = w_weights[posIdx.v0];
+    t.invW1 = w_weights[posIdx.v1];
+    t.invW2 = w_weights[posIdx.v2];
+
+    if constexpr (Textured) {
+        auto [t0, t1, t2] = render_model.texcoordTriangle(i);
+        t.uvA = render_model.texcoord(t0);
+        t.uvB = render_model.texcoord(t1);
+        t.uvC = render_model.texcoord(t2);
+        t.grad = uvGradients(t.a, t.b, t.c, t.inv_area, t.invW0, t.invW1, t.invW2, t.uvA, t.uvB, t.uvC);
+    }
+
+    // the face normal is constant over the triangle
+    t.brightness = 1.f;
+    if constexpr (Lit) {
+        auto [n0, n1, n2] = render_model.normalTriangle(i);
+        vec3 faceNormal = ((render_model.normal(n0) + render_model.normal(n1) + render_model.normal(n2)) / 3.0f).normalize();
+        t.brightness = std::clamp(faceNormal.dot(lightDir), 0.2f, 1.f);
+    }
+    // material colours are display (sRGB) values, lit in linear light like
+    // the texels of an sRGB texture
+    auto channel = [](float c) { return static_cast<uint8_t>(std::clamp(c, 0.f, 255.f)); };
+    const uint32_t color = texture::packRGBA(channel(batch.color.x), channel(batch.color.y), channel(batch.color.z));
+    t.flat_color = texture::shadeTexel(color, t.brightness, true);
+}
+
+// Rasterizes rows [band_y0, band_y1) of the set-up triangles, in order.
+template <bool Textured, bool Lit>
+void rasterizeBand(const TriangleSetup* setups, size_t count, int band_y0, int band_y1,
+                   const texture::Texture* render_texture, Picture& image, Matrix& depthBuffer,
+                   TileMask* coverage, uint16_t* overdraw, RasterStats& stats) {
+    const bool needs_lod = Textured && render_texture->filter != texture::Filter::Nearest &&
+                           render_texture->levels.size() > 1;
+    const bool packed = image.isPacked();
+    const PictureFormat format = image.format();
+    PROFILE_SPLIT(shade);
+
+    for (size_t k = 0; k < count; ++k) {
+        const TriangleSetup& t = setups[k];
+        const int minY = std::max(t.minY, band_y0), maxY = std::min(t.maxY, band_y1 - 1);
+        if (minY > maxY) continue;
+        const int minX = t.minX, maxX = t.maxX;
+        const Pixel2D pa_screen = t.a, pb_screen = t.b, pc_screen = t.c;
+        const float inv_area = t.inv_area;
+        const UVGradients& grad = t.grad;
+        const float brightness = t.brightness;
+        const uint32_t flat_pixel = toFramebufferPixel(t.flat_color, format);
+
+        // textured fragments are queued and sampled/shaded 8 at a time
+        alignas(32) float frag_u[8] = {};
+        alignas(32) float frag_v[8] = {};
+        alignas(32) float frag_q[8] = {1, 1, 1, 1, 1, 1, 1, 1};
+        int frag_x[8];
+        int frag_count = 0;
+        auto flush = [&](int y) {
+            if (frag_count == 0) return;
+            PROFILE_SPLIT_SCOPE(shade);
+            stats.texture_fetches += frag_count;
+            __m256 u = _mm256_load_ps(frag_u);
+            __m256 v = _mm256_load_ps(frag_v);
+            __m256i texels;
+            if (needs_lod) {
+                __m256 inv_q = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_load_ps(frag_q));
+                auto derivative = [&](float d_num, float d_q, __m256 value) {
+                    return _mm256_mul_ps(_mm256_fnmadd_ps(value, _mm256_set1_ps(d_q), _mm256_set1_ps(d_num)), inv_q);
+                };
+                __m256 lod = render_texture->lod8(derivative(grad.du_dx, grad.dq_dx, u), derivative(grad.du_dy, grad.dq_dy, u),
+                                                  derivative(grad.dv_dx, grad.dq_dx, v), derivative(grad.dv_dy, grad.dq_dy, v));
+                texels = render_texture->sample8(u, v, lod);
+            } else {
+                texels = render_texture->sample8(u, v);
+            }
+            if constexpr (Lit) texels = texture::shadeTexels8(texels, brightness, render_texture->srgb);
+            if (packed) {
+                texels = toFramebufferPixels8(texels, format);
+                uint32_t* row = image.row32(y);
+                if (frag_count == 8 && frag_x[7] - frag_x[0] == 7) {
+                    // a contiguous run of 8 fragments goes out as one store
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + frag_x[0]), texels);
+                } else {
+                    alignas(32) uint32_t colors[8];
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(colors), texels);
+                    for (int k = 0; k < frag_count; ++k) row[frag_x[k]] = colors[k];
+                }
+            } else {
+                alignas(32) uint32_t colors[8];
+                _mm256_store_si256(reinterpret_cast<__m256i*>(colors), texels);
+                for (int k = 0; k < frag_count; ++k) storePixel(image, frag_x[k], y, colors[k]);
+            }
+            frag_count = 0;
+        };
+
+        for(int y = minY; y <= maxY; ++y){
+            int written_min = maxX + 1, written_max = minX - 1;
+            stats.bbox_pixels += maxX - minX + 1;
+            for(int x = minX; x <= maxX; ++x){
                 Pixel2D pixel(x,y);
                 float w0 = edgeFunction(pb_screen, pc_screen, pixel) * inv_area;
-                float w1 = edgeFunction(pc_screen, pa_screen, pixel) * inv_area; 
+                float w1 = edgeFunction(pc_screen, pa_screen, pixel) * inv_area;
                 float w2 = edgeFunction(pa_screen, pb_screen, pixel) * inv_area;
-                
+
                 if (w0 < 0 || w1 < 0 || w2 < 0) continue;
-                
-                auto interpolated_depth = perspectiveCorrectedDepth(pa_ndc.z, pb_ndc.z, pc_ndc.z, 
-                        w_weights[posIdx.v0], w_weights[posIdx.v1], w_weights[posIdx.v2],
+                ++stats.covered_pixels;
+                if (overdraw) ++overdraw[static_cast<size_t>(y) * image.width() + x];
+
+                auto interpolated_depth = perspectiveCorrectedDepth(t.za, t.zb, t.zc,
+                        t.invW0, t.invW1, t.invW2,
                         w0, w1, w2);
-                
-                int buf_x = x, buf_y = y;
-                    float buffered_depth = depthBuffer(buf_y, buf_x);
-                    
-                if (interpolated_depth >= buffered_depth) {
+
+                if (interpolated_depth >= depthBuffer(y, x)) {
+                    ++stats.depth_failed;
                     continue;
                 }
-            
-                vec3 render_color(255,255,255);
-                if (texIdx.has_value() && render_texture.isLoaded) {
-                    auto [t0, t1, t2] = texIdx.value();
-                    auto texCoordA = render_model.texcoords[t0];
-                    auto texCoordB = render_model.texcoords[t1];
-                    auto texCoordC = render_model.texcoords[t2];
+                ++stats.depth_passed;
+
+                depthBuffer(y, x) = interpolated_depth;
+                written_min = std::min(written_min, x);
+                written_max = x;
+                if constexpr (Textured) {
                     auto correct_uv = perspectiveCorrectedUV(
-                    texCoordA, texCoordB, texCoordC,
-                    w_weights[posIdx.v0], w_weights[posIdx.v1], w_weights[posIdx.v2],
+                    t.uvA, t.uvB, t.uvC,
+                    t.invW0, t.invW1, t.invW2,
                     w0, w1, w2
                     );
-                    render_color = render_texture.getColor(correct_uv.x, correct_uv.y);
+                    frag_u[frag_count] = correct_uv.x;
+                    frag_v[frag_count] = correct_uv.y;
+                    frag_q[frag_count] = w0 * t.invW0 + w1 * t.invW1 + w2 * t.invW2;
+                    frag_x[frag_count] = x;
+                    if (++frag_count == 8) flush(y);
+                } else if (packed) {
+                    image.row32(y)[x] = flat_pixel;
+                } else {
+                    storePixel(image, x, y, t.flat_color);
                 }
+            }
+            if constexpr (Textured) flush(y);
+            if (coverage && written_min <= written_max) coverage->markSpan(y, written_min, written_max);
+        }
+    }
+    PROFILE_SPLIT_RECORD(shade, "shade");
+}
 
-                if (normIdx.has_value()) {
-                    auto [n0, n1, n2] = normIdx.value();
-                    vec3 na = render_model.vertex_norm[n0];
-                    vec3 nb = render_model.vertex_norm[n1];
-                    vec3 nc = render_model.vertex_norm[n2];
+// Draws the batch in windows of kSetupWindow triangles: the window is set up
+// in parallel chunks, then its bands are rasterized in parallel. Each band
+// draws the window's triangles in submission order and owns its rows of the
+// picture, depth buffer and coverage mask, so the result matches a serial
+// rasterizer pixel for pixel.
+template <bool Textured, bool Lit>
+void rasterizeBatch(const model::Model& render_model, const DrawBatch& batch,
+                    const std::vector<vec3>& ndc_points, const std::vector<float>& w_weights,
+                    const vec3& lightDir, Picture& image, Matrix& depthBuffer, TileMask* coverage,
+                    RasterDiagnostics* diagnostics, std::vector<TriangleSetup>& setups, ThreadPool& pool){
+    RasterStats stats;
+    stats.triangles = batch.count;
+    std::mutex stats_mutex;
+    uint16_t* overdraw = diagnostics && !diagnostics->overdraw.empty() ? diagnostics->overdraw.data() : nullptr;
+    const int width = image.width(), height = image.height();
+    const size_t bands = static_cast<size_t>((height + kRasterBandRows - 1) / kRasterBandRows);
 
-                    vec3 faceNormal = ((na + nb + nc) / 3.0f).normalize();
-                    float brightness = std::clamp(faceNormal.dot(lightDir),0.2f,1.f);
-                    render_color = render_color * brightness;
+    for (size_t first = batch.first; first < batch.first + batch.count; first += kSetupWindow) {
+        const size_t count = std::min(kSetupWindow, batch.first + batch.count - first);
+        setups.resize(std::max(setups.size(), count));
+        {
+            PROFILE_ZONE("triangle setup");
+            pool.parallelFor(0, count, 1024, [&](size_t begin, size_t end) {
+                PROFILE_WORK("triangle setup");
+                RasterStats local;
+                for (size_t k = begin; k < end; ++k)
+                    setupTriangle<Textured, Lit>(render_model, batch, first + k, ndc_points, w_weights, lightDir,
+                                                 width, height, setups[k], local);
+                std::lock_guard lock(stats_mutex);
+                stats += local;
+            });
+        }
+        {
+            PROFILE_ZONE("tile raster");
+            pool.parallelFor(0, bands, 1, [&](size_t begin, size_t end) {
+                PROFILE_WORK("tile raster");
+                RasterStats local;
+                for (size_t band = begin; band < end; ++band) {
+                    const int y0 = static_cast<int>(band) * kRasterBandRows;
+                    rasterizeBand<Textured, Lit>(setups.data(), count, y0, std::min(height, y0 + kRasterBandRows),
+                                                 batch.texture, image, depthBuffer, coverage, overdraw, local);
                 }
-                
-                depthBuffer(buf_y, buf_x) = interpolated_depth;
-                // img_row[x] = static_cast<uint8_t>(render_color.x);
-                // img_row[x + 1] = static_cast<uint8_t>(render_color.y);
-                // img_row[x + 2] = static_cast<uint8_t>(render_color.z);
-                image.at(x,y,0) = static_cast<uint8_t>(render_color.x);
-                image.at(x,y,1) = static_cast<uint8_t>(render_color.y);
-                image.at(x,y,2) = static_cast<uint8_t>(render_color.z);
+                std::lock_guard lock(stats_mutex);
+                stats += local;
+            });
+        }
+    }
+    if (diagnostics) diagnostics->stats += stats;
+}
 
-            }
+// Clears the tiles of the mask, or the whole picture without one.
+inline void clearPicture(Picture& image, const TileMask* tiles) {
+    if (!tiles) {
+        if (image.isPacked()) image.fill32(toFramebufferPixel(0, image.format()));
+        else image.fill(0);
+        return;
+    }
+    const uint32_t background = toFramebufferPixel(0, image.format());
+    for (const TileRect& r : tiles->rects()) {
+        for (int y = r.y; y < r.y + r.height; ++y) {
+            if (image.isPacked()) std::fill_n(image.row32(y) + r.x, r.width, background);
+            else std::memset(image.row_ptr(y) + 3 * r.x, 0, 3 * static_cast<size_t>(r.width));
+        }
+    }
+}
+
+// clip_vertices are the model's vertices after transformModel, kept outside
+// the model so concurrent renders of one model do not race.
+//
+// coverage, if given, must belong to this picture: it holds the tiles the
+// previous render wrote, so only those are cleared, and on return it holds
+// the tiles written by this one. A mask of another size clears everything.
+//
+// diagnostics, if given, is reset and receives this render's counters.
+//
+// Projection, triangle setup and rasterization are split into jobs on pool.
+bool render(const model::Model& render_model, const std::vector<vec4>& clip_vertices,
+            const std::vector<DrawBatch>& batches, Picture& image, Matrix& depthBuffer,
+            TileMask* coverage = nullptr, RasterDiagnostics* diagnostics = nullptr,
+            ThreadPool& pool = defaultThreadPool()){
+    PROFILE_ZONE("render");
+    PROFILE_PIXELS(static_cast<uint64_t>(image.width()) * image.height());
+    {
+        PROFILE_ZONE("clear");
+        depthBuffer.fill(1.f);
+        if (coverage && coverage->matches(image)) {
+            clearPicture(image, coverage);
+            coverage->clear();
+        } else {
+            clearPicture(image, nullptr);
+            if (coverage) coverage->reset(image.width(), image.height());
         }
     }
+
+    vec3 lightDir = vec3(1, 2, 3).normalize();
+
+    if (diagnostics) {
+        diagnostics->width = image.width();
+        diagnostics->height = image.height();
+        if (diagnostics->capture_overdraw) diagnostics->overdraw.resize(static_cast<size_t>(image.width()) * image.height());
+        else diagnostics->overdraw.clear();
+        diagnostics->reset();
+    }
+
+    std::vector<float> w_weights(clip_vertices.size());
+    std::vector<vec3> ndc_points(clip_vertices.size());
+    {
+        PROFILE_ZONE("project");
+        pool.parallelFor(0, clip_vertices.size(), 16384, [&](size_t begin, size_t end) {
+            PROFILE_WORK("project");
+            for (size_t idx = begin; idx < end; ++idx) {
+                float w = clip_vertices[idx].w;
+                if (std::abs(w) < 1e-6f || std::isnan(w) || std::isinf(w)) {
+                    w_weights[idx] = 1.0f / 1e-6f;
+                    ndc_points[idx] = vec3(0,0,1);
+                } else {
+                    w_weights[idx] = 1.0f / w;
+                    ndc_points[idx] = homoToNdc(clip_vertices[idx]);
+                }
+            }
+        });
+    }
+    std::vector<TriangleSetup> setups;
+
+    // pick the specialised rasterizer once per batch instead of per pixel
+    for (const auto& batch : batches) {
+        PROFILE_ZONE("raster");
+        const size_t end = batch.first + batch.count;
+        const bool textured = batch.texture && render_model.texcoordTriangleCount() >= end;
+        const bool lit = render_model.normalTriangleCount() >= end;
+
+        if (textured && lit)
+            rasterizeBatch<true, true>(render_model, batch, ndc_points, w_weights, lightDir, image, depthBuffer, coverage, diagnostics, setups, pool);
+        else if (textured)
+            rasterizeBatch<true, false>(render_model, batch, ndc_points, w_weights, lightDir, image, depthBuffer, coverage, diagnostics, setups, pool);
+        else if (lit)
+            rasterizeBatch<false, true>(render_model, batch, ndc_points, w_weights, lightDir, image, depthBuffer, coverage, diagnostics, setups, pool);
+        else
+            rasterizeBatch<false, false>(render_model, batch, ndc_points, w_weights, lightDir, image, depthBuffer, coverage, diagnostics, setups, pool);
+    }
     return true;
 }
+
+bool render(const model::Model& render_model, const std::vector<DrawBatch>& batches, Picture& image, Matrix& depthBuffer,
+            TileMask* coverage = nullptr, RasterDiagnostics* diagnostics = nullptr,
+            ThreadPool& pool = defaultThreadPool()){
+    return render(render_model, render_model.transfromed_vertices, batches, image, depthBuffer, coverage, diagnostics, pool);
+}
+
+bool render(const model::Model& render_model, const texture::MaterialTextures& textures, Picture& image, Matrix& depthBuffer){
+    return render(render_model, buildDrawBatches(render_model, textures), image, depthBuffer);
+}
+
+// Single texture for the whole model, regardless of its materials.
+bool render(const model::Model& render_model, const texture::Texture& render_texture, Picture& image, Matrix& depthBuffer){
+    const texture::Texture* tex = render_texture.isLoaded ? &render_texture : nullptr;
+    std::vector<DrawBatch> batches{ {tex, vec3(255, 255, 255), 0, render_model.triangleCount()} };
+    return render(render_model, batches, image, depthBuffer);
+}
@@ -0,0 +1,343 @@
+﻿#pragma once
+#include "graph.h"
+#include "dirty.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// POSIX shared-memory ring of frame slots for other processes on the same
+// machine. One producer renders straight into the next slot; any number of
+// consumers read published frames in place.
+//
+// Every slot carries a sequence word used as a seqlock: 2f+1 while frame f is
+// being written, 2f once it is published. The producer never waits. A
+// consumer checks the word before reading and again afterwards; if it changed
+// the producer lapped the consumer and the frame must be discarded. Frame
+// numbers start at 1, so gaps between frames a consumer took are dropped
+// frames.
+//
+// Next to each slot the producer publishes which tiles changed since the
+// previous frame, so a consumer keeping a copy of consecutive frames only
+// copies those (FrameRingConsumer::copyFrame).
+namespace shm {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring sequence words must be lock-free");
+
+constexpr uint32_t kRingMagic = 0x52474E46; // "FNGR"
+constexpr uint32_t kRingVersion = 2;
+constexpr size_t kPageSize = 4096;
+
+struct alignas(64) SlotHeader {
+    std::atomic<uint64_t> sequence;
+    uint64_t timestamp_ns;     // steady clock (CLOCK_MONOTONIC) at publish
+    uint32_t has_dirty;        // the slot's tile mask is relative to the previous frame
+};
+
+struct alignas(64) RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;           // PictureFormat
+    uint32_t slot_count;
+    uint64_t stride;           // bytes per row
+    uint64_t slot_bytes;       // page-aligned distance between slot pixels
+    uint64_t pixels_offset;    // from the start of the mapping
+    uint32_t tile_size;        // dirty tile mask: one byte per tile
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint64_t masks_offset;     // slot_count masks of tiles_x * tiles_y bytes
+    alignas(64) std::atomic<uint64_t> latest; // newest published frame, 0 = none
+};
+
+inline size_t alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+inline std::string shmName(const std::string& name) {
+    return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+inline uint64_t monotonicNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+class FrameRingProducer {
+private:
+    std::string name_;
+    uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    RingHeader* header_ = nullptr;
+    SlotHeader* slots_ = nullptr;
+    uint64_t frame_ = 0;       // frame being written, 0 = none
+    Picture target_;
+    std::vector<TileMask> coverage_; // per slot, kept in process memory
+
+    uint8_t* slotPixels(uint64_t frame) {
+        return base_ + header_->pixels_offset + (frame % header_->slot_count) * header_->slot_bytes;
+    }
+
+    uint8_t* slotMask(uint64_t frame) {
+        return base_ + header_->masks_offset + (frame % header_->slot_count) * header_->tiles_x * header_->tiles_y;
+    }
+
+public:
+    // Creates (or replaces) the shared-memory object. Throws std::system_error
+    // when it cannot be created or mapped.
+    FrameRingProducer(const std::string& name, int width, int height, PictureFormat format, int slot_count = 3)
+        : name_(shmName(name)) {
+        if (width <= 0 || height <= 0 || slot_count < 2) throw std::invalid_argument("invalid frame ring size");
+        const size_t channels = format == PictureFormat::RGB8 ? 3 : 4;
+        const size_t stride = static_cast<size_t>(width) * channels;
+        const size_t slot_bytes = alignUp(stride * height, kPageSize);
+        const TileMask grid(width, height);
+        const size_t masks_offset = sizeof(RingHeader) + sizeof(SlotHeader) * slot_count;
+        const size_t pixels_offset = alignUp(masks_offset + grid.size() * slot_count, kPageSize);
+        size_ = pixels_offset + slot_bytes * slot_count;
+
+        int fd = ::shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "shm_open " + name_);
+        if (::ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+            int err = errno;
+            ::close(fd);
+            ::shm_unlink(name_.c_str());
+            throw std::system_error(err, std::generic_category(), "ftruncate " + name_);
+        }
+        void* mapped = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            ::shm_unlink(name_.c_str());
+            throw std::system_error(err, std::generic_category(), "mmap " + name_);
+        }
+        base_ = static_cast<uint8_t*>(mapped);
+
+        header_ = new (base_) RingHeader{};
+        slots_ = reinterpret_cast<SlotHeader*>(base_ + sizeof(RingHeader));
+        for (int i = 0; i < slot_count; ++i) new (slots_ + i) SlotHeader{};
+        header_->width = static_cast<uint32_t>(width);
+        header_->height = static_cast<uint32_t>(height);
+        header_->format = static_cast<uint32_t>(format);
+        header_->slot_count = static_cast<uint32_t>(slot_count);
+        header_->stride = stride;
+        header_->slot_bytes = slot_bytes;
+        header_->pixels_offset = pixels_offset;
+        header_->tile_size = kDirtyTileSize;
+        header_->tiles_x = static_cast<uint32_t>(grid.tilesX());
+        header_->tiles_y = static_cast<uint32_t>(grid.tilesY());
+        header_->masks_offset = masks_offset;
+        coverage_.resize(slot_count);
+        header_->version = kRingVersion;
+        // consumers treat the ring as ready once the magic is visible
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->magic = kRingMagic;
+    }
+
+    ~FrameRingProducer() {
+        if (base_) {
+            ::munmap(base_, size_);
+            ::shm_unlink(name_.c_str());
+        }
+    }
+
+    FrameRingProducer(const FrameRingProducer&) = delete;
+    FrameRingProducer& operator=(const FrameRingProducer&) = delete;
+
+    // Marks the next slot as being written and returns a picture over its
+    // memory to render into. Valid until endFrame().
+    Picture& beginFrame() {
+        frame_ = header_->latest.load(std::memory_order_relaxed) + 1;
+        SlotHeader& slot = slots_[frame_ % header_->slot_count];
+        slot.sequence.store(2 * frame_ + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        target_ = Picture::view(slotPixels(frame_), static_cast<int>(header_->width), static_cast<int>(header_->height),
+                                static_cast<PictureFormat>(header_->format), header_->stride);
+        return target_;
+    }
+
+    // Coverage mask of the slot being written, to pass to render() with the
+    // picture from beginFrame. It limits the clear to what this slot's
+    // previous frame drew and lets endFrame publish the changed tiles. Use it
+    // for every frame or for none.
+    TileMask& coverage() {
+        return coverage_[frame_ % header_->slot_count];
+    }
+
+    // Publishes the frame started by beginFrame and returns its number.
+    uint64_t endFrame() {
+        SlotHeader& slot = slots_[frame_ % header_->slot_count];
+        const TileMask& current = coverage_[frame_ % header_->slot_count];
+        const TileMask& previous = coverage_[(frame_ - 1) % header_->slot_count];
+        slot.has_dirty = frame_ > 1 && current.matches(target_) && previous.matches(target_);
+        if (slot.has_dirty) {
+            uint8_t* mask = slotMask(frame_);
+            for (size_t i = 0; i < current.size(); ++i) mask[i] = current.data()[i] | previous.data()[i];
+        }
+        slot.timestamp_ns = monotonicNs();
+        slot.sequence.store(2 * frame_, std::memory_order_release);
+        header_->latest.store(frame_, std::memory_order_release);
+        return std::exchange(frame_, 0);
+    }
+
+    uint64_t published() const { return header_->latest.load(std::memory_order_relaxed); }
+    const std::string& name() const { return name_; }
+};
+
+// A published frame read in place. Check FrameRingConsumer::stillValid once
+// done with the pixels; a false result means they were being overwritten.
+struct RingFrame {
+    uint64_t number = 0;
+    uint64_t dropped = 0;      // frames skipped since the previous one taken
+    uint64_t timestamp_ns = 0;
+    Picture picture;           // read-only view into the slot
+    TileMask dirty;            // tiles changed since frame number - 1; empty if unknown
+};
+
+class FrameRingConsumer {
+private:
+    const uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    const RingHeader* header_ = nullptr;
+    const SlotHeader* slots_ = nullptr;
+    uint64_t last_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t torn_ = 0;
+    uint64_t copied_ = 0;      // frame last copied by copyFrame, 0 = none
+
+    std::optional<RingFrame> tryFrame(uint64_t number) {
+        const SlotHeader& slot = slots_[number % header_->slot_count];
+        if (slot.sequence.load(std::memory_order_acquire) != 2 * number) return std::nullopt;
+        RingFrame frame;
+        frame.number = number;
+        frame.timestamp_ns = slot.timestamp_ns;
+        uint8_t* pixels = const_cast<uint8_t*>(base_ + header_->pixels_offset +
+                                               (number % header_->slot_count) * header_->slot_bytes);
+        frame.picture = Picture::view(pixels, static_cast<int>(header_->width), static_cast<int>(header_->height),
+                                      static_cast<PictureFormat>(header_->format), header_->stride);
+        if (slot.has_dirty) {
+            frame.dirty.reset(width(), height());
+            std::memcpy(frame.dirty.data(), base_ + header_->masks_offset +
+                        (number % header_->slot_count) * frame.dirty.size(), frame.dirty.size());
+        }
+        frame.dropped = last_ == 0 ? number - 1 : number - last_ - 1;
+        dropped_ += frame.dropped;
+        last_ = number;
+        return frame;
+    }
+
+public:
+    // Maps the ring read-only. Throws std::system_error if it does not exist
+    // and std::runtime_error if it is not a frame ring of this version.
+    explicit FrameRingConsumer(const std::string& name) {
+        const std::string shm_name = shmName(name);
+        int fd = ::shm_open(shm_name.c_str(), O_RDONLY, 0);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "shm_open " + shm_name);
+        struct stat st{};
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RingHeader)) {
+            ::close(fd);
+            throw std::runtime_error(shm_name + " is not a frame ring");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (mapped == MAP_FAILED) throw std::system_error(err, std::generic_category(), "mmap " + shm_name);
+        base_ = static_cast<const uint8_t*>(mapped);
+        header_ = reinterpret_cast<const RingHeader*>(base_);
+        slots_ = reinterpret_cast<const SlotHeader*>(base_ + sizeof(RingHeader));
+
+        bool valid = header_->magic == kRingMagic;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        valid = valid && header_->version == kRingVersion && header_->slot_count >= 2 &&
+                header_->pixels_offset + header_->slot_bytes * header_->slot_count <= size_ &&
+                header_->tile_size == kDirtyTileSize;
+        if (!valid) {
+            ::munmap(const_cast<uint8_t*>(base_), size_);
+            base_ = nullptr;
+            throw std::runtime_error(shm_name + " is not a frame ring of version " + std::to_string(kRingVersion));
+        }
+    }
+
+    ~FrameRingConsumer() {
+        if (base_) ::munmap(const_cast<uint8_t*>(base_), size_);
+    }
+
+    FrameRingConsumer(const FrameRingConsumer&) = delete;
+    FrameRingConsumer& operator=(const FrameRingConsumer&) = delete;
+
+    // Newest published frame newer than the last one taken.
+    std::optional<RingFrame> latest() {
+        const uint64_t newest = header_->latest.load(std::memory_order_acquire);
+        if (newest == 0 || newest <= last_) return std::nullopt;
+        return tryFrame(newest);
+    }
+
+    // The frame after the last one taken, or the oldest still in the ring if
+    // that one was already overwritten.
+    std::optional<RingFrame> next() {
+        const uint64_t newest = header_->latest.load(std::memory_order_acquire);
+        if (newest == 0 || newest <= last_) return std::nullopt;
+        // the slot after newest may be mid-write, so only slot_count - 1 frames are safe
+        const uint64_t oldest = newest + 2 > header_->slot_count ? newest + 2 - header_->slot_count : 1;
+        for (uint64_t number = std::max(last_ + 1, oldest); number <= newest; ++number) {
+            if (auto frame = tryFrame(number)) return frame;
+        }
+        return std::nullopt;
+    }
+
+    // True if the frame's pixels were not touched by the producer while read.
+    bool stillValid(const RingFrame& frame) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const SlotHeader& slot = slots_[frame.number % header_->slot_count];
+        const bool valid = slot.sequence.load(std::memory_order_relaxed) == 2 * frame.number;
+        if (!valid) {
+            ++torn_;
+            if (copied_ == frame.number) copied_ = 0;
+        }
+        return valid;
+    }
+
+    // Copies the frame into dst, which is (re)allocated in the ring's format
+    // if needed. When dst holds the frame just before this one, as copied by
+    // the previous call, only the changed tiles are copied. Returns the bytes
+    // copied; call stillValid afterwards as for any read.
+    size_t copyFrame(const RingFrame& frame, Picture& dst) {
+        const Picture& src = frame.picture;
+        const int bpp = src.channels();
+        const bool same = dst.width() == src.width() && dst.height() == src.height() && dst.format() == src.format();
+        if (!same) dst = Picture(src.width(), src.height(), src.format());
+        const bool partial = same && copied_ != 0 && frame.number == copied_ + 1 && frame.dirty.matches(src);
+        copied_ = frame.number;
+
+        std::vector<TileRect> rects = partial ? frame.dirty.rects()
+                                              : std::vector<TileRect>{ {0, 0, src.width(), src.height()} };
+        for (const TileRect& r : rects) {
+            for (int y = r.y; y < r.y + r.height; ++y) {
+                std::memcpy(dst.row_ptr(y) + static_cast<size_t>(r.x) * bpp, src.row_ptr(y) + static_cast<size_t>(r.x) * bpp,
+                            static_cast<size_t>(r.width) * bpp);
+            }
+        }
+        return rectBytes(rects, bpp);
+    }
+
+    int width() const { return static_cast<int>(header_->width); }
+    int height() const { return static_cast<int>(header_->height); }
+    PictureFormat format() const { return static_cast<PictureFormat>(header_->format); }
+    uint64_t published() const { return header_->latest.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_; }
+    uint64_t torn() const { return torn_; }
+};
+
+}
@@ -0,0 +1,300 @@
+﻿#pragma once
+#include "graph.h"
+#include "dirty.h"
+#include "profiler.h"
+#include <immintrin.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// ANSI terminal output for headless (SSH) sessions. Every cell shows two
+// pixels with the upper half block: foreground is the top pixel, background
+// the bottom one. Only cells that changed since the previous frame are sent.
+enum class TerminalColor {
+    Palette256,
+    TrueColor,
+};
+
+struct TerminalStats {
+    size_t frames = 0;
+    size_t bytes = 0;           // total written
+    size_t last_bytes = 0;      // written for the last frame
+    size_t last_changed = 0;    // cells redrawn for the last frame
+    size_t last_sampled = 0;    // picture bytes read for the last frame
+};
+
+// Columns and rows of the terminal on fd, {80, 24} if it is not a terminal.
+inline std::pair<int, int> terminalSize(int fd = STDOUT_FILENO) {
+    winsize ws{};
+    if (::ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) return { ws.ws_col, ws.ws_row };
+    return { 80, 24 };
+}
+
+// Nearest xterm-256 colour: the 6x6x6 cube or the 24-step grey ramp.
+inline uint8_t xterm256(uint32_t rgb) {
+    const int r = rgb & 0xFF, g = (rgb >> 8) & 0xFF, b = (rgb >> 16) & 0xFF;
+    auto level = [](int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+    auto value = [](int l) { return l == 0 ? 0 : 55 + 40 * l; };
+    const int lr = level(r), lg = level(g), lb = level(b);
+    const int cr = value(lr), cg = value(lg), cb = value(lb);
+    const int cube_d = (r - cr) * (r - cr) + (g - cg) * (g - cg) + (b - cb) * (b - cb);
+
+    const int avg = (r + g + b) / 3;
+    const int grey = avg > 238 ? 23 : std::max(0, (avg - 3) / 10);
+    const int gv = 8 + 10 * grey;
+    const int grey_d = (r - gv) * (r - gv) + (g - gv) * (g - gv) + (b - gv) * (b - gv);
+    return static_cast<uint8_t>(grey_d < cube_d ? 232 + grey : 16 + 36 * lr + 6 * lg + lb);
+}
+
+class TerminalPresenter {
+private:
+    int fd_;
+    int columns_;
+    int rows_;
+    TerminalColor mode_;
+    // per cell, top pixel colour and bottom pixel colour (RGB, or the palette
+    // index in 256 mode); previous frame for the delta
+    std::vector<uint32_t> top_, bottom_, prev_top_, prev_bottom_;
+    std::vector<uint32_t> sums_;  // downsampling accumulators, 4 per column
+    std::vector<uint8_t> resample_;
+    bool full_redraw_ = true;
+    std::string out_;
+    TerminalStats stats_;
+
+    // Box-filters the picture down to columns_ x (2 * rows_) pixels. With a
+    // dirty mask, pixels whose box has no dirty tile keep their last value.
+    size_t downsample(const Picture& image, const TileMask* dirty) {
+        const int out_w = columns_, out_h = rows_ * 2;
+        const int w = image.width(), h = image.height();
+        sums_.assign(static_cast<size_t>(out_w) * 4, 0);
+        if (dirty && !dirty->matches(image)) dirty = nullptr;
+        if (dirty) {
+            top_ = prev_top_;
+            bottom_ = prev_bottom_;
+        }
+        size_t sampled = 0;
+
+        for (int oy = 0; oy < out_h; ++oy) {
+            const int y0 = oy * h / out_h, y1 = std::max(y0 + 1, (oy + 1) * h / out_h);
+            std::fill(sums_.begin(), sums_.end(), 0);
+            // columns to resample on this pixel row; the rest keep their value
+            resample_.assign(out_w, 1);
+            if (dirty) {
+                for (int ox = 0; ox < out_w; ++ox) {
+                    const int x0 = ox * w / out_w, x1 = std::max(x0 + 1, (ox + 1) * w / out_w);
+                    resample_[ox] = dirty->any(x0, y0, x1, y1);
+                }
+            }
+            for (int y = y0; y < y1; ++y) {
+                const uint8_t* row = image.row_ptr(y);
+                for (int ox = 0; ox < out_w; ++ox) {
+                    if (!resample_[ox]) continue;
+                    const int x0 = ox * w / out_w, x1 = std::max(x0 + 1, (ox + 1) * w / out_w);
+                    uint32_t* acc = sums_.data() + ox * 4;
+                    sampled += static_cast<size_t>(x1 - x0) * image.channels();
+                    int x = x0;
+                    if (image.isPacked()) {
+                        // 4 pixels widened to 16-bit lanes, folded to one pixel
+                        __m128i sum = _mm_setzero_si128();
+                        for (; x + 4 <= x1; x += 4) {
+                            __m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + 4 * x)));
+                            __m128i two = _mm_add_epi16(_mm256_castsi256_si128(px), _mm256_extracti128_si256(px, 1));
+                            sum = _mm_add_epi32(sum, _mm_cvtepu16_epi32(_mm_add_epi16(two, _mm_srli_si128(two, 8))));
+                        }
+                        for (; x < x1; ++x) {
+                            uint32_t p;
+                            std::memcpy(&p, row + 4 * x, 4);
+                            sum = _mm_add_epi32(sum, _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(p))));
+                        }
+                        alignas(16) uint32_t lanes[4];
+                        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sum);
+                        acc[0] += lanes[image.red_offset()];
+                        acc[1] += lanes[1];
+                        acc[2] += lanes[image.blue_offset()];
+                    } else {
+                        for (; x < x1; ++x) {
+                            acc[0] += row[3 * x];
+                            acc[1] += row[3 * x + 1];
+                            acc[2] += row[3 * x + 2];
+                        }
+                    }
+                    acc[3] += static_cast<uint32_t>(x1 - x0);
+                }
+            }
+
+            std::vector<uint32_t>& half = (oy & 1) ? bottom_ : top_;
+            uint32_t* cells = half.data() + static_cast<size_t>(oy / 2) * out_w;
+            for (int ox = 0; ox < out_w; ++ox) {
+                if (!resample_[ox]) continue;
+                const uint32_t* acc = sums_.data() + ox * 4;
+                const uint32_t n = acc[3] * static_cast<uint32_t>(y1 - y0);
+                const uint32_t rgb = (acc[0] + n / 2) / n | ((acc[1] + n / 2) / n) << 8 | ((acc[2] + n / 2) / n) << 16;
+                cells[ox] = mode_ == TerminalColor::Palette256 ? xterm256(rgb) : rgb;
+            }
+        }
+        return sampled;
+    }
+
+    void appendNumber(unsigned v) {
+        char digits[10];
+        int n = 0;
+        do { digits[n++] = static_cast<char>('0' + v % 10); v /= 10; } while (v);
+        while (n) out_.push_back(digits[--n]);
+    }
+
+    // SGR for one colour, foreground (38) or background (48).
+    void appendColor(int base, uint32_t color) {
+        out_ += "\x1b[";
+        appendNumber(static_cast<unsigned>(base));
+        if (mode_ == TerminalColor::Palette256) {
+            out_ += ";5;";
+            appendNumber(color);
+        } else {
+            out_ += ";2;";
+            appendNumber(color & 0xFF);
+            out_.push_back(';');
+            appendNumber((color >> 8) & 0xFF);
+            out_.push_back(';');
+            appendNumber((color >> 16) & 0xFF);
+        }
+        out_.push_back('m');
+    }
+
+    bool changed(size_t i) const {
+        return full_redraw_ || top_[i] != prev_top_[i] || bottom_[i] != prev_bottom_[i];
+    }
+
+    // Builds the escape sequences for the changed cells into out_. Changed
+    // cells are sent in runs: one cursor move per run, and colour codes only
+    // where the colour differs from the previous cell's. Unchanged gaps of up
+    // to kBridge cells are re-sent instead of moving the cursor again.
+    size_t encodeChanges() {
+        constexpr int kBridge = 3;
+        out_.clear();
+        out_ += "\x1b[?2026h"; // synchronized update, ignored where unsupported
+
+        size_t changed_cells = 0;
+        for (int row = 0; row < rows_; ++row) {
+            const size_t base = static_cast<size_t>(row) * columns_;
+            int col = 0;
+            while (col < columns_) {
+                if (!changed(base + col)) { ++col; continue; }
+                out_ += "\x1b[";
+                appendNumber(static_cast<unsigned>(row + 1));
+                out_.push_back(';');
+                appendNumber(static_cast<unsigned>(col + 1));
+                out_.push_back('H');
+
+                int64_t fg = -1, bg = -1;
+                for (; col < columns_; ++col) {
+                    const size_t i = base + col;
+                    if (changed(i)) {
+                        ++changed_cells;
+                    } else {
+                        // end the run when the gap is too long to bridge
+                        int gap = 0;
+                        while (col + gap < columns_ && !changed(base + col + gap) && gap <= kBridge) ++gap;
+                        if (gap > kBridge || col + gap == columns_) break;
+                    }
+                    const uint32_t t = top_[i], b = bottom_[i];
+                    if (b != bg) { appendColor(48, b); bg = b; }
+                    if (t == b) {
+                        out_.push_back(' ');
+                    } else {
+                        if (t != fg) { appendColor(38, t); fg = t; }
+                        out_ += "\xE2\x96\x80"; // upper half block
+                    }
+                }
+            }
+        }
+        out_ += "\x1b[0m\x1b[?2026l";
+        return changed_cells;
+    }
+
+public:
+    TerminalPresenter(int columns, int rows, TerminalColor mode = TerminalColor::TrueColor, int fd = STDOUT_FILENO)
+        : fd_(fd), columns_(std::max(columns, 1)), rows_(std::max(rows, 1)), mode_(mode) {
+        const size_t cells = static_cast<size_t>(columns_) * rows_;
+        top_.resize(cells);
+        bottom_.resize(cells);
+        prev_top_.resize(cells);
+        prev_bottom_.resize(cells);
+        writeAll("\x1b[?25l\x1b[2J");
+    }
+
+    ~TerminalPresenter() {
+        writeAll("\x1b[0m\x1b[?25h\r\n");
+    }
+
+    TerminalPresenter(const TerminalPresenter&) = delete;
+    TerminalPresenter& operator=(const TerminalPresenter&) = delete;
+
+    int columns() const { return columns_; }
+    int rows() const { return rows_; }
+
+    // The next frame redraws every cell, e.g. after the screen was cleared.
+    void invalidate() { full_redraw_ = true; }
+
+    // Draws the picture scaled to the cell grid, sending only the cells that
+    // changed.
+    //
+    // dirty, the tiles changed since the previous picture (see DirtyTracker),
+    // limits the downsampling to the cells over them.
+    void present(const Picture& image, const TileMask* dirty = nullptr) {
+        PROFILE_ZONE("present");
+        size_t sampled;
+        {
+            PROFILE_ZONE("downsample");
+            sampled = downsample(image, full_redraw_ ? nullptr : dirty);
+        }
+        size_t changed_cells;
+        {
+            PROFILE_ZONE("encode");
+            changed_cells = encodeChanges();
+        }
+
+        std::swap(top_, prev_top_);
+        std::swap(bottom_, prev_bottom_);
+        full_redraw_ = false;
+
+        stats_.frames++;
+        stats_.last_changed = changed_cells;
+        stats_.last_bytes = out_.size();
+        stats_.last_sampled = sampled;
+        stats_.bytes += out_.size();
+        {
+            PROFILE_ZONE("write");
+            writeAll(out_);
+        }
+    }
+
+    // Text on the row below the picture (row rows()+1), e.g. a status line.
+    void status(const std::string& text) {
+        std::string line = "\x1b[";
+        line += std::to_string(rows_ + 1) + ";1H\x1b[0m\x1b[2K" + text;
+        writeAll(line);
+    }
+
+    const TerminalStats& stats() const { return stats_; }
+
+private:
+    void writeAll(const std::string& data) {
+        const char* p = data.data();
+        size_t left = data.size();
+        while (left > 0) {
+            ssize_t n = ::write(fd_, p, left);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+    }
+};
@@ -0,0 +1,231 @@
+﻿#pragma once
+#include "model.h"
+#include "threadpool.h"
+
+// Block compression of RGBA8 textures into the Format::BC1 / Format::BC7
+// layouts that Texture samples directly.
+namespace texture {
+
+namespace detail {
+    // End points of the principal axis through the block colours (channels
+    // 0..dims-1), clamped to [0, 255].
+    inline void principalEndpoints(const uint32_t texels[16], int dims, float lo[4], float hi[4]) {
+        float px[16][4];
+        float mean[4] = {};
+        for (int i = 0; i < 16; ++i) {
+            for (int c = 0; c < dims; ++c) {
+                px[i][c] = static_cast<float>((texels[i] >> (8 * c)) & 0xFF);
+                mean[c] += px[i][c] / 16.f;
+            }
+        }
+        float cov[4][4] = {};
+        for (int i = 0; i < 16; ++i)
+            for (int a = 0; a < dims; ++a)
+                for (int b = 0; b < dims; ++b)
+                    cov[a][b] += (px[i][a] - mean[a]) * (px[i][b] - mean[b]);
+
+        float axis[4] = { 1.f, 1.f, 1.f, 1.f };
+        for (int iter = 0; iter < 8; ++iter) {
+            float next[4] = {};
+            float len = 0;
+            for (int a = 0; a < dims; ++a) {
+                for (int b = 0; b < dims; ++b) next[a] += cov[a][b] * axis[b];
+                len += next[a] * next[a];
+            }
+            if (len < 1e-12f) break;
+            len = 1.f / std::sqrt(len);
+            for (int a = 0; a < dims; ++a) axis[a] = next[a] * len;
+        }
+
+        float tmin = 0, tmax = 0;
+        for (int i = 0; i < 16; ++i) {
+            float t = 0;
+            for (int c = 0; c < dims; ++c) t += (px[i][c] - mean[c]) * axis[c];
+            tmin = std::min(tmin, t);
+            tmax = std::max(tmax, t);
+        }
+        for (int c = 0; c < dims; ++c) {
+            lo[c] = std::clamp(mean[c] + axis[c] * tmin, 0.f, 255.f);
+            hi[c] = std::clamp(mean[c] + axis[c] * tmax, 0.f, 255.f);
+        }
+    }
+
+    inline int colorDistance(uint32_t a, uint32_t b, int channels) {
+        int d = 0;
+        for (int c = 0; c < channels; ++c) {
+            int diff = static_cast<int>((a >> (8 * c)) & 0xFF) - static_cast<int>((b >> (8 * c)) & 0xFF);
+            d += diff * diff;
+        }
+        return d;
+    }
+
+    inline uint32_t toRGB565(const float c[3]) {
+        uint32_t r = static_cast<uint32_t>(std::lround(c[0] * 31.f / 255.f));
+        uint32_t g = static_cast<uint32_t>(std::lround(c[1] * 63.f / 255.f));
+        uint32_t b = static_cast<uint32_t>(std::lround(c[2] * 31.f / 255.f));
+        return (r << 11) | (g << 5) | b;
+    }
+
+    struct BitWriter {
+        uint32_t* words;
+        int pos = 0;
+
+        void put(uint32_t value, int count) {
+            for (int i = 0; i < count; ++i, ++pos) {
+                if ((value >> i) & 1) words[pos >> 5] |= 1u << (pos & 31);
+            }
+        }
+    };
+}
+
+inline void encodeBC1Block(const uint32_t texels[16], uint32_t out[2]) {
+    float lo[4], hi[4];
+    detail::principalEndpoints(texels, 3, lo, hi);
+    uint32_t c0 = detail::toRGB565(hi);
+    uint32_t c1 = detail::toRGB565(lo);
+    if (c0 < c1) std::swap(c0, c1);
+
+    out[0] = c0 | (c1 << 16);
+    out[1] = 0;
+    if (c0 == c1) return; // flat block, every index selects c0
+
+    uint32_t palette[4];
+    for (int i = 0; i < 4; ++i) {
+        out[1] = static_cast<uint32_t>(i);
+        palette[i] = decodeBC1Texel(out, 0);
+    }
+    out[1] = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, best_d = detail::colorDistance(texels[i], palette[0], 3);
+        for (int p = 1; p < 4; ++p) {
+            int d = detail::colorDistance(texels[i], palette[p], 3);
+            if (d < best_d) { best = p; best_d = d; }
+        }
+        out[1] |= static_cast<uint32_t>(best) << (2 * i);
+    }
+}
+
+// BC7 mode 6: RGBA 7.7.7.7 end points with one p-bit each and 4-bit indices.
+inline void encodeBC7Block(const uint32_t texels[16], uint32_t out[4]) {
+    float ends[2][4];
+    detail::principalEndpoints(texels, 4, ends[0], ends[1]);
+
+    uint32_t q[2][4], p[2];
+    for (int e = 0; e < 2; ++e) {
+        float best_err = 1e30f;
+        for (uint32_t pbit = 0; pbit < 2; ++pbit) {
+            uint32_t cand[4];
+            float err = 0;
+            for (int c = 0; c < 4; ++c) {
+                cand[c] = static_cast<uint32_t>(std::clamp(std::lround((ends[e][c] - pbit) / 2.f), 0l, 127l));
+                float d = static_cast<float>((cand[c] << 1) | pbit) - ends[e][c];
+                err += d * d;
+            }
+            if (err < best_err) {
+                best_err = err;
+                p[e] = pbit;
+                std::copy(cand, cand + 4, q[e]);
+            }
+        }
+    }
+
+    uint32_t palette[16];
+    for (int i = 0; i < 16; ++i) {
+        uint32_t w = kBC7Weights4[i];
+        palette[i] = 0;
+        for (int c = 0; c < 4; ++c) {
+            uint32_t e0 = (q[0][c] << 1) | p[0], e1 = (q[1][c] << 1) | p[1];
+            palette[i] |= (((64 - w) * e0 + w * e1 + 32) >> 6) << (8 * c);
+        }
+    }
+    uint32_t index[16];
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, best_d = detail::colorDistance(texels[i], palette[0], 4);
+        for (int k = 1; k < 16; ++k) {
+            int d = detail::colorDistance(texels[i], palette[k], 4);
+            if (d < best_d) { best = k; best_d = d; }
+        }
+        index[i] = static_cast<uint32_t>(best);
+    }
+    // the anchor index is stored with its top bit implied zero
+    if (index[0] & 8) {
+        std::swap(q[0], q[1]);
+        std::swap(p[0], p[1]);
+        for (auto& i : index) i = 15 - i;
+    }
+
+    std::fill(out, out + 4, 0u);
+    detail::BitWriter bits{out};
+    bits.put(1u << 6, 7);
+    for (int c = 0; c < 4; ++c) {
+        bits.put(q[0][c], 7);
+        bits.put(q[1][c], 7);
+    }
+    bits.put(p[0], 1);
+    bits.put(p[1], 1);
+    bits.put(index[0], 3);
+    for (int i = 1; i < 16; ++i) bits.put(index[i], 4);
+}
+
+// Re-encodes every level of an RGBA8 texture as blocks; partial blocks at
+// the edges repeat the last row/column. Tiled textures are read through their
+// layout, so the result is always the linear block layout. Block rows go to
+// the pool. Returns false, leaving the texture as it is, when there is nothing
+// to encode: no texels, an already compressed texture or Format::RGBA8.
+inline bool compressTexture(Texture& texture, Format format, ThreadPool& pool = defaultThreadPool()) {
+    if (format == Format::RGBA8 || texture.format != Format::RGBA8 || texture.data.empty()) return false;
+
+    const int words = blockWords(format);
+    std::vector<MipLevel> levels;
+    size_t total = 0;
+    for (const auto& level : texture.levels) {
+        int bx = (level.width + 3) / 4, by = (level.height + 3) / 4;
+        levels.push_back(MipLevel{level.width, level.height, static_cast<int>(total), bx});
+        total += static_cast<size_t>(bx) * by * words;
+    }
+
+    std::vector<uint32_t> blocks(total);
+    for (size_t l = 0; l < levels.size(); ++l) {
+        const MipLevel& src = texture.levels[l];
+        const MipLevel& dst = levels[l];
+        const int rows = (dst.height + 3) / 4;
+        pool.parallelFor(0, rows, std::max<size_t>(1, 256 / dst.pitch), [&](size_t r0, size_t r1) {
+            uint32_t texels[16];
+            for (size_t by = r0; by < r1; ++by) {
+                for (int bx = 0; bx < dst.pitch; ++bx) {
+                    for (int i = 0; i < 16; ++i) {
+                        int x = std::min(bx * 4 + (i & 3), src.width - 1);
+                        int y = std::min(static_cast<int>(by) * 4 + (i >> 2), src.height - 1);
+                        texels[i] = texture.texel(src, x, y);
+                    }
+                    uint32_t* out = blocks.data() + dst.offset + (by * dst.pitch + bx) * words;
+                    if (format == Format::BC1) encodeBC1Block(texels, out);
+                    else encodeBC7Block(texels, out);
+                }
+            }
+        });
+    }
+
+    texture.data = std::move(blocks);
+    texture.levels = std::move(levels);
+    texture.layout = Layout::Linear;
+    texture.format = format;
+    return true;
+}
+
+inline Texture loadCompressedTexture(const std::string& filename, Format format) {
+    Texture texture = loadTexture(filename);
+    if (texture.isLoaded) compressTexture(texture, format);
+    return texture;
+}
+
+// "rgba8", "bc1" or "bc7"; false for anything else.
+inline bool parseFormat(const std::string& name, Format& format) {
+    if (name == "rgba8") format = Format::RGBA8;
+    else if (name == "bc1") format = Format::BC1;
+    else if (name == "bc7") format = Format::BC7;
+    else return false;
+    return true;
+}
+
+}
@@ -0,0 +1,430 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Counts unfinished jobs. Jobs started with a counter keep it above zero
+// until they return; ThreadPool::wait helps run jobs until it reaches zero
+// and ThreadPool::runAfter starts a job once it does, which is how jobs
+// depend on each other. A counter can be reused once it is back at zero.
+// A job that throws still counts as finished; the first exception is kept
+// and rethrown by ThreadPool::wait.
+class JobCounter {
+private:
+    friend class ThreadPool;
+    std::atomic<size_t> pending_{0};
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::exception_ptr error_;
+    // jobs waiting for the counter and the counters they report to
+    std::vector<std::pair<std::function<void()>, JobCounter*>> continuations_;
+
+public:
+    JobCounter() = default;
+    JobCounter(const JobCounter&) = delete;
+    JobCounter& operator=(const JobCounter&) = delete;
+
+    bool done() const { return pending_.load(std::memory_order_acquire) == 0; }
+    size_t pending() const { return pending_.load(std::memory_order_acquire); }
+};
+
+struct WorkerStats {
+    size_t jobs = 0;          // jobs this worker ran
+    size_t steals = 0;        // of those, taken from another worker's deque
+    size_t depth = 0;         // jobs in its deque now
+    size_t max_depth = 0;     // deepest its deque has been
+    double busy_ms = 0;       // running jobs
+    double idle_ms = 0;       // asleep, waiting for work
+};
+
+// Work-stealing scheduler shared by the loaders and the renderer. Every
+// worker owns a deque: it pushes and pops its own jobs at the back, where
+// they are still warm in its cache, and idle workers steal from the front
+// of the others, where the oldest and usually biggest jobs are. Jobs from
+// threads outside the pool go to a shared queue.
+//
+// A thread waiting for jobs (wait, parallelFor) runs queued jobs meanwhile,
+// so nested parallel loops cannot deadlock. parallelFor only takes jobs from
+// the workers' deques, which hold the split-up work of running jobs, and
+// leaves the shared queue - loads submitted from elsewhere - to the workers,
+// so a render waiting on its tiles does not pick up a texture decode.
+class ThreadPool {
+private:
+    struct Job {
+        std::function<void()> run;
+        JobCounter* counter = nullptr;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+        std::thread thread;
+        std::atomic<size_t> executed{0};
+        std::atomic<size_t> steals{0};
+        std::atomic<size_t> max_depth{0};
+        std::atomic<int64_t> busy_ns{0};
+        std::atomic<int64_t> idle_ns{0};
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    mutable std::mutex shared_mutex_;
+    std::deque<Job> shared_;
+    std::atomic<size_t> queued_{0};      // jobs in all queues
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    size_t sleepers_ = 0;
+    bool stopping_ = false;
+
+    // the pool and worker index of the calling thread, if it is a worker
+    static inline thread_local const ThreadPool* current_pool_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+
+    static int64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Worker* self() const { return current_pool_ == this ? workers_[current_index_].get() : nullptr; }
+
+    void push(Job job) {
+        // counted before it is visible, so queued_ never drops below the jobs queued
+        queued_.fetch_add(1, std::memory_order_release);
+        if (Worker* w = self()) {
+            std::lock_guard lock(w->mutex);
+            w->jobs.push_back(std::move(job));
+            size_t depth = w->jobs.size(), seen = w->max_depth.load(std::memory_order_relaxed);
+            if (depth > seen) w->max_depth.store(depth, std::memory_order_relaxed);
+        } else {
+            std::lock_guard lock(shared_mutex_);
+            shared_.push_back(std::move(job));
+        }
+        {
+            std::lock_guard lock(sleep_mutex_);
+            if (sleepers_ == 0) return;
+        }
+        wake_.notify_one();
+    }
+
+    // Own deque (back), then the shared queue if allowed, then the other
+    // workers' deques (front).
+    bool take(Job& job, bool use_shared) {
+        if (queued_.load(std::memory_order_acquire) == 0) return false;
+        Worker* me = self();
+        if (me) {
+            std::lock_guard lock(me->mutex);
+            if (!me->jobs.empty()) {
+                job = std::move(me->jobs.back());
+                me->jobs.pop_back();
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (use_shared) {
+            std::lock_guard lock(shared_mutex_);
+            if (!shared_.empty()) {
+                job = std::move(shared_.front());
+                shared_.pop_front();
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        const size_t n = workers_.size();
+        const size_t start = me ? current_index_ + 1 : 0;
+        for (size_t k = 0; k < n; ++k) {
+            Worker& victim = *workers_[(start + k) % n];
+            if (&victim == me) continue;
+            std::lock_guard lock(victim.mutex);
+            if (victim.jobs.empty()) continue;
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            if (me) me->steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    static void report(const std::exception_ptr& error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "thread pool job failed: %s\n", e.what());
+        } catch (...) {
+            std::fprintf(stderr, "thread pool job failed\n");
+        }
+    }
+
+    void execute(Job& job) {
+        Worker* me = self();
+        const int64_t start = me ? nowNs() : 0;
+        std::exception_ptr error;
+        try {
+            job.run();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (me) {
+            me->busy_ns.fetch_add(nowNs() - start, std::memory_order_relaxed);
+            me->executed.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (job.counter) finish(*job.counter, error);
+        else if (error) report(error);
+    }
+
+    // The last decrement happens under the counter's mutex, which wait()
+    // takes before it returns, so the counter outlives this call.
+    void finish(JobCounter& counter, const std::exception_ptr& error) {
+        std::vector<std::pair<std::function<void()>, JobCounter*>> ready;
+        {
+            std::lock_guard lock(counter.mutex_);
+            if (error && !counter.error_) counter.error_ = error;
+            if (counter.pending_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+            ready.swap(counter.continuations_);
+            counter.done_.notify_all();
+        }
+        // queued like any other job, so idle workers can steal them
+        for (auto& [run, next] : ready) push({ std::move(run), next });
+    }
+
+    // Runs one queued job if there is one the caller may take.
+    bool helpOnce(bool use_shared = false) {
+        Job job;
+        if (!take(job, use_shared)) return false;
+        execute(job);
+        return true;
+    }
+
+    void workerLoop(size_t index) {
+        current_pool_ = this;
+        current_index_ = index;
+        Worker& me = *workers_[index];
+        for (;;) {
+            Job job;
+            if (take(job, true)) {
+                execute(job);
+                continue;
+            }
+            const int64_t idle_start = nowNs();
+            bool stop;
+            {
+                std::unique_lock lock(sleep_mutex_);
+                ++sleepers_;
+                wake_.wait(lock, [this] { return stopping_ || queued_.load(std::memory_order_acquire) > 0; });
+                --sleepers_;
+                stop = stopping_ && queued_.load() == 0;
+            }
+            me.idle_ns.fetch_add(nowNs() - idle_start, std::memory_order_relaxed);
+            if (stop) return;
+        }
+    }
+
+    static void pin(std::thread& thread, size_t index) {
+#ifdef __linux__
+        const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread;
+        (void)index;
+#endif
+    }
+
+public:
+    // pin_workers binds worker i to CPU i (Linux; ignored elsewhere).
+    explicit ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()), bool pin_workers = false) {
+        workers_.reserve(threads);
+        for (unsigned i = 0; i < threads; ++i) workers_.push_back(std::make_unique<Worker>());
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_[i]->thread = std::thread([this, i] { workerLoop(i); });
+            if (pin_workers) pin(workers_[i]->thread, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& w : workers_) w->thread.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers_.size(); }
+
+    // Queues job; counter, if given, stays above zero until it has run. An
+    // exception from a job without a counter is printed to stderr.
+    void run(std::function<void()> job, JobCounter* counter = nullptr) {
+        if (counter) counter->pending_.fetch_add(1, std::memory_order_relaxed);
+        push({ std::move(job), counter });
+    }
+
+    // Queues job once dependency reaches zero (at once if it already has).
+    void runAfter(JobCounter& dependency, std::function<void()> job, JobCounter* counter = nullptr) {
+        if (counter) counter->pending_.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard lock(dependency.mutex_);
+            if (!dependency.done()) {
+                dependency.continuations_.emplace_back(std::move(job), counter);
+                return;
+            }
+        }
+        push({ std::move(job), counter });
+    }
+
+    // Returns once counter is zero, running queued jobs while it waits, and
+    // rethrows the first exception of its jobs. A thread outside the pool
+    // also takes from the shared queue, where its own run() calls went, so
+    // waiting works on a pool without workers.
+    void wait(JobCounter& counter) {
+        const bool use_shared = self() == nullptr;
+        while (!counter.done()) {
+            if (helpOnce(use_shared)) continue;
+            std::unique_lock lock(counter.mutex_);
+            counter.done_.wait_for(lock, std::chrono::microseconds(200), [&] { return counter.done(); });
+        }
+        std::exception_ptr error;
+        {
+            // the finishing thread holds the mutex until it is done with the counter
+            std::lock_guard lock(counter.mutex_);
+            error = std::exchange(counter.error_, nullptr);
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+    template <class F>
+    auto submit(F&& f) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using R = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        run([task] { (*task)(); });
+        return result;
+    }
+
+    // Runs body(chunk_begin, chunk_end) over [begin, end) in chunks of grain.
+    // The calling thread takes chunks too and only waits for chunks, never for
+    // helpers to start, so nested calls from a worker cannot deadlock. The
+    // first exception from body is rethrown once every chunk has finished.
+    void parallelFor(size_t begin, size_t end, size_t grain,
+                     const std::function<void(size_t, size_t)>& body) {
+        if (begin >= end) return;
+        grain = std::max<size_t>(grain, 1);
+        const size_t chunks = (end - begin + grain - 1) / grain;
+        if (chunks == 1 || workers_.empty()) {
+            body(begin, end);
+            return;
+        }
+
+        struct State {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::exception_ptr error;
+        };
+        auto state = std::make_shared<State>();
+        auto run_chunks = [state, begin, end, grain, chunks, &body] {
+            for (;;) {
+                size_t c = state->next.fetch_add(1);
+                if (c >= chunks) return;
+                size_t b = begin + c * grain;
+                try {
+                    body(b, std::min(end, b + grain));
+                } catch (...) {
+                    std::lock_guard lock(state->mutex);
+                    if (!state->error) state->error = std::current_exception();
+                }
+                if (state->done.fetch_add(1) + 1 == chunks) {
+                    std::lock_guard lock(state->mutex);
+                    state->cv.notify_all();
+                }
+            }
+        };
+
+        const size_t helpers = std::min(chunks - 1, workers_.size());
+        for (size_t i = 0; i < helpers; ++i) push({ run_chunks, nullptr });
+
+        run_chunks();
+        // chunks still running elsewhere; help with other split-up work
+        while (state->done.load() != chunks) {
+            if (helpOnce()) continue;
+            std::unique_lock lock(state->mutex);
+            state->cv.wait_for(lock, std::chrono::microseconds(200), [&] { return state->done.load() == chunks; });
+        }
+        std::lock_guard lock(state->mutex);
+        if (state->error) std::rethrow_exception(state->error);
+    }
+
+    std::vector<WorkerStats> workerStats() const {
+        std::vector<WorkerStats> stats(workers_.size());
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            Worker& w = *workers_[i];
+            WorkerStats& s = stats[i];
+            s.jobs = w.executed.load(std::memory_order_relaxed);
+            s.steals = w.steals.load(std::memory_order_relaxed);
+            s.max_depth = w.max_depth.load(std::memory_order_relaxed);
+            s.busy_ms = w.busy_ns.load(std::memory_order_relaxed) / 1e6;
+            s.idle_ms = w.idle_ns.load(std::memory_order_relaxed) / 1e6;
+            std::lock_guard lock(w.mutex);
+            s.depth = w.jobs.size();
+        }
+        return stats;
+    }
+
+    // jobs waiting in the shared queue
+    size_t sharedDepth() const {
+        std::lock_guard lock(shared_mutex_);
+        return shared_.size();
+    }
+
+    void resetStats() {
+        for (auto& w : workers_) {
+            w->executed = 0;
+            w->steals = 0;
+            w->busy_ns = 0;
+            w->idle_ns = 0;
+            std::lock_guard lock(w->mutex);
+            w->max_depth = w->jobs.size();
+        }
+    }
+
+    // One line per worker: jobs, steals, queue depth and busy/idle time.
+    std::string statsReport() const {
+        std::string out = "worker      jobs   steals  depth  max depth    busy ms    idle ms\n";
+        const std::vector<WorkerStats> stats = workerStats();
+        for (size_t i = 0; i < stats.size(); ++i) {
+            const WorkerStats& s = stats[i];
+            char line[128];
+            std::snprintf(line, sizeof(line), "%6zu %9zu %8zu %6zu %10zu %10.2f %10.2f\n", i, s.jobs, s.steals, s.depth,
+                          s.max_depth, s.busy_ms, s.idle_ms);
+            out += line;
+        }
+        return out;
+    }
+};
+
+inline ThreadPool& defaultThreadPool() {
+    static ThreadPool pool;
+    return pool;
+}
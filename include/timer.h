@@ -1,6 +1,68 @@
 ﻿#pragma once
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
 #include <thread>
+#include <vector>
+#ifdef __linux__
+#include <time.h>
+#endif
+
+// How RenderTimer::waitIfNeeded gets to the frame deadline.
+enum class PacingMode {
+    Spin,    // sleep until 2 ms before the deadline, spin the rest: least jitter, most CPU
+    Hybrid,  // sleep until the predicted wake-up overshoot before it, then yield
+    Sleep,   // one sleep to the deadline: no busy time, late by the scheduler's overshoot
+};
+
+struct PacingOptions {
+    PacingMode mode = PacingMode::Hybrid;
+    // Hybrid wakes mean + safety * deviation of the measured overshoot early;
+    // a larger value yields longer (CPU) for fewer late wake-ups (jitter)
+    double safety = 3.0;
+    double max_margin_ms = 4.0;  // bound of the early wake-up
+};
+
+// Wake-up error is how far after the deadline waitIfNeeded returned. Frames
+// that reached waitIfNeeded after their deadline are overruns, not pacing
+// errors, and are only counted.
+struct PacingStats {
+    size_t frames = 0;
+    size_t overruns = 0;
+    double mean_error_us = 0;
+    double p50_error_us = 0;
+    double p99_error_us = 0;
+    double max_error_us = 0;
+    double overshoot_us = 0;   // predicted sleep overshoot
+    double busy_ms = 0;        // spent spinning or yielding, total
+
+    std::string describe() const {
+        char text[256];
+        std::snprintf(text, sizeof(text),
+                      "pacing: %zu frames, %zu overruns, wake-up error mean %.1f us p50 %.1f us p99 %.1f us max %.1f us, "
+                      "overshoot %.1f us, busy %.2f ms/frame",
+                      frames, overruns, mean_error_us, p50_error_us, p99_error_us, max_error_us, overshoot_us,
+                      frames ? busy_ms / frames : 0.0);
+        return text;
+    }
+};
+
+// Sleeps until an absolute steady_clock time. On Linux steady_clock is
+// CLOCK_MONOTONIC, so clock_nanosleep with TIMER_ABSTIME cannot drift by the
+// time spent computing a relative interval.
+inline void sleepUntil(std::chrono::steady_clock::time_point deadline) {
+#ifdef __linux__
+    const long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    const timespec ts{ static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+    while (::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+#else
+    std::this_thread::sleep_until(deadline);
+#endif
+}
 
 class RenderTimer {
 private:
@@ -17,6 +79,18 @@ private:
     float fps = 0.0f;
     int frameCount = 0;
 
+    static constexpr size_t kErrorWindow = 1024;
+    PacingOptions pacing;
+    // predicted sleep overshoot, us; starts pessimistic and converges
+    double overshootMean = 1000.0;
+    double overshootDev = 500.0;
+    size_t pacedFrames = 0;
+    size_t overruns = 0;
+    double errorTotal = 0;
+    double errorMax = 0;
+    std::vector<double> errors;
+    std::chrono::steady_clock::duration busyTime{};
+
 public:
     RenderTimer(int targetFPS = 60) {
         setTargetFPS(targetFPS);
@@ -65,38 +139,92 @@ public:
         }
     }
     
+    void setPacing(const PacingOptions& options) { pacing = options; }
+    const PacingOptions& getPacing() const { return pacing; }
+
+    // Waits for the end of the current frame period, then starts the next.
     void waitIfNeeded() {
-        auto currentTime = std::chrono::steady_clock::now();
-        
+        using namespace std::chrono;
+        auto currentTime = steady_clock::now();
+
         if (currentTime < frameEndTargetTime) {
-            // 修复6：统一duration类型进行比较
-            auto waitTime = frameEndTargetTime - currentTime;
-            auto threshold = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::milliseconds(2));
-            
-            if (waitTime > threshold) {
-                // 修复7：sleep_for 需要相同单位的duration
-                auto sleepTime = waitTime - std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::milliseconds(1));
-                std::this_thread::sleep_for(sleepTime);
-            }
-            
-            // 短时间等待：自旋等待
-            while (std::chrono::steady_clock::now() < frameEndTargetTime) {
-                // 忙等待
+            if (pacing.mode == PacingMode::Spin) {
+                if (frameEndTargetTime - currentTime > milliseconds(2)) sleepAndMeasure(frameEndTargetTime - milliseconds(2));
+                const auto busy = steady_clock::now();
+                while (steady_clock::now() < frameEndTargetTime) {
+                }
+                busyTime += steady_clock::now() - busy;
+            } else if (pacing.mode == PacingMode::Sleep) {
+                sleepAndMeasure(frameEndTargetTime);
+            } else {
+                const double margin_us = std::min(overshootMean + pacing.safety * overshootDev, pacing.max_margin_ms * 1000.0);
+                const auto wake = frameEndTargetTime - duration_cast<nanoseconds>(duration<double, std::micro>(std::max(0.0, margin_us)));
+                if (wake > currentTime) sleepAndMeasure(wake);
+                const auto busy = steady_clock::now();
+                while (steady_clock::now() < frameEndTargetTime) std::this_thread::yield();
+                busyTime += steady_clock::now() - busy;
             }
+            recordError(duration<double, std::micro>(steady_clock::now() - frameEndTargetTime).count());
+        } else {
+            overruns++;
         }
-        
-        // 修复8：正确更新下一帧目标时间
-        frameEndTargetTime += std::chrono::duration_cast<std::chrono::nanoseconds>(targetFrameTime);
-        
-        // 修复9：比较时要统一duration类型
+
+        frameEndTargetTime += duration_cast<nanoseconds>(targetFrameTime);
+
+        // after a long stall start a new schedule instead of rushing to catch up
         auto overshoot = currentTime - frameEndTargetTime;
-        auto maxDrift = std::chrono::duration_cast<std::chrono::nanoseconds>(targetFrameTime * 3);
-        
+        auto maxDrift = duration_cast<nanoseconds>(targetFrameTime * 3);
         if (overshoot > maxDrift) {
             std::cout << "Frame drift detected, skipping ahead" << std::endl;
-            frameEndTargetTime = currentTime + std::chrono::duration_cast<std::chrono::nanoseconds>(targetFrameTime);
+            frameEndTargetTime = currentTime + duration_cast<nanoseconds>(targetFrameTime);
         }
     }
+
+    PacingStats getPacingStats() const {
+        PacingStats s;
+        s.frames = pacedFrames + overruns;
+        s.overruns = overruns;
+        s.overshoot_us = overshootMean;
+        s.busy_ms = std::chrono::duration<double, std::milli>(busyTime).count();
+        if (pacedFrames == 0) return s;
+        s.mean_error_us = errorTotal / pacedFrames;
+        s.max_error_us = errorMax;
+        std::vector<double> sorted = errors;
+        std::sort(sorted.begin(), sorted.end());
+        auto pct = [&](double p) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))]; };
+        s.p50_error_us = pct(0.5);
+        s.p99_error_us = pct(0.99);
+        return s;
+    }
+
+    void resetPacingStats() {
+        pacedFrames = overruns = 0;
+        errorTotal = errorMax = 0;
+        errors.clear();
+        busyTime = {};
+    }
+
+private:
+    // Sleeps until wake and feeds how late it woke up into the overshoot
+    // estimate: a smoothed mean and mean deviation, like TCP's RTT estimator.
+    void sleepAndMeasure(std::chrono::steady_clock::time_point wake) {
+        sleepUntil(wake);
+        const double late_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wake).count();
+        const double delta = late_us - overshootMean;
+        overshootMean += delta / 8;
+        overshootDev += (std::abs(delta) - overshootDev) / 4;
+    }
+
+    void recordError(double error_us) {
+        pacedFrames++;
+        errorTotal += error_us;
+        errorMax = std::max(errorMax, error_us);
+        // the last kErrorWindow frames for the percentiles
+        if (errors.size() < kErrorWindow) errors.push_back(error_us);
+        else errors[pacedFrames % kErrorWindow] = error_us;
+    }
+
+public:
     float getDeltaTime() const { return deltaTime; }
     float getTotalTime() const { return totalTime; }
     float getFPS() const { return fps; }
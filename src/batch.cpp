@@ -0,0 +1,474 @@
+﻿#include "linear.h"
+#include "graph.h"
+#include "render.h"
+#include "model.h"
+#include "assets.h"
+#include "imageio.h"
+#include "framesink.h"
+#ifndef _WIN32
+#include "shmring.h"
+#endif
+#include "threadpool.h"
+#include "profiler.h"
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+namespace fs = std::filesystem;
+
+// Headless batch renderer: renders every camera pose of every job in a job
+// file to an image, several jobs at a time, without a window.
+//
+//   render_batch <job file> [-o output_dir] [-j concurrent_jobs] [--ppm] [--png-level 0-9]
+//                [--stats] [--overdraw] [--compress bc1|bc7]
+//
+// Images are written as PNG (level 1 by default, 0 is the uncompressed fast
+// path) or with --ppm as binary PPM. --stats prints the rasterizer counters
+// of each job and, per worker of the job and render pools, the jobs run,
+// steals, queue depth and busy/idle time. --overdraw also writes a heat map
+// of fragments per pixel next to every image (<image>_overdraw.png; blue is
+// 1, red 8, white more).
+// --compress block-compresses the textures at load and samples them as BC1
+// or BC7.
+//
+// RENDER_PROFILE builds treat every image as a profiler frame, print the zone
+// summary at the end and with --trace <file> write a Chrome trace. --counters
+// adds hardware counters per zone (Linux perf_event). Profiler frames span
+// all threads, so these builds run one job at a time (-j 1) to keep one
+// image per frame.
+//
+// Job file, one directive per line, '#' starts a comment. size/fov/clip/up
+// before the first job are defaults for all jobs, after it they apply to the
+// current job only.
+//
+//   size 512 512
+//   fov 60                      vertical, degrees
+//   clip 0.1 100                near and far plane
+//   up 0 1 0
+//   job models/cube.obj [texture.png]
+//   pose ex ey ez tx ty tz      camera position and target
+//   orbit 8 4 1.5               8 poses on a circle of radius 4, height 1.5, around the origin
+//   video flythrough.y4m        stream the job's poses as Y4M frames instead of images
+//   video | ffmpeg -i - a.mp4   ... or pipe them into a command
+//   fps 30                      frame rate written to the Y4M header
+//   shm render_ring 3           render the poses into a 3-slot shared-memory ring (POSIX)
+
+namespace {
+
+struct Pose {
+    vec3 eye;
+    vec3 target;
+};
+
+struct Job {
+    std::string model_path;
+    std::string texture_path;
+    int width = 512;
+    int height = 512;
+    float fov = 60.f;
+    float near_plane = 0.1f;
+    float far_plane = 100.f;
+    vec3 up = vec3(0, 1, 0);
+    std::vector<Pose> poses;
+    std::string video;           // file, or "| command"
+    int fps = 30;
+    std::string shm_name;        // shared-memory ring instead of files
+    int shm_slots = 3;
+};
+
+struct OutputOptions {
+    bool ppm = false;
+    imageio::PngOptions png;
+    bool stats = false;
+    bool overdraw = false;
+};
+
+struct JobResult {
+    size_t images = 0;
+    size_t failed = 0;
+    double load_ms = 0;
+    double render_ms = 0;
+    double write_ms = 0;
+    RasterStats raster;
+    int max_overdraw = 0;
+};
+
+std::vector<Job> parseJobFile(const std::string& filename) {
+    std::ifstream fin(filename);
+    if (!fin) throw std::runtime_error("cannot open job file: " + filename);
+
+    Job defaults;
+    std::vector<Job> jobs;
+    std::string line;
+    for (int line_no = 1; std::getline(fin, line); ++line_no) {
+        if (auto hash = line.find('#'); hash != std::string::npos) line.erase(hash);
+        std::istringstream in(line);
+        std::string key;
+        if (!(in >> key)) continue;
+
+        auto fail = [&](const std::string& what) {
+            return std::runtime_error(filename + ":" + std::to_string(line_no) + ": " + what);
+        };
+        Job& target = jobs.empty() ? defaults : jobs.back();
+
+        if (key == "job") {
+            Job job = defaults;
+            job.poses.clear();
+            if (!(in >> job.model_path)) throw fail("job needs a model path");
+            in >> job.texture_path;
+            jobs.push_back(std::move(job));
+        } else if (key == "size") {
+            if (!(in >> target.width >> target.height) || target.width <= 0 || target.height <= 0)
+                throw fail("size needs a positive width and height");
+        } else if (key == "fov") {
+            if (!(in >> target.fov) || target.fov <= 0 || target.fov >= 180) throw fail("fov needs degrees in (0, 180)");
+        } else if (key == "clip") {
+            if (!(in >> target.near_plane >> target.far_plane) || target.near_plane <= 0 ||
+                target.far_plane <= target.near_plane)
+                throw fail("clip needs 0 < near < far");
+        } else if (key == "video") {
+            if (jobs.empty()) throw fail("video before the first job");
+            std::getline(in >> std::ws, target.video);
+            if (target.video.empty()) throw fail("video needs a file or '| command'");
+        } else if (key == "shm") {
+            if (jobs.empty()) throw fail("shm before the first job");
+            if (!(in >> target.shm_name)) throw fail("shm needs a name");
+            int slots = 0;
+            if (in >> slots) {
+                if (slots < 2) throw fail("shm needs at least 2 slots");
+                target.shm_slots = slots;
+            }
+        } else if (key == "fps") {
+            if (!(in >> target.fps) || target.fps <= 0) throw fail("fps needs a positive number");
+        } else if (key == "up") {
+            if (!(in >> target.up.x >> target.up.y >> target.up.z)) throw fail("up needs three numbers");
+        } else if (key == "pose") {
+            if (jobs.empty()) throw fail("pose before the first job");
+            Pose pose;
+            if (!(in >> pose.eye.x >> pose.eye.y >> pose.eye.z >> pose.target.x >> pose.target.y >> pose.target.z))
+                throw fail("pose needs six numbers");
+            target.poses.push_back(pose);
+        } else if (key == "orbit") {
+            if (jobs.empty()) throw fail("orbit before the first job");
+            int count = 0;
+            float radius = 0, height = 0;
+            if (!(in >> count >> radius >> height) || count <= 0) throw fail("orbit needs count, radius and height");
+            for (int i = 0; i < count; ++i) {
+                float a = 2.f * static_cast<float>(PI) * i / count;
+                target.poses.push_back({ vec3(radius * std::sin(a), height, radius * std::cos(a)), vec3(0, 0, 0) });
+            }
+        } else {
+            throw fail("unknown directive '" + key + "'");
+        }
+    }
+    for (const auto& job : jobs) {
+        if (job.poses.empty()) throw std::runtime_error(filename + ": job " + job.model_path + " has no poses");
+    }
+    return jobs;
+}
+
+// Counters of a job, per image.
+void printRasterStats(const RasterStats& s, size_t images, int max_overdraw) {
+    const double n = static_cast<double>(images);
+    std::cout << "  triangles " << s.triangles / n << " (culled: depth " << s.depth_culled / n << ", offscreen "
+              << s.offscreen_culled / n << ", zero area " << s.zero_area / n << "; backfacing " << s.backfacing / n << ")\n"
+              << "  pixels: bbox " << s.bbox_pixels / n << ", covered " << s.covered_pixels / n << " ("
+              << (s.bbox_pixels ? 100.0 * s.covered_pixels / s.bbox_pixels : 0.0) << "% of bbox), depth passed "
+              << s.depth_passed / n << ", failed " << s.depth_failed / n << ", texture fetches "
+              << s.texture_fetches / n << ", max overdraw " << max_overdraw << std::endl;
+}
+
+double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A job's assets, resolved by its load step for its render step.
+struct JobAssets {
+    assets::ModelHandle model;
+    assets::TextureHandle texture;
+    texture::MaterialTextures material_textures;
+    std::vector<DrawBatch> draw_batches;
+};
+
+// Waits for the job's model and texture and builds its draw batches. A job
+// whose assets cannot be resolved fails on its own: its poses are counted as
+// failed and the model is left empty, which its render step skips.
+JobAssets loadJob(size_t index, const Job& job, assets::AssetManager& asset_manager,
+                  std::shared_future<assets::ModelHandle> model_future,
+                  std::shared_future<assets::TextureHandle> texture_future, texture::Format texture_format,
+                  JobResult& result) {
+    JobAssets loaded;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        loaded.model = model_future.get();
+        loaded.texture = texture_future.valid() ? texture_future.get() : nullptr;
+        const model::Model& render_model = *loaded.model;
+        if (loaded.texture) {
+            loaded.draw_batches = { {loaded.texture->isLoaded ? loaded.texture.get() : nullptr,
+                                     vec3(255, 255, 255), 0, render_model.triangleCount()} };
+        } else if (render_model.isLoaded) {
+            // through the cache, so jobs on the same model share the decoded maps
+            loaded.material_textures = asset_manager.loadMaterialTextures(render_model, texture::Layout::Linear, texture_format);
+            loaded.draw_batches = buildDrawBatches(render_model, loaded.material_textures);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "job " << index << ": cannot load " << job.model_path << ": " << e.what() << std::endl;
+        loaded = {};
+        result.failed = job.poses.size();
+    }
+    result.load_ms = msSince(start);
+    return loaded;
+}
+
+void renderJob(size_t index, const Job& job, const JobAssets& loaded, const fs::path& output_dir,
+               const OutputOptions& output, JobResult& result) {
+    if (!loaded.model) return; // failed in loadJob
+    const model::Model& render_model = *loaded.model;
+    const std::vector<DrawBatch>& draw_batches = loaded.draw_batches;
+    if (!render_model.isLoaded) {
+        std::cerr << "job " << index << ": cannot load model " << job.model_path << std::endl;
+        result.failed = job.poses.size();
+        return;
+    }
+
+    // video frames are converted to YUV from the packed layout with SIMD
+    Picture image(job.width, job.height, job.video.empty() ? PictureFormat::RGB8 : PictureFormat::RGBA8);
+    Matrix depthBuffer(job.height, job.width);
+    TileMask coverage;           // only what the previous pose drew is cleared
+    RasterDiagnostics diagnostics;
+    diagnostics.capture_overdraw = output.overdraw;
+    RasterDiagnostics* diag = output.stats || output.overdraw ? &diagnostics : nullptr;
+    std::vector<vec4> clip_vertices;
+    const Matrix projection = getPerspectiveMatrix(job.fov * static_cast<float>(PI) / 180.f,
+                                                   static_cast<float>(job.width) / job.height,
+                                                   job.near_plane, job.far_plane);
+    const std::string stem = "job" + std::to_string(index) + "_" + fs::path(job.model_path).stem().string();
+
+    imageio::FrameSink video;
+    if (!job.video.empty()) {
+        video = job.video[0] == '|'
+            ? imageio::FrameSink::openCommand(job.video.substr(1), imageio::StreamFormat::Y4M, job.fps)
+            : imageio::FrameSink::openFile((output_dir / job.video).string(), imageio::StreamFormat::Y4M, job.fps);
+        if (!video.good()) {
+            std::cerr << "job " << index << ": cannot open video output " << job.video << std::endl;
+            result.failed = job.poses.size();
+            return;
+        }
+    }
+
+#ifndef _WIN32
+    std::unique_ptr<shm::FrameRingProducer> ring;
+    if (!job.shm_name.empty()) {
+        try {
+            ring = std::make_unique<shm::FrameRingProducer>(job.shm_name, job.width, job.height,
+                                                            PictureFormat::RGBA8, job.shm_slots);
+        } catch (const std::exception& e) {
+            std::cerr << "job " << index << ": " << e.what() << std::endl;
+            result.failed = job.poses.size();
+            return;
+        }
+    }
+#endif
+
+    // accumulated after each render; the heat map goes out with the pose's image
+    auto collect = [&](size_t p) {
+        if (!diag) return;
+        result.raster += diagnostics.stats;
+        result.max_overdraw = std::max<int>(result.max_overdraw, diagnostics.maxOverdraw());
+        if (!output.overdraw) return;
+        char suffix[48]; // fits any size_t pose index
+        std::snprintf(suffix, sizeof(suffix), "_%03zu_overdraw.png", p);
+        if (!imageio::writePNG(diagnostics.heatMap(8), (output_dir / (stem + suffix)).string(), output.png))
+            std::cerr << "job " << index << ": cannot write overdraw map" << std::endl;
+    };
+
+    for (size_t p = 0; p < job.poses.size(); ++p) {
+        auto render_start = std::chrono::steady_clock::now();
+        Matrix MVP = projection * getViewMatrix(job.poses[p].eye, job.poses[p].target, job.up);
+        model::transformModel(render_model, MVP, clip_vertices);
+#ifndef _WIN32
+        if (ring) {
+            // consumers read the slot in place, nothing is copied
+            Picture& target = ring->beginFrame();
+            render(render_model, clip_vertices, draw_batches, target, depthBuffer, &ring->coverage(), diag);
+            ring->endFrame();
+            result.render_ms += msSince(render_start);
+            collect(p);
+            ++result.images;
+            PROFILE_FRAME();
+            continue;
+        }
+#endif
+        render(render_model, clip_vertices, draw_batches, image, depthBuffer, &coverage, diag);
+        result.render_ms += msSince(render_start);
+        collect(p);
+
+        auto write_start = std::chrono::steady_clock::now();
+        // once the stream has failed the remaining poses fail too rather
+        // than switching to image files
+        if (!job.video.empty()) {
+            if (video.write(image)) ++result.images;
+            else ++result.failed;
+            result.write_ms += msSince(write_start);
+            PROFILE_FRAME();
+            continue;
+        }
+        char suffix[48]; // fits any size_t pose index
+        std::snprintf(suffix, sizeof(suffix), "_%03zu.%s", p, output.ppm ? "ppm" : "png");
+        const fs::path out = output_dir / (stem + suffix);
+        const bool written = output.ppm ? imageio::writePPM(image, out.string())
+                                        : imageio::writePNG(image, out.string(), output.png);
+        if (written) {
+            ++result.images;
+        } else {
+            ++result.failed;
+            std::cerr << "job " << index << ": cannot write " << out.string() << std::endl;
+        }
+        result.write_ms += msSince(write_start);
+        PROFILE_FRAME();
+    }
+    if (!job.video.empty() && !video.close()) {
+        std::cerr << "job " << index << ": video output " << job.video << " failed" << std::endl;
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string job_file;
+    fs::path output_dir = ".";
+    unsigned concurrent = std::max(1u, std::thread::hardware_concurrency());
+    OutputOptions output;
+    std::string trace_path;
+    bool counters = false;
+    texture::Format texture_format = texture::Format::RGBA8;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) output_dir = argv[++i];
+        else if (arg == "-j" && i + 1 < argc) concurrent = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+        else if (arg == "--ppm") output.ppm = true;
+        else if (arg == "--png-level" && i + 1 < argc) output.png.level = std::stoi(argv[++i]);
+        else if (arg == "--trace" && i + 1 < argc) trace_path = argv[++i];
+        else if (arg == "--counters") counters = true;
+        else if (arg == "--stats") output.stats = true;
+        else if (arg == "--overdraw") output.overdraw = true;
+        else if (arg == "--compress" && i + 1 < argc) {
+            if (!texture::parseFormat(argv[++i], texture_format)) {
+                std::cerr << "unknown texture format " << argv[i] << " (rgba8, bc1 or bc7)" << std::endl;
+                return 2;
+            }
+        }
+        else job_file = arg;
+    }
+    if (job_file.empty()) {
+        std::cerr << "usage: render_batch <job file> [-o output_dir] [-j concurrent_jobs] [--ppm] [--png-level 0-9]"
+                     " [--stats] [--overdraw] [--compress bc1|bc7]" << std::endl;
+        return 2;
+    }
+
+    std::vector<Job> jobs;
+    try {
+        jobs = parseJobFile(job_file);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    std::error_code ec;
+    fs::create_directories(output_dir, ec);
+#ifndef _WIN32
+    // a video command that exits early fails its job's stream (EPIPE)
+    // instead of killing the whole batch
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+#ifdef RENDER_PROFILE
+    if (concurrent > 1) {
+        std::cerr << "profiling: running one job at a time so every profiler frame is one image" << std::endl;
+        concurrent = 1;
+    }
+    std::string counter_error;
+    if (counters && !profiler::Profiler::instance().enableCounters(&counter_error)) {
+        std::cerr << "hardware counters unavailable: " << counter_error << std::endl;
+        counters = false;
+    }
+#else
+    if (!trace_path.empty()) {
+        std::cerr << "--trace needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return 2;
+    }
+    if (counters) {
+        std::cerr << "--counters needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return 2;
+    }
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+
+    // every load is queued up front on the asset manager's pool; jobs wait
+    // for their own assets on a separate pool so a blocked job never holds
+    // a loader thread
+    assets::AssetManager asset_manager;
+    std::vector<std::shared_future<assets::ModelHandle>> models;
+    std::vector<std::shared_future<assets::TextureHandle>> textures;
+    for (const auto& job : jobs) {
+        models.push_back(asset_manager.loadModelAsync(job.model_path));
+        textures.push_back(job.texture_path.empty() ? std::shared_future<assets::TextureHandle>()
+                                                    : asset_manager.loadTextureAsync(job.texture_path, texture::Layout::Linear,
+                                                                                     texture_format));
+    }
+
+    // every job is a load step, which waits for its assets, and a render
+    // step that depends on it; the worker finishing a load usually takes the
+    // render next, from the back of its own deque
+    std::vector<JobResult> results(jobs.size());
+    std::vector<JobAssets> loaded(jobs.size());
+    std::vector<JobCounter> loads(jobs.size());
+    JobCounter rendered;
+    ThreadPool job_pool(concurrent - 1);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        job_pool.run([&, i] {
+            loaded[i] = loadJob(i, jobs[i], asset_manager, models[i], textures[i], texture_format, results[i]);
+        }, &loads[i]);
+        job_pool.runAfter(loads[i], [&, i] {
+            try {
+                renderJob(i, jobs[i], loaded[i], output_dir, output, results[i]);
+            } catch (const std::exception& e) {
+                std::cerr << "job " << i << ": " << e.what() << std::endl;
+                results[i].failed = jobs[i].poses.size() - results[i].images;
+            }
+            loaded[i] = {};
+        }, &rendered);
+    }
+    job_pool.wait(rendered);
+
+    const double wall_s = msSince(start) / 1000.0;
+    JobResult total;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const JobResult& r = results[i];
+        std::cout << "job " << i << " " << jobs[i].model_path << ": " << r.images << " images, load "
+                  << r.load_ms << "ms, render " << r.render_ms << "ms, write " << r.write_ms << "ms" << std::endl;
+        if (output.stats && r.images > 0) printRasterStats(r.raster, r.images, r.max_overdraw);
+        total.images += r.images;
+        total.failed += r.failed;
+        total.load_ms += r.load_ms;
+        total.render_ms += r.render_ms;
+        total.write_ms += r.write_ms;
+    }
+    std::cout << total.images << " images in " << wall_s << "s with " << concurrent << " concurrent jobs: "
+              << total.images / wall_s << " images/s";
+    if (total.render_ms > 0) std::cout << " (" << total.images * 1000.0 / total.render_ms << " images/s per job thread rendering)";
+    std::cout << std::endl;
+    if (total.failed > 0) std::cout << total.failed << " images failed" << std::endl;
+    if (output.stats) {
+        if (job_pool.size() > 0) std::cout << "job pool\n" << job_pool.statsReport();
+        std::cout << "render pool\n" << defaultThreadPool().statsReport();
+    }
+#ifdef RENDER_PROFILE
+    std::cout << profiler::Profiler::instance().report();
+    if (counters) std::cout << profiler::Profiler::instance().counterReport();
+    if (!trace_path.empty() && !profiler::Profiler::instance().writeChromeTrace(trace_path))
+        std::cerr << "cannot write trace " << trace_path << std::endl;
+#endif
+    return total.failed > 0 ? 1 : 0;
+}
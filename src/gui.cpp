@@ -1,19 +1,90 @@
 ﻿#include "gui.h"
 #include "raylib.h"
 #include "graph.h"
+#include "dirty.h"
+#include "profiler.h"
 #include <cmath>
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
 
 class RaylibPictureRendererImpl {
 public:
+    enum class BufferState { Free, Acquired, Front };
+
     int screenWidth = 0;
     int screenHeight = 0;
     std::string title;
-    Picture localPic;
     ::Texture2D texture = { 0 };
     bool initialized = false;
 
+    std::vector<Picture> buffers;
+    std::vector<TileMask> coverage;
+    std::vector<BufferState> states;
+    DirtyTracker dirty;
+    std::vector<uint8_t> staging;
+    int front = -1;
+    std::mutex mutex;
+    std::condition_variable bufferFreed;
+
+    bool createTexture(const void* pixels, int width, int height, int channels) {
+        if (channels != 3 && channels != 4) {
+            ::TraceLog(::LOG_ERROR, "Only 3 or 4 channel images supported");
+            return false;
+        }
+
+        ::PixelFormat format = (channels == 3)
+            ? ::PIXELFORMAT_UNCOMPRESSED_R8G8B8
+            : ::PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+
+        ::Image image = {
+            const_cast<void*>(pixels),
+            width,
+            height,
+            1,
+            format
+        };
+
+        texture = ::LoadTextureFromImage(image);
+        if (texture.id == 0) {
+            ::TraceLog(::LOG_ERROR, "Failed to load texture");
+            return false;
+        }
+
+        ::SetTextureFilter(texture, ::TEXTURE_FILTER_BILINEAR);
+        return true;
+    }
+
+    // Uploads the rectangles of an RGBA8 picture. Full-width rectangles are
+    // contiguous in the picture; narrower ones go through a staging copy.
+    size_t uploadRects(const Picture& pic, const std::vector<TileRect>& rects) {
+        size_t bytes = 0;
+        for (const TileRect& r : rects) {
+            const size_t row_bytes = static_cast<size_t>(r.width) * 4;
+            const void* pixels = pic.row_ptr(r.y) + static_cast<size_t>(r.x) * 4;
+            if (r.width != pic.width()) {
+                staging.resize(row_bytes * r.height);
+                for (int y = 0; y < r.height; ++y) {
+                    std::memcpy(staging.data() + y * row_bytes, pic.row_ptr(r.y + y) + static_cast<size_t>(r.x) * 4, row_bytes);
+                }
+                pixels = staging.data();
+            }
+            ::UpdateTextureRec(texture, { static_cast<float>(r.x), static_cast<float>(r.y),
+                                          static_cast<float>(r.width), static_cast<float>(r.height) }, pixels);
+            bytes += row_bytes * r.height;
+        }
+        return bytes;
+    }
+
+    void openWindow() {
+        if (initialized) cleanup();
+        ::InitWindow(screenWidth, screenHeight, title.c_str());
+        ::SetTargetFPS(60);
+    }
+
     void cleanup() {
         if (initialized) {
             if (texture.id != 0) {
@@ -40,54 +111,119 @@ RaylibPictureRenderer& RaylibPictureRenderer::operator=(RaylibPictureRenderer&&)
 
 bool RaylibPictureRenderer::initialize(const Picture& pic) {
     auto& impl = *pImpl;
-    if (impl.initialized) impl.cleanup();
+    impl.openWindow();
 
-    impl.localPic = pic;
+    // raylib has no BGRA upload format, so BGRA pictures are uploaded as RGB
+    bool ok = pic.format() == PictureFormat::BGRA8
+        ? impl.createTexture(pic.toRGB().data(), pic.width(), pic.height(), 3)
+        : impl.createTexture(pic.data(), pic.width(), pic.height(), pic.channels());
+    impl.initialized = ok;
+    return ok;
+}
 
-    ::InitWindow(impl.screenWidth, impl.screenHeight, impl.title.c_str());
-    ::SetTargetFPS(60);
+void RaylibPictureRenderer::updateTexture(const Picture& pic) {
+    auto& impl = *pImpl;
+    if (!impl.initialized) return;
 
-    if (impl.localPic.channels() != 3 && impl.localPic.channels() != 4) {
-        ::TraceLog(::LOG_ERROR, "Only 3 or 4 channel images supported");
-        return false;
+    const int channels = pic.format() == PictureFormat::BGRA8 ? 3 : pic.channels();
+    const int textureChannels = impl.texture.format == ::PIXELFORMAT_UNCOMPRESSED_R8G8B8 ? 3 : 4;
+    if (pic.width() != impl.texture.width ||
+        pic.height() != impl.texture.height ||
+        channels != textureChannels) {
+        initialize(pic);
+        return;
     }
 
-    ::PixelFormat format = (impl.localPic.channels() == 3)
-        ? ::PIXELFORMAT_UNCOMPRESSED_R8G8B8
-        : ::PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-
-    ::Image image = {
-        impl.localPic.data(),
-        static_cast<int>(impl.localPic.width()),
-        static_cast<int>(impl.localPic.height()),
-        1,
-        format
-    };
-
-    impl.texture = ::LoadTextureFromImage(image);
-    if (impl.texture.id == 0) {
-        ::TraceLog(::LOG_ERROR, "Failed to load texture");
-        return false;
+    if (pic.format() == PictureFormat::BGRA8) ::UpdateTexture(impl.texture, pic.toRGB().data());
+    else ::UpdateTexture(impl.texture, pic.data());
+}
+
+bool RaylibPictureRenderer::initializeSwapChain(int width, int height, int bufferCount) {
+    auto& impl = *pImpl;
+    {
+        std::lock_guard lock(impl.mutex);
+        impl.buffers.clear();
+        impl.coverage.clear();
+        for (int i = 0; i < std::max(bufferCount, 2); ++i) {
+            impl.buffers.emplace_back(width, height, PictureFormat::RGBA8);
+            impl.buffers.back().fill32(0xFF000000u);
+            impl.coverage.emplace_back();
+        }
+        impl.dirty.invalidate();
+        impl.states.assign(impl.buffers.size(), RaylibPictureRendererImpl::BufferState::Free);
+        impl.front = -1;
     }
+    impl.bufferFreed.notify_all();
 
-    ::SetTextureFilter(impl.texture, ::TEXTURE_FILTER_BILINEAR);
-    impl.initialized = true;
-    return true;
+    impl.openWindow();
+    impl.initialized = impl.createTexture(impl.buffers[0].data(), width, height, 4);
+    return impl.initialized;
 }
 
-void RaylibPictureRenderer::updateTexture(const Picture& pic) {
+int RaylibPictureRenderer::acquireBackBuffer() {
+    using State = RaylibPictureRendererImpl::BufferState;
     auto& impl = *pImpl;
-    if (!impl.initialized) return;
+    std::unique_lock lock(impl.mutex);
+    int index = -1;
+    impl.bufferFreed.wait(lock, [&] {
+        for (size_t i = 0; i < impl.states.size(); ++i) {
+            if (impl.states[i] == State::Free) {
+                index = static_cast<int>(i);
+                return true;
+            }
+        }
+        return impl.states.empty();
+    });
+    if (index >= 0) impl.states[index] = State::Acquired;
+    return index;
+}
 
-    if (pic.width() != impl.localPic.width() ||
-        pic.height() != impl.localPic.height() ||
-        pic.channels() != impl.localPic.channels()) {
-        initialize(pic);
-        return;
+Picture& RaylibPictureRenderer::buffer(int index) {
+    return pImpl->buffers.at(index);
+}
+
+TileMask& RaylibPictureRenderer::coverage(int index) {
+    return pImpl->coverage.at(index);
+}
+
+size_t RaylibPictureRenderer::present(int index) {
+    using State = RaylibPictureRendererImpl::BufferState;
+    auto& impl = *pImpl;
+    size_t bytes = 0;
+    if (impl.initialized) {
+        PROFILE_ZONE("upload");
+        const Picture& pic = impl.buffers.at(index);
+        const TileMask& coverage = impl.coverage.at(index);
+        if (coverage.matches(pic)) {
+            bytes = impl.uploadRects(pic, impl.dirty.update(coverage).rects());
+        } else {
+            // rendered without coverage: nothing is known, upload everything
+            ::UpdateTexture(impl.texture, pic.data());
+            impl.dirty.invalidate();
+            bytes = static_cast<size_t>(pic.width()) * pic.height() * 4;
+        }
+    }
+    {
+        std::lock_guard lock(impl.mutex);
+        if (impl.front >= 0) impl.states[impl.front] = State::Free;
+        impl.states[index] = State::Front;
+        impl.front = index;
     }
+    impl.bufferFreed.notify_one();
+    return bytes;
+}
+
+void RaylibPictureRenderer::releaseBackBuffer(int index) {
+    auto& impl = *pImpl;
+    {
+        std::lock_guard lock(impl.mutex);
+        impl.states.at(index) = RaylibPictureRendererImpl::BufferState::Free;
+    }
+    impl.bufferFreed.notify_one();
+}
 
-    impl.localPic = pic;
-    ::UpdateTexture(impl.texture, impl.localPic.data());
+int RaylibPictureRenderer::bufferCount() const {
+    return static_cast<int>(pImpl->buffers.size());
 }
 
 void RaylibPictureRenderer::draw() {
@@ -98,11 +234,11 @@ void RaylibPictureRenderer::draw() {
     ::ClearBackground(::BLACK);
 
     float scale = std::fminf(
-        static_cast<float>(impl.screenWidth) / impl.localPic.width(),
-        static_cast<float>(impl.screenHeight) / impl.localPic.height()
+        static_cast<float>(impl.screenWidth) / impl.texture.width,
+        static_cast<float>(impl.screenHeight) / impl.texture.height
     );
-    int renderWidth = static_cast<int>(impl.localPic.width() * scale);
-    int renderHeight = static_cast<int>(impl.localPic.height() * scale);
+    int renderWidth = static_cast<int>(impl.texture.width * scale);
+    int renderHeight = static_cast<int>(impl.texture.height * scale);
     int posX = (impl.screenWidth - renderWidth) / 2;
     int posY = (impl.screenHeight - renderHeight) / 2;
 
@@ -7,6 +7,9 @@
 #include "model.h"
 #include "gui.h"
 #include "inputmanger.h"
+#include "assets.h"
+#include "pipeline.h"
+#include "profiler.h"
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -56,67 +59,158 @@ int main(int argc, char* argv[]){
 
     }
 
-    model::Model render_model = model::loadModel(model_path);
-    texture::Texture render_texture = texture::loadTexture(texture_path);
+    // --compact loads the quantized representation as its own cache entry;
+    // the cached model is shared and never modified afterwards.
+    // --compress bc1|bc7 samples the textures as blocks, encoded at load.
+    bool compact = false;
+    texture::Format texture_format = texture::Format::RGBA8;
+    for (int i = 2; i < argc; ++i) {
+        if (std::string(argv[i]) == "--compact") compact = true;
+        if (std::string(argv[i]) == "--compress" && i + 1 < argc && !texture::parseFormat(argv[++i], texture_format)) {
+            std::cerr << "unknown texture format " << argv[i] << " (rgba8, bc1 or bc7)" << std::endl;
+            return -1;
+        }
+    }
+
+    // model and texture decode concurrently on the asset manager's workers
+    assets::AssetManager asset_manager;
+    auto model_future = asset_manager.loadModelAsync(model_path, compact);
+    std::shared_future<assets::TextureHandle> texture_future;
+    if (!texture_path.empty()) texture_future = asset_manager.loadTextureAsync(texture_path, texture::Layout::Linear, texture_format);
+
+    assets::ModelHandle model_handle = model_future.get();
+    const model::Model& render_model = *model_handle;
+
+    // without an explicit texture, draw with the textures named by the .mtl files
+    std::vector<DrawBatch> draw_batches;
+    texture::MaterialTextures material_textures;
+    assets::TextureHandle render_texture;
+    if (texture_future.valid()) {
+        render_texture = texture_future.get();
+        draw_batches = { {render_texture->isLoaded ? render_texture.get() : nullptr,
+                          vec3(255, 255, 255), 0, render_model.triangleCount()} };
+    } else {
+        material_textures = asset_manager.loadMaterialTextures(render_model, texture::Layout::Linear, texture_format);
+        draw_batches = buildDrawBatches(render_model, material_textures);
+    }
 
     WindowsInputManager inputManager(GetConsoleWindow());
     Camera camera((float)PI/2.f, (float)SCREEN_WIDTH/(float)SCREEN_HEIGHT, 1.f, 20.0f, 
                  vec3(0,0,4), vec3(0,0,0), vec3(0,-1,0));
 
-    Picture image(SCREEN_WIDTH, SCREEN_HEIGHT, 3);
     Matrix depthBuffer(SCREEN_HEIGHT, SCREEN_WIDTH);
+    std::vector<vec4> clip_vertices;
+
+    // --throughput lets the render thread run ahead by a frame; the default
+    // latency mode only overlaps rendering frame N+1 with presenting frame N
+    PipelineMode mode = PipelineMode::Latency;
+    // --trace <file> writes the profiler's Chrome trace on exit, --counters
+    // adds hardware counters per zone (RENDER_PROFILE builds)
+    std::string trace_path;
+    bool counters = false;
+    // --record <file> writes the camera input of this session, --replay <file>
+    // flies the recorded path at its fixed timestep and exits at its end
+    std::string record_path, replay_path;
+    for (int i = 2; i < argc; ++i) {
+        if (std::string(argv[i]) == "--throughput") mode = PipelineMode::Throughput;
+        if (std::string(argv[i]) == "--trace" && i + 1 < argc) trace_path = argv[++i];
+        if (std::string(argv[i]) == "--counters") counters = true;
+        if (std::string(argv[i]) == "--record" && i + 1 < argc) record_path = argv[++i];
+        if (std::string(argv[i]) == "--replay" && i + 1 < argc) replay_path = argv[++i];
+    }
+    InputSource* input = &inputManager;
+    std::unique_ptr<InputRecorder> recorder;
+    std::unique_ptr<InputPlayer> player;
+    try {
+        if (!replay_path.empty()) input = (player = std::make_unique<InputPlayer>(replay_path)).get();
+        else if (!record_path.empty()) input = (recorder = std::make_unique<InputRecorder>(inputManager, record_path)).get();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+#ifdef RENDER_PROFILE
+    std::string counter_error;
+    if (counters && !profiler::Profiler::instance().enableCounters(&counter_error)) {
+        std::cerr << "hardware counters unavailable: " << counter_error << std::endl;
+        counters = false;
+    }
+#else
+    if (!trace_path.empty()) {
+        std::cerr << "--trace needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return -1;
+    }
+    if (counters) {
+        std::cerr << "--counters needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return -1;
+    }
+#endif
 
     RaylibPictureRenderer viewer(SCREEN_WIDTH, SCREEN_HEIGHT, "Raylib Picture Viewer");
-    viewer.initialize(image);
+    viewer.initializeSwapChain(SCREEN_WIDTH, SCREEN_HEIGHT, mode == PipelineMode::Latency ? 2 : 3);
 
     RenderTimer timer(60);
-    std::vector<vec4> transfromed_vertices(render_model.transfromed_vertices.size());
-    Matrix vertex(4,1);
-
-    bool running = true;
-    while(running){
-        timer.tick();
-
-        auto dt = timer.getDeltaTime();
-        auto tt = timer.getTotalTime();
-
-        Matrix View = camera.view_matrix();
-        Matrix Perspective = camera.perspective_matrix();
-        Matrix MVP = Perspective * View;
-        
-
-        //for(int i=0; i<render_model.vertices.size(); i++){
-        //    
-        //    vertex(0,0) = render_model.vertices[i].x;
-        //    vertex(1,0) = render_model.vertices[i].y;
-        //    vertex(2,0) = render_model.vertices[i].z;
-        //    vertex(3,0) = 1.0f;
-
-        //    Matrix transformed = MVP * vertex;
-        //    float w = transformed(3,0);
-        //    render_model.transfromed_vertices[i] = vec4(
-        //    transformed(0,0),
-        //    transformed(1,0),
-        //    transformed(2,0),
-        //    transformed(3,0)
-        //    );
-        //}
-
-         transform_batch_aos(render_model.transfromed_vertices.data(),MVP.data().data(),
-         render_model.mesh.x.data(),render_model.mesh.y.data(),render_model.mesh.z.data(),
-         render_model.mesh.x.size());
-        
-
-        render(render_model, render_texture, image, depthBuffer);
-
-        inputManager.update();
-        camera.update(inputManager, dt);
-
-        viewer.updateTexture(image);
-        viewer.draw();
-
-        timer.waitIfNeeded();
+
+    // transform and rasterization run on the pipeline's render thread, the
+    // window (and raylib) stays on this one
+    FramePipeline<RaylibPictureRenderer> pipeline(viewer, mode);
+    pipeline.start([&](Picture& target, FrameTimings& timings) {
+        Matrix MVP(4, 4);
+        if (timings.frame == 0) PROFILE_THREAD("render");
+        timeStage(timings.update_ms, [&] {
+            PROFILE_ZONE("update");
+            timer.tick();
+            input->update();
+            camera.update(*input, player ? static_cast<float>(player->timestep()) : timer.getDeltaTime());
+            MVP = camera.perspective_matrix() * camera.view_matrix();
+        });
+        timeStage(timings.transform_ms, [&] { model::transformModel(render_model, MVP, clip_vertices); });
+        // the buffer's coverage limits the clear here and the upload in present()
+        timeStage(timings.raster_ms, [&] {
+            render(render_model, clip_vertices, draw_batches, target, depthBuffer, &viewer.coverage(timings.buffer));
+        });
+        // the frame of the last replay step is still presented
+        return !(player && player->finished());
+    });
+
+    auto printStats = [&] {
+        PipelineStats s = pipeline.stats();
+        std::cout << "frames " << s.frames << ", " << s.fps << " fps, latency " << s.latency_ms << "ms"
+                  << " | update " << s.update_ms << " transform " << s.transform_ms
+                  << " raster " << s.raster_ms << " present " << s.present_ms << "ms"
+                  << " | upload " << s.upload_bytes / 1024.0 << " KiB/frame"
+                  << " | render busy " << s.render_busy * 100 << "% present busy " << s.present_busy * 100
+                  << "% overlap " << s.overlap * 100 << "%" << std::endl;
+    };
+
+    PROFILE_THREAD("present");
+    while (!viewer.shouldClose()) {
+        auto frame = pipeline.nextFrame();
+        if (!frame) break;
+        timeStage(frame->present_ms, [&] {
+            PROFILE_ZONE("present");
+            frame->upload_bytes = viewer.present(frame->buffer);
+            viewer.draw();
+        });
+        pipeline.presented(*frame);
+        PROFILE_FRAME();
+
+        if (frame->frame % 120 == 119) {
+            printStats();
+#ifdef RENDER_PROFILE
+            std::cout << profiler::Profiler::instance().report();
+            if (counters) std::cout << profiler::Profiler::instance().counterReport();
+#endif
+        }
+    }
+    pipeline.stop();
+    if (player) {
+        std::cout << "replay finished: ";
+        printStats();
     }
+#ifdef RENDER_PROFILE
+    if (!trace_path.empty() && !profiler::Profiler::instance().writeChromeTrace(trace_path))
+        std::cerr << "cannot write trace " << trace_path << std::endl;
+#endif
     system("pause");
     return 0;
 
@@ -0,0 +1,335 @@
+﻿#include "linear.h"
+#include "graph.h"
+#include "render.h"
+#include "model.h"
+#include "assets.h"
+#include "shmring.h"
+#include "terminal.h"
+#include "camera.h"
+#include "input.h"
+#include "profiler.h"
+#include "timer.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <thread>
+#include <poll.h>
+#include <termios.h>
+
+// Terminal viewer for headless (SSH) sessions: renders a model, or shows the
+// frames of a shared-memory ring, as half-block characters.
+//
+//   render_term <model.obj> [texture.png] [--256] [--scale N] [--fps N] [--pacing mode]
+//               [--compress bc1|bc7]
+//   render_term --shm <ring name> [--256] [--fps N]
+//   render_term <model.obj> [texture.png] --record <input.txt> | --replay <input.txt>
+//
+// RENDER_PROFILE builds print the zone summary on exit; --trace <file> also
+// writes a Chrome trace and --counters adds hardware counters per zone.
+//
+// Keys: a/d orbit, w/s zoom, r redraw, q quits. --256 uses the xterm palette
+// for terminals without truecolor; --scale renders N x N pixels per cell
+// half (default 2) which the presenter averages down. --pacing spin|hybrid|
+// sleep picks how frames wait for their slot (see PacingMode); the pacing
+// error statistics are printed on exit. --compress samples the textures as
+// BC1 or BC7 blocks, encoded at load.
+//
+// --record and --replay switch to the viewer's fly camera: w/s/a/d move, e/c
+// up and down, i/j/k/l look, capitals sprint, r resets. --record writes the
+// camera input, --replay flies a recording (also one made by the viewer) at
+// its fixed timestep without reading keys, then prints the frame times.
+
+namespace {
+
+volatile std::sig_atomic_t g_resized = 0;
+volatile std::sig_atomic_t g_quit = 0;
+
+// Puts stdin into non-canonical no-echo mode for the lifetime of the object.
+class RawInput {
+private:
+    termios saved_{};
+    bool active_ = false;
+
+public:
+    RawInput() {
+        if (!::isatty(STDIN_FILENO) || ::tcgetattr(STDIN_FILENO, &saved_) != 0) return;
+        termios raw = saved_;
+        raw.c_lflag &= ~static_cast<tcflag_t>(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        active_ = ::tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+    }
+    ~RawInput() {
+        if (active_) ::tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+    }
+
+    // Next pending key, 0 if none arrives within timeout_ms.
+    char poll(int timeout_ms) const {
+        pollfd pfd{ STDIN_FILENO, POLLIN, 0 };
+        if (::poll(&pfd, 1, timeout_ms) <= 0) return 0;
+        char c = 0;
+        return ::read(STDIN_FILENO, &c, 1) == 1 ? c : 0;
+    }
+};
+
+double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Camera keys from the terminal. Terminals report presses but no releases,
+// so a key is held for the frame after its press and auto-repeat keeps it
+// held; i/j/k/l stand in for the mouse.
+class TerminalKeys : public InputSource {
+private:
+    InputState pending_;
+
+protected:
+    InputState poll() override {
+        InputState s = pending_;
+        pending_ = {};
+        return s;
+    }
+
+public:
+    void press(char c) {
+        constexpr float kLook = 45.f;
+        if (std::isupper(static_cast<unsigned char>(c))) pending_.press(InputKey::Sprint);
+        switch (std::tolower(static_cast<unsigned char>(c))) {
+        case 'w': pending_.press(InputKey::Forward); break;
+        case 's': pending_.press(InputKey::Back); break;
+        case 'a': pending_.press(InputKey::Left); break;
+        case 'd': pending_.press(InputKey::Right); break;
+        case 'e': pending_.press(InputKey::Up); break;
+        case 'c': pending_.press(InputKey::Down); break;
+        case 'r': pending_.press(InputKey::Reset); break;
+        case 'i': pending_.mouse_dy -= kLook; break;
+        case 'k': pending_.mouse_dy += kLook; break;
+        case 'j': pending_.mouse_dx -= kLook; break;
+        case 'l': pending_.mouse_dx += kLook; break;
+        default: break;
+        }
+    }
+};
+
+std::string statusLine(const TerminalPresenter& presenter, double fps, double frame_ms, const char* keys) {
+    const TerminalStats& s = presenter.stats();
+    char text[192];
+    std::snprintf(text, sizeof(text), "%5.1f fps  %6.2f ms  %7zu B/frame  %5zu cells  %8.1f KiB total  %7.1f KiB read  [%s]",
+                  fps, frame_ms, s.last_bytes, s.last_changed, s.bytes / 1024.0, s.last_sampled / 1024.0, keys);
+    return text;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string model_path, texture_path, ring_name, trace_path, record_path, replay_path;
+    TerminalColor color = TerminalColor::TrueColor;
+    int scale = 2;
+    int max_fps = 30;
+    bool counters = false;
+    PacingOptions pacing;
+    texture::Format texture_format = texture::Format::RGBA8;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--256") color = TerminalColor::Palette256;
+        else if (arg == "--scale" && i + 1 < argc) scale = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--fps" && i + 1 < argc) max_fps = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--shm" && i + 1 < argc) ring_name = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc) trace_path = argv[++i];
+        else if (arg == "--counters") counters = true;
+        else if (arg == "--pacing" && i + 1 < argc) {
+            const std::string mode = argv[++i];
+            pacing.mode = mode == "spin" ? PacingMode::Spin : mode == "sleep" ? PacingMode::Sleep : PacingMode::Hybrid;
+        }
+        else if (arg == "--compress" && i + 1 < argc) {
+            if (!texture::parseFormat(argv[++i], texture_format)) {
+                std::cerr << "unknown texture format " << argv[i] << " (rgba8, bc1 or bc7)" << std::endl;
+                return 2;
+            }
+        }
+        else if (arg == "--record" && i + 1 < argc) record_path = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replay_path = argv[++i];
+        else if (model_path.empty()) model_path = arg;
+        else texture_path = arg;
+    }
+    if (model_path.empty() && ring_name.empty()) {
+        std::cerr << "usage: render_term <model.obj> [texture.png] [--256] [--scale N] [--fps N] [--pacing spin|hybrid|sleep]"
+                     " [--compress bc1|bc7]\n"
+                     "       render_term --shm <ring name> [--256] [--fps N]\n"
+                     "       render_term <model.obj> [texture.png] --record <input.txt> | --replay <input.txt>" << std::endl;
+        return 2;
+    }
+
+    std::unique_ptr<shm::FrameRingConsumer> ring;
+    assets::AssetManager asset_manager;
+    assets::ModelHandle model_handle;
+    assets::TextureHandle texture_handle;
+    std::vector<DrawBatch> draw_batches;
+    texture::MaterialTextures material_textures;
+    if (!ring_name.empty()) {
+        try {
+            ring = std::make_unique<shm::FrameRingConsumer>(ring_name);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        model_handle = asset_manager.loadModel(model_path);
+        if (!model_handle->isLoaded) {
+            std::cerr << "cannot load model " << model_path << std::endl;
+            return 1;
+        }
+        if (!texture_path.empty()) texture_handle = asset_manager.loadTexture(texture_path, texture::Layout::Linear, texture_format);
+        if (texture_handle) {
+            draw_batches = { {texture_handle->isLoaded ? texture_handle.get() : nullptr,
+                              vec3(255, 255, 255), 0, model_handle->triangleCount()} };
+        } else {
+            material_textures = asset_manager.loadMaterialTextures(*model_handle, texture::Layout::Linear, texture_format);
+            draw_batches = buildDrawBatches(*model_handle, material_textures);
+        }
+    }
+
+#ifdef RENDER_PROFILE
+    std::string counter_error;
+    if (counters && !profiler::Profiler::instance().enableCounters(&counter_error)) {
+        std::cerr << "hardware counters unavailable: " << counter_error << std::endl;
+        counters = false;
+    }
+#else
+    if (!trace_path.empty()) {
+        std::cerr << "--trace needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return 2;
+    }
+    if (counters) {
+        std::cerr << "--counters needs a RENDER_PROFILE build (cmake -DRENDER_PROFILE=ON)" << std::endl;
+        return 2;
+    }
+#endif
+
+    // fly camera driven by the terminal, a recording of it, or a replay
+    TerminalKeys keys;
+    std::unique_ptr<InputRecorder> recorder;
+    std::unique_ptr<InputPlayer> player;
+    InputSource* camera_input = nullptr;
+    try {
+        if (!replay_path.empty()) camera_input = (player = std::make_unique<InputPlayer>(replay_path)).get();
+        else if (!record_path.empty()) camera_input = (recorder = std::make_unique<InputRecorder>(keys, record_path)).get();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    Camera camera(60.f * static_cast<float>(PI) / 180.f, 1.f, 0.1f, 100.f);
+    std::vector<double> frame_times;
+    auto last_update = std::chrono::steady_clock::now();
+
+    RenderTimer timer(max_fps);
+    timer.setPacing(pacing);
+
+    std::signal(SIGWINCH, [](int) { g_resized = 1; });
+    std::signal(SIGINT, [](int) { g_quit = 1; });
+    RawInput input;
+
+    float yaw = 0.f, distance = 3.f;
+    bool running = true;
+    while (running && !g_quit) {
+        // the last terminal row holds the status line
+        auto [columns, lines] = terminalSize();
+        g_resized = 0;
+        TerminalPresenter presenter(columns, std::max(1, lines - 1), color);
+
+        const int width = columns * scale, height = presenter.rows() * 2 * scale;
+        Picture image(width, height, PictureFormat::RGBA8);
+        Matrix depthBuffer(height, width);
+        TileMask coverage;
+        DirtyTracker dirty;
+        uint64_t last_frame = 0;
+        std::vector<vec4> clip_vertices;
+        const Matrix projection = getPerspectiveMatrix(60.f * static_cast<float>(PI) / 180.f,
+                                                       static_cast<float>(width) / height, 0.1f, 100.f);
+
+        double fps = 0, frame_ms = 0;
+        auto fps_start = std::chrono::steady_clock::now();
+        int fps_frames = 0;
+        while (running && !g_quit && !g_resized) {
+            auto frame_start = std::chrono::steady_clock::now();
+            if (ring) {
+                if (auto frame = ring->latest()) {
+                    const bool consecutive = frame->number == last_frame + 1 && frame->dirty.matches(frame->picture);
+                    presenter.present(frame->picture, consecutive ? &frame->dirty : nullptr);
+                    last_frame = frame->number;
+                    if (!ring->stillValid(*frame)) {
+                        presenter.invalidate();
+                        last_frame = 0;
+                    }
+                }
+            } else {
+                Matrix MVP(4, 4);
+                if (camera_input) {
+                    if (player && player->finished()) break;
+                    camera_input->update();
+                    const auto now = std::chrono::steady_clock::now();
+                    const float dt = player ? static_cast<float>(player->timestep())
+                                            : std::min(0.8f, std::chrono::duration<float>(now - last_update).count());
+                    last_update = now;
+                    camera.update(*camera_input, dt);
+                    MVP = projection * camera.view_matrix();
+                } else {
+                    const vec3 eye(distance * std::sin(yaw), distance * 0.4f, distance * std::cos(yaw));
+                    MVP = projection * getViewMatrix(eye, vec3(0, 0, 0), vec3(0, 1, 0));
+                }
+                model::transformModel(*model_handle, MVP, clip_vertices);
+                render(*model_handle, clip_vertices, draw_batches, image, depthBuffer, &coverage);
+                presenter.present(image, &dirty.update(coverage));
+            }
+            frame_ms = msSince(frame_start);
+            if (player) frame_times.push_back(frame_ms);
+            ++fps_frames;
+            const double window_ms = msSince(fps_start);
+            if (window_ms >= 500) {
+                fps = fps_frames * 1000.0 / window_ms;
+                fps_frames = 0;
+                fps_start = std::chrono::steady_clock::now();
+            }
+            presenter.status(statusLine(presenter, fps, frame_ms,
+                                        player ? "replay, q" : camera_input ? "wsad ec ijkl r q" : "a/d w/s r q"));
+            PROFILE_FRAME();
+
+            timer.waitIfNeeded();
+            const char key = input.poll(0);
+            if (camera_input && key != 'q') {
+                if (!player) keys.press(key);
+                continue;
+            }
+            switch (key) {
+            case 'q': running = false; break;
+            case 'a': yaw -= 0.1f; break;
+            case 'd': yaw += 0.1f; break;
+            case 'w': distance = std::max(0.5f, distance * 0.9f); break;
+            case 's': distance *= 1.1f; break;
+            case 'r': presenter.invalidate(); break;
+            default: break;
+            }
+        }
+        if (player && player->finished()) break;
+    }
+    std::printf("%s\n", timer.getPacingStats().describe().c_str());
+    if (!frame_times.empty()) {
+        std::vector<double> sorted = frame_times;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double t : sorted) total += t;
+        auto pct = [&](double p) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))]; };
+        std::printf("replay: %zu frames, mean %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms\n", sorted.size(),
+                    total / sorted.size(), pct(0.5), pct(0.95), sorted.back());
+    }
+#ifdef RENDER_PROFILE
+    std::cout << profiler::Profiler::instance().report();
+    if (counters) std::cout << profiler::Profiler::instance().counterReport();
+    if (!trace_path.empty() && !profiler::Profiler::instance().writeChromeTrace(trace_path))
+        std::cerr << "cannot write trace " << trace_path << std::endl;
+#endif
+    return 0;
+}